@@ -0,0 +1,212 @@
+#!/usr/bin/python
+"""Generate large, valid programs in the subset of C that cici supports.
+
+The output only depends on the options, and especially the seed, so the same
+command always produces the same program. Loops always terminate, and functions
+only call earlier functions which make no calls themselves, so the programs
+can also be run in a reasonable time.
+"""
+import argparse
+import random
+import sys
+
+BINARY_OPS = ["+", "-", "*", "&", "|", "^", "==", "!="]
+UNARY_OPS = ["-", "~", "!"]
+MAX_PARAMS = 6
+
+
+class Function:
+    def __init__(self, name, params, leaf):
+        self.name = name
+        self.params = params
+        # Leaf functions make no calls, and are the only ones we call
+        self.leaf = leaf
+
+
+class Generator:
+    def __init__(self, rng, args):
+        self.rng = rng
+        self.args = args
+        self.functions = []
+        self.callees = []
+        self.can_call = False
+        self.lines = []
+        self.depth = 0
+        self.scopes = []
+        self.var_index = 0
+        self.loop_depth = 0
+        # Loop counters can be read, but never assigned
+        self.counters = set()
+
+    def emit(self, line):
+        self.lines.append("    " * self.depth + line)
+
+    def variables(self):
+        return [v for scope in self.scopes for v in scope]
+
+    def fresh_var(self):
+        self.var_index += 1
+        return f"v{self.var_index}"
+
+    def operand(self):
+        variables = self.variables()
+        if variables and self.rng.random() < 0.7:
+            return self.rng.choice(variables)
+        return str(self.rng.randint(0, 100))
+
+    def call(self, depth):
+        function = self.rng.choice(self.callees)
+        args = [self.expr(depth + 1) for _ in range(function.params)]
+        return f"{function.name}({', '.join(args)})"
+
+    def expr(self, depth=0):
+        roll = self.rng.random()
+        if depth >= self.args.expr_depth or roll < 0.3:
+            return self.operand()
+        if roll < 0.4 and self.can_call and self.callees and depth == 0:
+            return self.call(depth)
+        if roll < 0.5:
+            op = self.rng.choice(UNARY_OPS)
+            return f"{op}({self.expr(depth + 1)})"
+        if roll < 0.55:
+            # Only divide by constants, so we never divide by 0
+            op = self.rng.choice(["/", "%"])
+            return f"({self.expr(depth + 1)}) {op} {self.rng.randint(1, 9)}"
+        op = self.rng.choice(BINARY_OPS)
+        return f"({self.expr(depth + 1)}) {op} ({self.expr(depth + 1)})"
+
+    def chain(self):
+        terms = [self.operand() for _ in range(self.args.chain_length)]
+        expr = terms[0]
+        for term in terms[1:]:
+            expr += f" {self.rng.choice(['+', '-', '^', '|', '&'])} {term}"
+        return expr
+
+    def declaration(self):
+        names = [self.fresh_var() for _ in range(self.rng.randint(1, 4))]
+        parts = [f"{name} = {self.expr()}" for name in names]
+        self.emit(f"int {', '.join(parts)};")
+        self.scopes[-1].extend(names)
+
+    def assignment(self, targets):
+        targets = [t for t in targets if t not in self.counters]
+        if not targets:
+            self.declaration()
+            return
+        target = self.rng.choice(targets)
+        if self.rng.random() < 0.2:
+            self.emit(f"{target} = {self.chain()};")
+        else:
+            self.emit(f"{target} = {self.expr()};")
+
+    def block(self, statements, targets):
+        self.scopes.append([])
+        self.depth += 1
+        for _ in range(statements):
+            self.statement(targets + self.scopes[-1])
+        self.depth -= 1
+        self.scopes.pop()
+
+    def statement(self, targets):
+        roll = self.rng.random()
+        nested = self.depth < self.args.nesting
+        if roll < 0.3 or not targets:
+            self.declaration()
+        elif roll < 0.65:
+            self.assignment(targets)
+        elif roll < 0.85 and nested:
+            self.emit(f"if ({self.expr()}) {{")
+            self.block(self.rng.randint(1, 4), targets)
+            if self.rng.random() < 0.5:
+                self.emit("} else {")
+                self.block(self.rng.randint(1, 4), targets)
+            self.emit("}")
+        elif nested and self.loop_depth < 2:
+            # The counter is never assigned in the body, so the loop always
+            # terminates
+            counter = self.fresh_var()
+            self.emit(f"int {counter} = 0;")
+            self.scopes[-1].append(counter)
+            self.counters.add(counter)
+            self.emit(f"while ({counter} != {self.rng.randint(1, 8)}) {{")
+            self.loop_depth += 1
+            self.block(self.rng.randint(1, 4), targets)
+            self.loop_depth -= 1
+            self.depth += 1
+            self.emit(f"{counter} = {counter} + 1;")
+            self.depth -= 1
+            self.emit("}")
+            self.counters.remove(counter)
+        else:
+            self.assignment(targets)
+
+    def function(self, name, params, leaf):
+        self.can_call = not leaf
+        names = [f"p{i}" for i in range(params)]
+        args = ", ".join(f"int {n}" for n in names)
+        self.lines.append(f"int {name}({args}) {{")
+        self.var_index = 0
+        self.scopes = [names, []]
+        self.depth = 1
+        for _ in range(self.args.statements):
+            self.statement(self.variables())
+        self.emit(f"return {self.expr()};")
+        self.lines.append("}")
+        self.lines.append("")
+        function = Function(name, params, leaf)
+        self.functions.append(function)
+        if leaf:
+            self.callees.append(function)
+
+    def program(self):
+        for i in range(self.args.functions):
+            params = self.rng.randint(0, MAX_PARAMS)
+            self.function(f"f{i}", params, self.rng.random() < 0.5)
+        self.lines.append("int main() {")
+        self.scopes = [[]]
+        self.depth = 1
+        self.emit("int result = 0;")
+        for function in self.functions[-self.args.main_calls:]:
+            args = ", ".join(str(self.rng.randint(0, 9))
+                             for _ in range(function.params))
+            self.emit(f"result = result ^ {function.name}({args});")
+        self.emit("return result & 255;")
+        self.lines.append("}")
+        return "\n".join(self.lines) + "\n"
+
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--functions", type=int, default=1000,
+                        help="number of functions before main")
+    parser.add_argument("--statements", type=int, default=20,
+                        help="top level statements per function")
+    parser.add_argument("--nesting", type=int, default=4,
+                        help="maximum depth of nested blocks")
+    parser.add_argument("--expr-depth", type=int, default=4,
+                        help="maximum depth of expression trees")
+    parser.add_argument("--chain-length", type=int, default=24,
+                        help="number of terms in long expression chains")
+    parser.add_argument("--main-calls", type=int, default=8,
+                        help="number of functions main calls")
+    parser.add_argument("-o", "--output", default="-")
+    return parser.parse_args(argv)
+
+
+def generate(args):
+    return Generator(random.Random(args.seed), args).program()
+
+
+def main():
+    args = parse_args(sys.argv[1:])
+    program = generate(args)
+    if args.output == "-":
+        sys.stdout.write(program)
+    else:
+        with open(args.output, "w") as fp:
+            fp.write(program)
+
+
+if __name__ == "__main__":
+    main()
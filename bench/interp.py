@@ -0,0 +1,114 @@
+#!/usr/bin/python
+"""Compare running a program with cici's interpreter to compiling it.
+
+For each program, we time `cici <file> stdout interp` against the whole native
+pipeline: compiling to assembly, assembling and linking with gcc, and running
+the binary. Both have to return what the //RET line expects. By default we go
+through the golden tests and the programs in bench/programs. Results are
+printed as a table, and appended as one JSON line to the results file.
+"""
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+SOURCE_DIRS = [os.path.join(ROOT_DIR, "tests"),
+               os.path.join(BENCH_DIR, "programs")]
+
+
+def expected_return(path):
+    with open(path) as fp:
+        for line in fp:
+            if line.startswith("//RET"):
+                return int(line.split()[1])
+    return None
+
+
+def flags(path):
+    with open(path) as fp:
+        for line in fp:
+            if line.startswith("//FLAGS"):
+                return line.split()[1:]
+    return []
+
+
+# Run a series of commands, returning the time they took and the exit code of
+# the last one
+def timed(steps):
+    start = time.perf_counter()
+    for step in steps[:-1]:
+        result = subprocess.run(step, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT,
+                                universal_newlines=True)
+        if result.returncode != 0:
+            sys.exit(f"{' '.join(step)} failed:\n{result.stdout}")
+    code = subprocess.run(steps[-1], stdout=subprocess.DEVNULL).returncode
+    return (time.perf_counter() - start, code)
+
+
+def measure(steps, repeat, expected):
+    times = []
+    for _ in range(repeat):
+        (seconds, code) = timed(steps)
+        if expected is not None and code != expected:
+            return {"error": f"returned {code}, expected {expected}"}
+        times.append(seconds)
+    return {"median_ms": statistics.median(times) * 1e3,
+            "min_ms": min(times) * 1e3}
+
+
+def cell(result):
+    return result["error"] if "error" in result else \
+        f"{result['median_ms']:.1f} ms"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--cici", default=os.path.join(ROOT_DIR, "cici"))
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--output",
+                        default=os.path.join(BENCH_DIR, "interp.jsonl"),
+                        help="file to append the results to")
+    parser.add_argument("programs", nargs="*",
+                        help="programs to run, the tests and bench/programs "
+                        "if empty")
+    args = parser.parse_args()
+    programs = args.programs or sorted(
+        os.path.join(d, f) for d in SOURCE_DIRS for f in os.listdir(d)
+        if f.endswith(".c"))
+    results = {}
+    print(f"{'program':<24}{'interp':>16}{'native':>16}{'speedup':>10}")
+    for source in programs:
+        name = os.path.relpath(source, ROOT_DIR)
+        expected = expected_return(source)
+        options = flags(source)
+        with tempfile.TemporaryDirectory() as directory:
+            asm = os.path.join(directory, "out.s")
+            binary = os.path.join(directory, "a.out")
+            native = [[args.cici, *options, source, asm, "compile"],
+                      ["gcc", asm, "-o", binary], [binary]]
+            interp = [[args.cici, *options, source, "stdout", "interp"]]
+            results[name] = {"interp": measure(interp, args.repeat, expected),
+                             "native": measure(native, args.repeat, expected)}
+        r = results[name]
+        speedup = ""
+        if "error" not in r["interp"] and "error" not in r["native"]:
+            ratio = r["native"]["median_ms"] / r["interp"]["median_ms"]
+            speedup = f"{ratio:.1f}x"
+        print(f"{name:<24}{cell(r['interp']):>16}{cell(r['native']):>16}"
+              f"{speedup:>10}")
+    record = {"timestamp": time.time(), "repeat": args.repeat,
+              "results": results}
+    with open(args.output, "a") as fp:
+        fp.write(json.dumps(record) + "\n")
+    print(f"\nResults appended to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,20 @@
+//RET 4
+int popcount(int x) {
+    int n = 0;
+    while (x != 0) {
+        x = x & (x - 1);
+        n = n + 1;
+    }
+    return n;
+}
+
+int main() {
+    int i = 0, total = 0, hash = 0;
+    while (i != 5000000) {
+        total = total + popcount(i ^ (i * 7));
+        hash = (hash ^ i) * 16777619;
+        if ((i & 3) == 0) hash = ~hash;
+        i = i + 1;
+    }
+    return (total ^ hash) & 255;
+}
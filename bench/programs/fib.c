@@ -0,0 +1,10 @@
+//RET 5
+int fib(int n) {
+    if (n == 0) return 0;
+    if (n == 1) return 1;
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main() {
+    return fib(32) % 256;
+}
@@ -0,0 +1,22 @@
+//RET 84
+int gcd(int a, int b) {
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int main() {
+    int i = 1, total = 0;
+    while (i != 1500) {
+        int j = 1;
+        while (j != 1500) {
+            total = total + gcd(i, j);
+            j = j + 1;
+        }
+        i = i + 1;
+    }
+    return total % 256;
+}
@@ -0,0 +1,17 @@
+//RET 0
+int main() {
+    int i = 0, total = 0;
+    while (i != 400) {
+        int j = 0;
+        while (j != 400) {
+            int k = 0;
+            while (k != 40) {
+                total = total + (i ^ j) + k * 3;
+                k = k + 1;
+            }
+            j = j + 1;
+        }
+        i = i + 1;
+    }
+    return total & 255;
+}
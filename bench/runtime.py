@@ -0,0 +1,150 @@
+#!/usr/bin/python
+"""Measure how fast the code generated by cici runs, next to gcc's.
+
+Each program in bench/programs is built by every configuration, checked
+against its //RET line, and run several times. We report the median wall time
+of those runs. When `perf` is available, we also report the cycles and
+instructions of one more run under `perf stat`, which isn't timed, so that
+perf doesn't slow down the timed runs. Results are printed as a table, and
+appended as one JSON line to the results file.
+"""
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+PROGRAM_DIR = os.path.join(BENCH_DIR, "programs")
+
+# Each configuration is a compiler and the options we give it. gcc uses
+# -fwrapv, since our programs rely on overflow wrapping around, like in cici.
+CONFIGS = {
+    "cici": ("cici", []),
+    "cici -O0": ("cici", ["-O0"]),
+    "cici -funroll": ("cici", ["-funroll"]),
+    "gcc -O0": ("gcc", ["-O0"]),
+    "gcc -O2": ("gcc", ["-O2"]),
+}
+
+
+def expected_return(path):
+    with open(path) as fp:
+        for line in fp:
+            if line.startswith("//RET"):
+                return int(line.split()[1])
+    return None
+
+
+def build(cici, config, source, directory):
+    compiler, options = CONFIGS[config]
+    binary = os.path.join(directory, "a.out")
+    if compiler == "cici":
+        asm = os.path.join(directory, "out.s")
+        steps = [[cici, *options, source, asm, "compile"],
+                 ["gcc", asm, "-o", binary]]
+    else:
+        steps = [["gcc", "-w", "-fwrapv", *options, source, "-o", binary]]
+    for step in steps:
+        result = subprocess.run(step, stdout=subprocess.PIPE,
+                                stderr=subprocess.PIPE,
+                                universal_newlines=True)
+        if result.returncode != 0:
+            sys.exit(f"{' '.join(step)} failed:\n{result.stdout}"
+                     f"{result.stderr}")
+    return binary
+
+
+def perf_counters(binary):
+    if shutil.which("perf") is None:
+        return None
+    command = ["perf", "stat", "-x,", "-e", "cycles,instructions", binary]
+    result = subprocess.run(command, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    counters = {}
+    for line in result.stderr.splitlines():
+        fields = line.split(",")
+        if len(fields) > 2 and fields[0].isdigit():
+            counters[fields[2].split(":")[0]] = int(fields[0])
+    return counters or None
+
+
+def measure(binary, repeat, expected):
+    times = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        code = subprocess.run([binary]).returncode
+        times.append(time.perf_counter() - start)
+        if expected is not None and code != expected:
+            return {"error": f"returned {code}, expected {expected}"}
+    result = {"median_ms": statistics.median(times) * 1e3,
+              "min_ms": min(times) * 1e3}
+    counters = perf_counters(binary)
+    if counters is not None:
+        result.update(counters)
+    return result
+
+
+def print_table(results, configs):
+    width = max(len(c) for c in configs) + 2
+    print(f"{'program':<10}" + "".join(f"{c:>{width}}" for c in configs))
+    for program, by_config in results.items():
+        row = f"{program:<10}"
+        for config in configs:
+            r = by_config[config]
+            cell = r["error"] if "error" in r else f"{r['median_ms']:.1f} ms"
+            row += f"{cell:>{width}}"
+        print(row)
+        if all("instructions" in by_config[c] for c in configs):
+            row = f"{'  instrs':<10}"
+            for config in configs:
+                row += f"{by_config[config]['instructions'] / 1e6:>{width}.1f}M"
+            print(row)
+            row = f"{'  cycles':<10}"
+            for config in configs:
+                row += f"{by_config[config]['cycles'] / 1e6:>{width}.1f}M"
+            print(row)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--cici", default=os.path.join(ROOT_DIR, "cici"))
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--config", action="append", choices=CONFIGS,
+                        help="only run these configurations")
+    parser.add_argument("--output",
+                        default=os.path.join(BENCH_DIR, "runtime.jsonl"),
+                        help="file to append the results to")
+    parser.add_argument("programs", nargs="*",
+                        help="programs to run, all of bench/programs if empty")
+    args = parser.parse_args()
+    configs = args.config or list(CONFIGS)
+    programs = args.programs or sorted(
+        os.path.join(PROGRAM_DIR, f) for f in os.listdir(PROGRAM_DIR)
+        if f.endswith(".c"))
+    results = {}
+    for source in programs:
+        name = os.path.splitext(os.path.basename(source))[0]
+        expected = expected_return(source)
+        results[name] = {}
+        for config in configs:
+            with tempfile.TemporaryDirectory() as directory:
+                binary = build(args.cici, config, source, directory)
+                results[name][config] = measure(binary, args.repeat, expected)
+    print_table(results, configs)
+    if shutil.which("perf") is None:
+        print("\nperf wasn't found, so cycles and instructions aren't shown")
+    record = {"timestamp": time.time(), "repeat": args.repeat,
+              "results": results}
+    with open(args.output, "a") as fp:
+        fp.write(json.dumps(record) + "\n")
+    print(f"\nResults appended to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,149 @@
+#!/usr/bin/python
+"""Measure how fast cici compiles large generated programs.
+
+Each program is compiled several times with --time-report and --mem-report,
+keeping the median time of each phase. Results are printed as a table, and
+appended as one JSON line to the results file, for tracking trends.
+"""
+import argparse
+import hashlib
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import gen
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+
+# Each corpus gives the options we pass to the generator
+CORPORA = {
+    "small": ["--functions", "100"],
+    "large": ["--functions", "1000"],
+    "deep": ["--functions", "200", "--nesting", "8", "--expr-depth", "6"],
+    "chains": ["--functions", "500", "--chain-length", "200"],
+}
+
+
+def generate_corpus(name, seed, directory):
+    # Programs are kept between runs, so the name says what made them: a
+    # change to the generator or to its options gives a new program
+    options = CORPORA[name] + ["--seed", str(seed)]
+    digest = hashlib.sha256()
+    with open(gen.__file__, "rb") as fp:
+        digest.update(fp.read())
+    digest.update(" ".join(options).encode())
+    file = f"{name}-{seed}-{digest.hexdigest()[:12]}.c"
+    path = os.path.join(directory, file)
+    if not os.path.exists(path):
+        args = gen.parse_args(options)
+        with open(path, "w") as fp:
+            fp.write(gen.generate(args))
+    return path
+
+
+def compile_once(cici, path, out):
+    command = [cici, "--time-report", "--mem-report",
+               "--report-format=json", path, out, "compile"]
+    start = time.perf_counter()
+    result = subprocess.run(command, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        sys.exit(f"cici failed on {path}:\n{result.stdout}")
+    report = json.loads(result.stderr.strip().splitlines()[-1])
+    phases = {p["name"]: p["ms"] / 1e3 for p in report["phases"]}
+    return wall, phases, report
+
+
+def measure(cici, name, path, repeat):
+    size = os.path.getsize(path)
+    with open(path) as fp:
+        lines = sum(1 for _ in fp)
+    walls = []
+    phase_runs = []
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, "out.s")
+        for _ in range(repeat):
+            wall, phases, report = compile_once(cici, path, out)
+            walls.append(wall)
+            phase_runs.append(phases)
+
+    def median_phase(phase):
+        return statistics.median(run.get(phase, 0) for run in phase_runs)
+
+    lex = median_phase("lex")
+    parse = median_phase("parse")
+    codegen = median_phase("codegen")
+    wall = statistics.median(walls)
+    result = {
+        "corpus": name,
+        "bytes": size,
+        "lines": lines,
+        "tokens": report["tokens"],
+        "ast_nodes": report["ast_nodes"],
+        "peak_rss_kib": report["peak_rss_kib"],
+        "output_bytes": report["output_bytes"],
+        "seconds": {"lex": lex, "parse": parse, "codegen": codegen,
+                    "wall": wall},
+    }
+    for phase, seconds in [("lex", lex), ("parse", lex + parse),
+                           ("compile", wall)]:
+        if seconds > 0:
+            result[f"{phase}_mb_per_s"] = size / seconds / 1e6
+            result[f"{phase}_lines_per_s"] = lines / seconds
+    return result
+
+
+def git_commit():
+    result = subprocess.run(["git", "rev-parse", "--short", "HEAD"],
+                            cwd=ROOT_DIR, stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL,
+                            universal_newlines=True)
+    return result.stdout.strip() or None
+
+
+def print_table(results):
+    header = f"{'corpus':<8} {'MB':>7} {'lines':>9}"
+    for phase in ["lex", "parse", "compile"]:
+        header += f" {phase + ' MB/s':>14} {phase + ' lines/s':>16}"
+    print(header)
+    for r in results:
+        row = f"{r['corpus']:<8} {r['bytes'] / 1e6:>7.2f} {r['lines']:>9}"
+        for phase in ["lex", "parse", "compile"]:
+            row += f" {r.get(phase + '_mb_per_s', 0):>14.2f}"
+            row += f" {r.get(phase + '_lines_per_s', 0):>16.0f}"
+        print(row)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--cici", default=os.path.join(ROOT_DIR, "cici"))
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--corpus", action="append", choices=CORPORA,
+                        help="only run these corpora")
+    parser.add_argument("--output",
+                        default=os.path.join(BENCH_DIR, "throughput.jsonl"),
+                        help="file to append the results to")
+    args = parser.parse_args()
+    directory = os.path.join(BENCH_DIR, "generated")
+    os.makedirs(directory, exist_ok=True)
+    results = []
+    for name in args.corpus or CORPORA:
+        path = generate_corpus(name, args.seed, directory)
+        results.append(measure(args.cici, name, path, args.repeat))
+    print_table(results)
+    record = {"timestamp": time.time(), "commit": git_commit(),
+              "seed": args.seed, "repeat": args.repeat, "results": results}
+    with open(args.output, "a") as fp:
+        fp.write(json.dumps(record) + "\n")
+    print(f"\nResults appended to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
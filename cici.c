@@ -1,15 +1,152 @@
 #include "assert.h"
+#include "cici.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "pthread.h"
+#include "setjmp.h"
+#include "signal.h"
+#include "stdatomic.h"
 #include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "sys/mman.h"
+#include "sys/resource.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/un.h"
+#include "time.h"
+#include "unistd.h"
 
-// Exit the program with a given error message
-void panic(char const *msg) {
-    puts(msg);
+// Where to go back to after an error, instead of exiting, e.g. in a server
+_Thread_local jmp_buf *error_handler = NULL;
+// Where to print errors on this thread, if not stdout
+_Thread_local FILE *error_stream = NULL;
+
+FILE *errors(void) { return error_stream == NULL ? stdout : error_stream; }
+
+// Stop after an error that's already been printed
+_Noreturn void fail(void) {
+    if (error_handler != NULL) {
+        fflush(errors());
+        longjmp(*error_handler, 1);
+    }
     exit(-1);
 }
 
+// Exit the program with a given error message
+_Noreturn void panic(char const *msg) {
+    fprintf(errors(), "%s\n", msg);
+    fail();
+}
+
+/** MEMORY **/
+// The total number of bytes we've asked the allocator for, from any thread
+atomic_size_t bytes_allocated = 0;
+
+// Every block we allocate starts with this header. While compiling for a
+// library context, blocks are linked into a list the context owns, so that
+// whatever an error leaves behind can be freed with the context.
+typedef union BlockHeader {
+    struct {
+        union BlockHeader *prev;
+        union BlockHeader *next;
+    } links;
+    // Keeps the block after the header aligned like malloc's
+    max_align_t align;
+} BlockHeader;
+
+// The list new blocks get linked into on this thread, or NULL
+_Thread_local BlockHeader *owned_blocks = NULL;
+
+// Make a list of blocks, which starts out empty
+void blocks_init(BlockHeader *list) {
+    list->links.prev = list;
+    list->links.next = list;
+}
+
+// Free every block still in a list
+void blocks_free_all(BlockHeader *list) {
+    BlockHeader *block = list->links.next;
+    while (block != list) {
+        BlockHeader *next = block->links.next;
+        free(block);
+        block = next;
+    }
+    blocks_init(list);
+}
+
+// Take every block out of a list, leaving them to be freed like any other
+void blocks_release(BlockHeader *list) {
+    BlockHeader *block = list->links.next;
+    while (block != list) {
+        BlockHeader *next = block->links.next;
+        block->links.prev = NULL;
+        block->links.next = NULL;
+        block = next;
+    }
+    blocks_init(list);
+}
+
+// Allocate memory, exiting if there's none left
+void *xmalloc(size_t size) {
+    BlockHeader *block = malloc(sizeof(BlockHeader) + size);
+    if (block == NULL) {
+        panic("Out of memory");
+    }
+    atomic_fetch_add_explicit(&bytes_allocated, size, memory_order_relaxed);
+    if (owned_blocks != NULL) {
+        block->links.prev = owned_blocks;
+        block->links.next = owned_blocks->links.next;
+        block->links.next->links.prev = block;
+        owned_blocks->links.next = block;
+    } else {
+        block->links.prev = NULL;
+        block->links.next = NULL;
+    }
+    return block + 1;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return xmalloc(size);
+    }
+    BlockHeader *block =
+        realloc((BlockHeader *)ptr - 1, sizeof(BlockHeader) + size);
+    if (block == NULL) {
+        panic("Out of memory");
+    }
+    atomic_fetch_add_explicit(&bytes_allocated, size, memory_order_relaxed);
+    // The block might have moved, so its neighbours need to know
+    if (block->links.next != NULL) {
+        block->links.prev->links.next = block;
+        block->links.next->links.prev = block;
+    }
+    return block + 1;
+}
+
+// Free memory from xmalloc or xrealloc
+void xfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    BlockHeader *block = (BlockHeader *)ptr - 1;
+    if (block->links.next != NULL) {
+        block->links.prev->links.next = block->links.next;
+        block->links.next->links.prev = block->links.prev;
+    }
+    free(block);
+}
+
+char *xstrdup(char const *string) {
+    size_t size = strlen(string) + 1;
+    char *copy = xmalloc(size);
+    memcpy(copy, string, size);
+    return copy;
+}
+
 /** CHARACTER UTILITIES **/
 // The first size of string we try and allocate
 #define BASE_STRING_SIZE 16
@@ -20,6 +157,19 @@ void panic(char const *msg) {
 // Check whether this character is alphanumeric
 #define IS_ALPHA_NUMERIC(c) (IS_ALPHA(c) || IS_NUMERIC(c))
 
+/** HASHING **/
+// The starting value of a hash, for 64 bit FNV-1a
+#define HASH_BASIS 14695981039346656037ull
+
+// Fold some bytes into a hash
+uint64_t hash_bytes(uint64_t hash, void const *data, size_t size) {
+    unsigned char const *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
 /** LEXING **/
 
 // Represents a type of token our lexer produces.
@@ -42,6 +192,7 @@ typedef enum TokenType {
     T_AMPERSAND,
     T_VERT_BAR,
     T_CARET,
+    T_COLON,
     // Double character tokens
     T_EQUALS_EQUALS,
     T_EXCLAMATION_EQUALS,
@@ -53,6 +204,9 @@ typedef enum TokenType {
     T_WHILE,
     T_BREAK,
     T_CONTINUE,
+    T_SWITCH,
+    T_CASE,
+    T_DEFAULT,
     // Litteral
     T_LITT_NUMBER,
     T_IDENTIFIER,
@@ -73,6 +227,8 @@ typedef union TokenData {
 typedef struct Token {
     // Holds which type of token this is.
     TokenType type;
+    // The line this token is on, starting at 1
+    int line;
     // Holds information about the data contained in this token
     TokenData data;
 } Token;
@@ -131,6 +287,9 @@ void token_print(Token t, FILE *fp) {
     case T_AMPERSAND:
         fputs("&\n", fp);
         break;
+    case T_COLON:
+        fputs(":\n", fp);
+        break;
     case T_EQUALS_EQUALS:
         fputs("==\n", fp);
         break;
@@ -158,6 +317,15 @@ void token_print(Token t, FILE *fp) {
     case T_CONTINUE:
         fputs("continue\n", fp);
         break;
+    case T_SWITCH:
+        fputs("switch\n", fp);
+        break;
+    case T_CASE:
+        fputs("case\n", fp);
+        break;
+    case T_DEFAULT:
+        fputs("default\n", fp);
+        break;
     case T_LITT_NUMBER:
         fprintf(fp, "%d\n", t.data.litt);
         break;
@@ -178,152 +346,269 @@ typedef struct LexState {
     char const *program;
     // The index we're currently at in the program
     long index;
+    // The line we're currently on, starting at 1
+    int line;
+    // The index where the last token we produced starts
+    long token_start;
+    // The number of tokens we've produced
+    long token_count;
+    // A hash of the tokens we've produced, ignoring spacing
+    uint64_t hash;
 } LexState;
 
 LexState lex_init(char const *program) {
-    LexState ret = {.program = program, .index = 0};
+    LexState ret = {.program = program,
+                    .index = 0,
+                    .line = 1,
+                    .token_start = 0,
+                    .token_count = 0,
+                    .hash = HASH_BASIS};
     return ret;
 }
 
-Token lex_next(LexState *st) {
-    Token token = {.type = T_EOF, .data = {.litt = 0}};
-    // We always return unless we continue
-    for (;;) {
+// Continue lexing from somewhere else in the program, which is on `line`
+void lex_seek(LexState *st, long index, int line) {
+    st->index = index;
+    st->line = line;
+}
+
+// The column the last token we produced starts at, starting at 1
+//
+// We only need this for errors, so we find the start of the line then.
+long lex_column(LexState *st) {
+    long start = st->token_start;
+    while (start > 0 && st->program[start - 1] != '\n') {
+        --start;
+    }
+    return st->token_start - start + 1;
+}
+
+// Fold a token into the hash of the tokens we've produced
+void lex_hash(LexState *st, Token token) {
+    unsigned char type = token.type;
+    st->hash = hash_bytes(st->hash, &type, 1);
+    if (token.type == T_IDENTIFIER) {
+        st->hash = hash_bytes(st->hash, token.data.string,
+                              strlen(token.data.string) + 1);
+    } else if (token.type == T_LITT_NUMBER) {
+        st->hash = hash_bytes(st->hash, &token.data.litt, sizeof(int));
+    }
+}
+
+// Skip over a block comment, after its `/*`, stopping at `end` or at the end
+// of the program, returning whether we found the `*/` closing it
+bool lex_skip_comment(LexState *st, long end) {
+    // This avoids us matching `/*/` as a complete comment
+    bool star = false;
+    while (st->index < end) {
         char next = st->program[st->index];
         if (next == 0) {
-            token.type = T_EOF;
-        } else if (next == '(') {
-            st->index++;
-            token.type = T_LEFT_PARENS;
-        } else if (next == ')') {
-            st->index++;
-            token.type = T_RIGHT_PARENS;
-        } else if (next == '{') {
-            st->index++;
-            token.type = T_LEFT_BRACE;
-        } else if (next == '}') {
-            st->index++;
-            token.type = T_RIGHT_BRACE;
-        } else if (next == ';') {
-            st->index++;
-            token.type = T_SEMICOLON;
-        } else if (next == ',') {
-            st->index++;
-            token.type = T_COMMA;
-        } else if (next == '=') {
-            st->index++;
-            next = st->program[st->index];
-            if (next == '=') {
+            return false;
+        }
+        st->index++;
+        if (star && next == '/') {
+            return true;
+        }
+        if (next == '\n') {
+            st->line++;
+        }
+        star = next == '*';
+    }
+    return false;
+}
+
+// Whether or not a character starts a token, or the end of the program
+bool lex_starts_token(char c) {
+    switch (c) {
+    case 0:
+    case '(':
+    case ')':
+    case '{':
+    case '}':
+    case ';':
+    case ',':
+    case '=':
+    case '+':
+    case '-':
+    case '/':
+    case '*':
+    case '%':
+    case '!':
+    case '~':
+    case '&':
+    case '|':
+    case '^':
+    case ':':
+        return true;
+    default:
+        return IS_ALPHA_NUMERIC(c);
+    }
+}
+
+// Skip over spacing and comments, stopping at the start of a token, at `end`,
+// or at the end of the program, returning whether we stopped in the middle of
+// a block comment
+bool lex_skip(LexState *st, long end) {
+    while (st->index < end) {
+        char next = st->program[st->index];
+        if (next == '/' && st->program[st->index + 1] == '/') {
+            st->index += 2;
+            while (st->index < end && st->program[st->index] != '\n' &&
+                   st->program[st->index] != 0) {
                 st->index++;
-                token.type = T_EQUALS_EQUALS;
-            } else {
-                token.type = T_EQUALS;
             }
-        } else if (next == '+') {
-            st->index++;
-            token.type = T_PLUS;
-        } else if (next == '-') {
-            st->index++;
-            token.type = T_MINUS;
-        } else if (next == '/') {
-            st->index++;
-            next = st->program[st->index];
-            if (next == '/') {
-                while (next != '\n') {
-                    next = st->program[st->index++];
-                }
-                continue;
-            } else if (next == '*') {
-                // This avoids us matching `/*/` as a complete comment
+            if (st->index < end && st->program[st->index] == '\n') {
                 st->index++;
-                int stage = 0;
-                for (;;) {
-                    next = st->program[st->index++];
-                    if (stage == 1 && next == '/') {
-                        break;
-                    } else if (next == '*') {
-                        stage = 1;
-                    } else {
-                        stage = 0;
-                    }
-                }
-                continue;
-            } else {
-                token.type = T_SLASH;
+                st->line++;
             }
-        } else if (next == '*') {
-            st->index++;
-            token.type = T_ASTERISK;
-        } else if (next == '%') {
-            st->index++;
-            token.type = T_PERCENT;
-        } else if (next == '!') {
-            st->index++;
-            next = st->program[st->index];
-            if (next == '=') {
-                st->index++;
-                token.type = T_EXCLAMATION_EQUALS;
-            } else {
-                token.type = T_EXCLAMATION;
+        } else if (next == '/' && st->program[st->index + 1] == '*') {
+            st->index += 2;
+            if (!lex_skip_comment(st, end)) {
+                return true;
+            }
+        } else if (lex_starts_token(next)) {
+            return false;
+        } else {
+            if (next == '\n') {
+                st->line++;
             }
-        } else if (next == '~') {
-            st->index++;
-            token.type = T_TILDE;
-        } else if (next == '&') {
             st->index++;
-            token.type = T_AMPERSAND;
-        } else if (next == '|') {
+        }
+    }
+    return false;
+}
+
+Token lex_next(LexState *st) {
+    Token token = {.type = T_EOF, .line = 0, .data = {.litt = 0}};
+    lex_skip(st, LONG_MAX);
+    token.line = st->line;
+    st->token_start = st->index;
+    char next = st->program[st->index];
+    if (next == 0) {
+        token.type = T_EOF;
+    } else if (next == '(') {
+        st->index++;
+        token.type = T_LEFT_PARENS;
+    } else if (next == ')') {
+        st->index++;
+        token.type = T_RIGHT_PARENS;
+    } else if (next == '{') {
+        st->index++;
+        token.type = T_LEFT_BRACE;
+    } else if (next == '}') {
+        st->index++;
+        token.type = T_RIGHT_BRACE;
+    } else if (next == ';') {
+        st->index++;
+        token.type = T_SEMICOLON;
+    } else if (next == ',') {
+        st->index++;
+        token.type = T_COMMA;
+    } else if (next == '=') {
+        st->index++;
+        next = st->program[st->index];
+        if (next == '=') {
             st->index++;
-            token.type = T_VERT_BAR;
-        } else if (next == '^') {
+            token.type = T_EQUALS_EQUALS;
+        } else {
+            token.type = T_EQUALS;
+        }
+    } else if (next == '+') {
+        st->index++;
+        token.type = T_PLUS;
+    } else if (next == '-') {
+        st->index++;
+        token.type = T_MINUS;
+    } else if (next == '/') {
+        // Comments were skipped above, so this is always a division
+        st->index++;
+        token.type = T_SLASH;
+    } else if (next == '*') {
+        st->index++;
+        token.type = T_ASTERISK;
+    } else if (next == '%') {
+        st->index++;
+        token.type = T_PERCENT;
+    } else if (next == '!') {
+        st->index++;
+        next = st->program[st->index];
+        if (next == '=') {
             st->index++;
-            token.type = T_CARET;
-        } else if (IS_ALPHA(next)) {
-            size_t size = BASE_STRING_SIZE;
-            char *buf = malloc(size);
-            unsigned int index = 0;
-            for (; IS_ALPHA_NUMERIC(next); next = st->program[st->index]) {
-                // Leave space for the last byte
-                if (index >= size - 1) {
-                    size <<= 1;
-                    buf = realloc(buf, size);
-                }
-                buf[index++] = next;
-                st->index++;
-            }
-            buf[index] = 0;
-            if (strcmp(buf, "return") == 0) {
-                token.type = T_RETURN;
-            } else if (strcmp(buf, "int") == 0) {
-                token.type = T_INT;
-            } else if (strcmp(buf, "if") == 0) {
-                token.type = T_IF;
-            } else if (strcmp(buf, "else") == 0) {
-                token.type = T_ELSE;
-            } else if (strcmp(buf, "while") == 0) {
-                token.type = T_WHILE;
-            } else if (strcmp(buf, "break") == 0) {
-                token.type = T_BREAK;
-            } else if (strcmp(buf, "continue") == 0) {
-                token.type = T_CONTINUE;
-            } else {
-                token.type = T_IDENTIFIER;
-                token.data.string = buf;
-            }
-        } else if (IS_NUMERIC(next)) {
-            int buf = 0;
-            for (; IS_NUMERIC(next); next = st->program[st->index]) {
-                buf = buf * 10 + next - '0';
-                st->index++;
+            token.type = T_EXCLAMATION_EQUALS;
+        } else {
+            token.type = T_EXCLAMATION;
+        }
+    } else if (next == '~') {
+        st->index++;
+        token.type = T_TILDE;
+    } else if (next == '&') {
+        st->index++;
+        token.type = T_AMPERSAND;
+    } else if (next == '|') {
+        st->index++;
+        token.type = T_VERT_BAR;
+    } else if (next == '^') {
+        st->index++;
+        token.type = T_CARET;
+    } else if (next == ':') {
+        st->index++;
+        token.type = T_COLON;
+    } else if (IS_ALPHA(next)) {
+        size_t size = BASE_STRING_SIZE;
+        char *buf = xmalloc(size);
+        unsigned int index = 0;
+        for (; IS_ALPHA_NUMERIC(next); next = st->program[st->index]) {
+            // Leave space for the last byte
+            if (index >= size - 1) {
+                size <<= 1;
+                buf = xrealloc(buf, size);
             }
-            token.type = T_LITT_NUMBER;
-            token.data.litt = buf;
+            buf[index++] = next;
+            st->index++;
+        }
+        buf[index] = 0;
+        if (strcmp(buf, "return") == 0) {
+            token.type = T_RETURN;
+        } else if (strcmp(buf, "int") == 0) {
+            token.type = T_INT;
+        } else if (strcmp(buf, "if") == 0) {
+            token.type = T_IF;
+        } else if (strcmp(buf, "else") == 0) {
+            token.type = T_ELSE;
+        } else if (strcmp(buf, "while") == 0) {
+            token.type = T_WHILE;
+        } else if (strcmp(buf, "break") == 0) {
+            token.type = T_BREAK;
+        } else if (strcmp(buf, "continue") == 0) {
+            token.type = T_CONTINUE;
+        } else if (strcmp(buf, "switch") == 0) {
+            token.type = T_SWITCH;
+        } else if (strcmp(buf, "case") == 0) {
+            token.type = T_CASE;
+        } else if (strcmp(buf, "default") == 0) {
+            token.type = T_DEFAULT;
         } else {
+            token.type = T_IDENTIFIER;
+            token.data.string = buf;
+        }
+        // Only identifiers keep their name
+        if (token.type != T_IDENTIFIER) {
+            xfree(buf);
+        }
+    } else {
+        int buf = 0;
+        for (; IS_NUMERIC(next); next = st->program[st->index]) {
+            buf = buf * 10 + next - '0';
             st->index++;
-            continue;
         }
-        return token;
+        token.type = T_LITT_NUMBER;
+        token.data.litt = buf;
     }
+    if (token.type != T_EOF) {
+        st->token_count++;
+        lex_hash(st, token);
+    }
+    return token;
 }
 
 // This enum identifies what kind of node we're dealing with in a tre
@@ -354,6 +639,14 @@ typedef enum AstKind {
     K_IF,
     // Represents a while loop, e.g. `while (x) return 1;`
     K_WHILE,
+    // Represents a switch, holding the value it switches on, followed by the
+    // statements and labels of its body, which isn't a block: control can
+    // jump to any label in it
+    K_SWITCH,
+    // Represents a `case 1:` label in a switch, holding its value
+    K_CASE,
+    // Represents the `default:` label in a switch
+    K_DEFAULT,
     // Represents a declaration with initialization
     K_INIT_DECLARATION,
     // Represents a declaration without initialization
@@ -388,6 +681,8 @@ typedef enum AstKind {
     K_BIT_XOR,
     // -a
     K_NEGATE,
+    // Represents choosing between two values without branching, `c ? a : b`
+    K_SELECT,
     // Represents an identifier.
     K_IDENTIFIER,
     // Represents a numeric litteral
@@ -400,23 +695,429 @@ typedef struct AstNode AstNode;
 typedef union AstData {
     // A numeric litteral
     int num;
-    // A string litteral or identifier
-    char *string;
-    // The nodes beneath us
-    AstNode *children;
+    // The index of an identifier in the pool's strings
+    uint32_t string;
+    // The index of the first node beneath us in the pool
+    uint32_t children;
 } AstData;
 
 // The root syntax node type
 struct AstNode {
-    // What kind of node this is
-    AstKind kind;
+    // What kind of node this is, an AstKind
+    uint8_t kind;
     // If relevant, how many children under us
-    unsigned int count;
+    unsigned int count : 24;
     // The payload for this node
     AstData data;
+    // For statements and functions, the line they start on, or 0 if we don't
+    // know it, and for other nodes, anything
+    uint32_t line;
 };
 
-#define BASE_CHILDREN_SIZE 8
+_Static_assert(sizeof(AstNode) == 12, "AstNode should fit in 12 bytes");
+
+// Whether a node is a statement, or a function, and has a line
+bool ast_has_line(AstNode const *node) {
+    switch (node->kind) {
+    case K_FUNCTION:
+    case K_BLOCK:
+    case K_RETURN:
+    case K_EXPR_STATEMENT:
+    case K_DECLARATION:
+    case K_BREAK:
+    case K_CONTINUE:
+    case K_IF:
+    case K_WHILE:
+    case K_SWITCH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/** PARALLEL LEXING **/
+// Inputs smaller than this, per thread, aren't worth lexing on several threads
+#define LEX_CHUNK_MIN (1 << 16)
+
+// A growable array of tokens
+typedef struct TokenArray {
+    Token *tokens;
+    long count;
+    long capacity;
+} TokenArray;
+
+void token_array_init(TokenArray *array) {
+    array->tokens = NULL;
+    array->count = 0;
+    array->capacity = 0;
+}
+
+void token_array_push(TokenArray *array, Token token) {
+    if (array->count == array->capacity) {
+        array->capacity =
+            array->capacity == 0 ? BASE_STRING_SIZE : array->capacity << 1;
+        array->tokens =
+            xrealloc(array->tokens, array->capacity * sizeof(Token));
+    }
+    array->tokens[array->count++] = token;
+}
+
+// Free the names of some of the tokens in an array
+void tokens_free_names(Token *tokens, long count) {
+    for (long i = 0; i < count; ++i) {
+        if (tokens[i].type == T_IDENTIFIER) {
+            xfree(tokens[i].data.string);
+        }
+    }
+}
+
+// A piece of the program, starting right after a newline, lexed by a thread
+//
+// We can't know whether the piece starts inside of a block comment until the
+// pieces before it are lexed, so we lex it both ways at once. Starting inside
+// of a comment, we skip to its end, and lex until both ways reach the same
+// token, after which they agree.
+typedef struct LexChunk {
+    char const *program;
+    long start;
+    long end;
+    pthread_t thread;
+    // The tokens we find starting outside of a comment
+    TokenArray outside;
+    bool outside_ends_in_comment;
+    // The tokens we find starting inside of a comment, before reaching the
+    // token at index `joins` in `outside`, or -1 if we never do
+    TokenArray inside;
+    long joins;
+    bool inside_ends_in_comment;
+    // Which way we ended up lexing the chunk, once we know
+    bool starts_in_comment;
+    // The chunk's tokens printed out
+    char *buffer;
+    size_t size;
+} LexChunk;
+
+// Skip to the next token in a chunk, returning false at the end of the chunk
+//
+// `in_comment` is set if we end in the middle of a block comment.
+bool lex_chunk_skip(LexChunk *chunk, LexState *lexer, bool *in_comment) {
+    *in_comment = lex_skip(lexer, chunk->end);
+    return !*in_comment && lexer->index < chunk->end &&
+           chunk->program[lexer->index] != 0;
+}
+
+void *lex_chunk_worker(void *arg) {
+    LexChunk *chunk = arg;
+    LexState outside = lex_init(chunk->program);
+    LexState inside = lex_init(chunk->program);
+    outside.index = chunk->start;
+    inside.index = chunk->start;
+    chunk->joins = -1;
+    bool inside_more = lex_skip_comment(&inside, chunk->end);
+    chunk->inside_ends_in_comment = !inside_more;
+    bool outside_more =
+        lex_chunk_skip(chunk, &outside, &chunk->outside_ends_in_comment);
+    // Move whichever way is behind forward, until they meet
+    while (inside_more) {
+        inside_more =
+            lex_chunk_skip(chunk, &inside, &chunk->inside_ends_in_comment);
+        if (!inside_more) {
+            break;
+        }
+        if (outside_more && outside.index == inside.index) {
+            chunk->joins = chunk->outside.count;
+            break;
+        }
+        if (outside_more && outside.index < inside.index) {
+            token_array_push(&chunk->outside, lex_next(&outside));
+            outside_more = lex_chunk_skip(chunk, &outside,
+                                          &chunk->outside_ends_in_comment);
+        } else {
+            token_array_push(&chunk->inside, lex_next(&inside));
+        }
+    }
+    while (outside_more) {
+        token_array_push(&chunk->outside, lex_next(&outside));
+        outside_more =
+            lex_chunk_skip(chunk, &outside, &chunk->outside_ends_in_comment);
+    }
+    if (chunk->joins >= 0) {
+        chunk->inside_ends_in_comment = chunk->outside_ends_in_comment;
+    }
+    return NULL;
+}
+
+// Lex a whole program on up to `jobs` threads, returning its chunks in order,
+// and putting how many there are in `count`
+//
+// Stitched together, the tokens of each chunk are the same tokens as lex_next
+// produces, without the final T_EOF.
+LexChunk *lex_parallel(char const *program, int jobs, int *count) {
+    long length = strlen(program);
+    *count = jobs;
+    if (length / LEX_CHUNK_MIN < *count) {
+        *count = length / LEX_CHUNK_MIN > 0 ? length / LEX_CHUNK_MIN : 1;
+    }
+    LexChunk *chunks = xmalloc(*count * sizeof(LexChunk));
+    // Each chunk starts right after a newline, so that no token straddles two
+    // chunks, and the only state we carry over is being in a block comment
+    long start = 0;
+    for (int i = 0; i < *count; ++i) {
+        LexChunk *chunk = chunks + i;
+        chunk->program = program;
+        chunk->start = start;
+        long end = length * (i + 1) / *count;
+        if (end < start) {
+            end = start;
+        }
+        char const *newline = memchr(program + end, '\n', length - end);
+        chunk->end = i + 1 == *count || newline == NULL
+                         ? length
+                         : newline + 1 - program;
+        start = chunk->end;
+        token_array_init(&chunk->outside);
+        token_array_init(&chunk->inside);
+        if (pthread_create(&chunk->thread, NULL, lex_chunk_worker, chunk)) {
+            panic("Failed to start a lexing thread");
+        }
+    }
+    // Now that we know where each chunk starts, we keep the right tokens
+    bool in_comment = false;
+    for (int i = 0; i < *count; ++i) {
+        LexChunk *chunk = chunks + i;
+        pthread_join(chunk->thread, NULL);
+        chunk->starts_in_comment = in_comment;
+        if (!in_comment) {
+            tokens_free_names(chunk->inside.tokens, chunk->inside.count);
+            chunk->inside.count = 0;
+            chunk->joins = 0;
+            in_comment = chunk->outside_ends_in_comment;
+            continue;
+        }
+        if (chunk->joins < 0) {
+            chunk->joins = chunk->outside.count;
+        }
+        tokens_free_names(chunk->outside.tokens, chunk->joins);
+        in_comment = chunk->inside_ends_in_comment;
+    }
+    return chunks;
+}
+
+// The tokens of a chunk are those in `inside`, followed by those in `outside`
+// from `joins` on, so this is how many tokens it has
+long lex_chunk_count(LexChunk *chunk) {
+    return chunk->inside.count + chunk->outside.count - chunk->joins;
+}
+
+void lex_chunks_free(LexChunk *chunks, int count) {
+    for (int i = 0; i < count; ++i) {
+        xfree(chunks[i].outside.tokens);
+        xfree(chunks[i].inside.tokens);
+    }
+    xfree(chunks);
+}
+
+void *lex_chunk_printer(void *arg) {
+    LexChunk *chunk = arg;
+    FILE *fp = open_memstream(&chunk->buffer, &chunk->size);
+    if (fp == NULL) {
+        panic("Failed to open a buffer for tokens");
+    }
+    for (long i = 0; i < chunk->inside.count; ++i) {
+        token_print(chunk->inside.tokens[i], fp);
+    }
+    for (long i = chunk->joins; i < chunk->outside.count; ++i) {
+        token_print(chunk->outside.tokens[i], fp);
+    }
+    fclose(fp);
+    tokens_free_names(chunk->inside.tokens, chunk->inside.count);
+    tokens_free_names(chunk->outside.tokens + chunk->joins,
+                      chunk->outside.count - chunk->joins);
+    return NULL;
+}
+
+// Print out the tokens of each chunk, like token_print, one thread per chunk
+void lex_chunks_print(LexChunk *chunks, int count, FILE *out) {
+    for (int i = 0; i < count; ++i) {
+        if (pthread_create(&chunks[i].thread, NULL, lex_chunk_printer,
+                           chunks + i)) {
+            panic("Failed to start a printing thread");
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        pthread_join(chunks[i].thread, NULL);
+        fwrite(chunks[i].buffer, 1, chunks[i].size, out);
+        free(chunks[i].buffer);
+    }
+}
+
+/** SYNTAX TREE POOL **/
+// The number of nodes in each chunk of a pool, as a power of 2
+#define AST_CHUNK_BITS 12
+#define AST_CHUNK_SIZE (1u << AST_CHUNK_BITS)
+#define AST_CHUNK_MASK (AST_CHUNK_SIZE - 1)
+
+typedef struct AstChunk {
+    AstNode *nodes;
+    // Whether this is the start of an allocation, large ranges taking up
+    // several chunks
+    bool owned;
+} AstChunk;
+
+// Holds the nodes and names of a syntax tree
+//
+// The children of a node are a contiguous range of nodes in the pool, which
+// the node refers to with a 32-bit index. Nodes live in chunks that never
+// move, so pointers to nodes stay valid as the pool grows.
+typedef struct AstPool {
+    AstChunk *chunks;
+    unsigned int chunk_count;
+    unsigned int chunk_capacity;
+    // The index of the next node to hand out
+    uint32_t used;
+    // Where the children of lists get gathered while we parse them
+    AstNode *scratch;
+    unsigned int scratch_count;
+    unsigned int scratch_capacity;
+    // The names used by identifiers, which the pool owns
+    char **strings;
+    uint32_t string_count;
+    uint32_t string_capacity;
+    // How many of the first names belong to someone else, like a mapped file
+    uint32_t borrowed_strings;
+} AstPool;
+
+// The pool holding the tree this thread is working on
+_Thread_local AstPool *ast_pool = NULL;
+
+void ast_pool_init(AstPool *pool) { memset(pool, 0, sizeof(AstPool)); }
+
+// Free every node and name, keeping the first chunk around for reuse
+void ast_pool_reset(AstPool *pool) {
+    unsigned int kept = 0;
+    if (pool->chunk_count > 0 && pool->chunks[0].owned &&
+        (pool->chunk_count == 1 || pool->chunks[1].owned)) {
+        kept = 1;
+    }
+    for (unsigned int i = kept; i < pool->chunk_count; ++i) {
+        if (pool->chunks[i].owned) {
+            xfree(pool->chunks[i].nodes);
+        }
+    }
+    pool->chunk_count = kept;
+    pool->used = 0;
+    for (uint32_t i = pool->borrowed_strings; i < pool->string_count; ++i) {
+        xfree(pool->strings[i]);
+    }
+    pool->string_count = 0;
+    pool->borrowed_strings = 0;
+}
+
+// Free the chunks and names added after the first `chunk_count` chunks and
+// `string_count` names, which stay as they are
+void ast_pool_rewind(AstPool *pool, unsigned int chunk_count,
+                     uint32_t string_count) {
+    for (unsigned int i = chunk_count; i < pool->chunk_count; ++i) {
+        if (pool->chunks[i].owned) {
+            xfree(pool->chunks[i].nodes);
+        }
+    }
+    pool->chunk_count = chunk_count;
+    pool->used = chunk_count * AST_CHUNK_SIZE;
+    for (uint32_t i = string_count; i < pool->string_count; ++i) {
+        xfree(pool->strings[i]);
+    }
+    pool->string_count = string_count;
+}
+
+void ast_pool_destroy(AstPool *pool) {
+    ast_pool_reset(pool);
+    if (pool->chunk_count > 0) {
+        xfree(pool->chunks[0].nodes);
+    }
+    xfree(pool->chunks);
+    xfree(pool->scratch);
+    xfree(pool->strings);
+}
+
+AstNode *ast_node_at(uint32_t index) {
+    return ast_pool->chunks[index >> AST_CHUNK_BITS].nodes +
+           (index & AST_CHUNK_MASK);
+}
+
+// Give a node `count` new children, returning a pointer to the first
+AstNode *ast_alloc_children(AstNode *node, unsigned int count) {
+    node->count = count;
+    node->data.children = 0;
+    if (count == 0) {
+        return NULL;
+    }
+    AstPool *pool = ast_pool;
+    uint32_t start = pool->used;
+    uint32_t room = pool->chunk_count * AST_CHUNK_SIZE;
+    // The range can't straddle two chunks, since they aren't contiguous
+    if (start + count > room ||
+        (start & AST_CHUNK_MASK) + count > AST_CHUNK_SIZE) {
+        unsigned int chunks = (count + AST_CHUNK_MASK) >> AST_CHUNK_BITS;
+        if (pool->chunk_count + chunks > pool->chunk_capacity) {
+            pool->chunk_capacity = 2 * pool->chunk_capacity + chunks;
+            pool->chunks =
+                xrealloc(pool->chunks, pool->chunk_capacity * sizeof(AstChunk));
+        }
+        AstNode *nodes = xmalloc(chunks * AST_CHUNK_SIZE * sizeof(AstNode));
+        for (unsigned int i = 0; i < chunks; ++i) {
+            AstChunk *chunk = pool->chunks + pool->chunk_count++;
+            chunk->nodes = nodes + i * AST_CHUNK_SIZE;
+            chunk->owned = i == 0;
+        }
+        start = room;
+    }
+    pool->used = start + count;
+    node->data.children = start;
+    return ast_node_at(start);
+}
+
+AstNode *ast_children(AstNode *node) {
+    return ast_node_at(node->data.children);
+}
+
+char *ast_string(AstNode *node) { return ast_pool->strings[node->data.string]; }
+
+// Make a node refer to a name, which the pool takes ownership of
+void ast_set_string(AstNode *node, char *string) {
+    AstPool *pool = ast_pool;
+    if (pool->string_count == pool->string_capacity) {
+        pool->string_capacity = 2 * pool->string_capacity + BASE_STRING_SIZE;
+        pool->strings =
+            xrealloc(pool->strings, pool->string_capacity * sizeof(char *));
+    }
+    node->data.string = pool->string_count;
+    pool->strings[pool->string_count++] = string;
+}
+
+// Start gathering the children of a list, returning where they start
+unsigned int ast_list_begin(void) { return ast_pool->scratch_count; }
+
+void ast_list_push(AstNode *item) {
+    AstPool *pool = ast_pool;
+    if (pool->scratch_count == pool->scratch_capacity) {
+        pool->scratch_capacity = 2 * pool->scratch_capacity + 8;
+        pool->scratch =
+            xrealloc(pool->scratch, pool->scratch_capacity * sizeof(AstNode));
+    }
+    pool->scratch[pool->scratch_count++] = *item;
+}
+
+// Make the items gathered since `start` the children of a node
+void ast_list_end(AstNode *node, unsigned int start) {
+    AstPool *pool = ast_pool;
+    unsigned int count = pool->scratch_count - start;
+    AstNode *children = ast_alloc_children(node, count);
+    if (count > 0) {
+        memcpy(children, pool->scratch + start, count * sizeof(AstNode));
+    }
+    pool->scratch_count = start;
+}
 
 void ast_print_rec(AstNode *node, FILE *fp) {
     if (node == NULL) {
@@ -463,6 +1164,15 @@ void ast_print_rec(AstNode *node, FILE *fp) {
     case K_WHILE:
         name = "while";
         break;
+    case K_SWITCH:
+        name = "switch";
+        break;
+    case K_CASE:
+        name = "case";
+        break;
+    case K_DEFAULT:
+        name = "default";
+        break;
     case K_NO_INIT_DECLARATION:
         name = "declare";
         break;
@@ -487,6 +1197,9 @@ void ast_print_rec(AstNode *node, FILE *fp) {
     case K_NEGATE:
         name = "-";
         break;
+    case K_SELECT:
+        name = "select";
+        break;
     case K_INIT_DECLARATION:
         name = "declare";
         break;
@@ -536,13 +1249,13 @@ void ast_print_rec(AstNode *node, FILE *fp) {
         fprintf(fp, "%d", node->data.num);
         break;
     case 1:
-        fprintf(fp, "%s", node->data.string);
+        fprintf(fp, "%s", ast_string(node));
         break;
     case 2:
         fprintf(fp, "(%s", name);
         for (unsigned int i = 0; i < node->count; ++i) {
             fputc(' ', fp);
-            ast_print_rec(node->data.children + i, fp);
+            ast_print_rec(ast_children(node) + i, fp);
         }
         fputc(')', fp);
         break;
@@ -563,18 +1276,37 @@ typedef struct ParseState {
     Token prev;
     // Whether or not the head has been initialized
     bool has_peek;
+    // Whether or not to measure the time spent lexing
+    bool time_lexing;
+    // The time spent lexing, if we measure it
+    double lex_seconds;
+    // A hash of the tokens in the last function we parsed
+    uint64_t function_hash;
 } ParseState;
 
 ParseState parse_init(LexState lex_st) {
     Token start = {.type = T_START, .data = {.litt = 0}};
-    ParseState st = {
-        .lex_st = lex_st, .peek = start, .prev = start, .has_peek = false};
+    ParseState st = {.lex_st = lex_st,
+                     .peek = start,
+                     .prev = start,
+                     .has_peek = false,
+                     .time_lexing = false,
+                     .lex_seconds = 0,
+                     .function_hash = 0};
     return st;
 }
 
+double now_seconds(void);
+
 Token parse_peek(ParseState *st) {
     if (!st->has_peek) {
-        st->peek = lex_next(&st->lex_st);
+        if (st->time_lexing) {
+            double start = now_seconds();
+            st->peek = lex_next(&st->lex_st);
+            st->lex_seconds += now_seconds() - start;
+        } else {
+            st->peek = lex_next(&st->lex_st);
+        }
         st->has_peek = true;
     }
     return st->peek;
@@ -604,12 +1336,18 @@ bool parse_match(ParseState *st, TokenType *types, unsigned int type_count) {
     return false;
 }
 
+// Start an error message with where the token the parser is looking at is
+void parse_error_position(ParseState *st) {
+    fprintf(errors(), "Error at line %d, column %ld:\n", st->lex_st.line,
+            lex_column(&st->lex_st));
+}
+
 void parse_consume(ParseState *st, TokenType type, const char *msg) {
     if (parse_check(st, type)) {
         parse_advance(st);
         return;
     }
-    printf("Error at index %ld:\n", st->lex_st.index);
+    parse_error_position(st);
     panic(msg);
 }
 
@@ -618,23 +1356,18 @@ void parse_assignment_expr(ParseState *st, AstNode *node);
 // This should be called after accepting the first `(`
 void parse_function_call_params(ParseState *st, AstNode *node) {
     node->kind = K_PARAMS;
-    node->count = 0;
-    unsigned int allocated = BASE_CHILDREN_SIZE;
-    node->data.children = malloc(allocated * sizeof(AstNode));
+    unsigned int start = ast_list_begin();
+    AstNode param;
     if (!parse_check(st, T_RIGHT_PARENS)) {
-        node->count = 1;
-        parse_assignment_expr(st, node->data.children);
+        parse_assignment_expr(st, &param);
+        ast_list_push(&param);
     }
     while (parse_check(st, T_COMMA)) {
         parse_advance(st);
-        int offset = node->count++;
-        if (node->count > allocated) {
-            allocated <<= 1;
-            size_t size = allocated * sizeof(AstNode);
-            node->data.children = realloc(node->data.children, size);
-        }
-        parse_assignment_expr(st, node->data.children + offset);
+        parse_assignment_expr(st, &param);
+        ast_list_push(&param);
     }
+    ast_list_end(node, start);
     parse_consume(st, T_RIGHT_PARENS, "Expected `)` to end function params");
 }
 
@@ -654,23 +1387,21 @@ void parse_primary(ParseState *st, AstNode *node) {
         if (parse_check(st, T_LEFT_PARENS)) {
             parse_advance(st);
             node->kind = K_CALL;
-            node->count = 2;
-            node->data.children = malloc(2 * sizeof(AstNode));
-            AstNode *id = node->data.children;
+            AstNode *id = ast_alloc_children(node, 2);
             id->kind = K_IDENTIFIER;
             id->count = 0;
-            id->data.string = name;
-            parse_function_call_params(st, node->data.children + 1);
+            ast_set_string(id, name);
+            parse_function_call_params(st, id + 1);
         } else {
             node->kind = K_IDENTIFIER;
             node->count = 0;
-            node->data.string = name;
+            ast_set_string(node, name);
         }
     } else {
-        printf("Error at index %ld:\n", st->lex_st.index);
-        puts("Unexpected Token:");
-        token_print(st->peek, stdout);
-        exit(-1);
+        parse_error_position(st);
+        fputs("Unexpected Token:\n", errors());
+        token_print(st->peek, errors());
+        fail();
     }
 }
 
@@ -679,21 +1410,15 @@ void parse_unary(ParseState *st, AstNode *node) {
         if (parse_check(st, T_EXCLAMATION)) {
             parse_advance(st);
             node->kind = K_LOGICAL_NOT;
-            node->count = 1;
-            node->data.children = malloc(sizeof(AstNode));
-            node = node->data.children;
+            node = ast_alloc_children(node, 1);
         } else if (parse_check(st, T_TILDE)) {
             parse_advance(st);
             node->kind = K_BIT_NOT;
-            node->count = 1;
-            node->data.children = malloc(sizeof(AstNode));
-            node = node->data.children;
+            node = ast_alloc_children(node, 1);
         } else if (parse_check(st, T_MINUS)) {
             parse_advance(st);
             node->kind = K_NEGATE;
-            node->count = 1;
-            node->data.children = malloc(sizeof(AstNode));
-            node = node->data.children;
+            node = ast_alloc_children(node, 1);
         } else {
             break;
         }
@@ -705,8 +1430,9 @@ void parse_multiply(ParseState *st, AstNode *node) {
     parse_unary(st, node);
     TokenType operators[] = {T_ASTERISK, T_SLASH, T_PERCENT};
     while (parse_match(st, operators, 3)) {
-        AstNode *children = malloc(2 * sizeof(AstNode));
-        children[0] = *node;
+        AstNode left = *node;
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = left;
         TokenType matched = st->prev.type;
         if (matched == T_ASTERISK) {
             node->kind = K_MUL;
@@ -715,9 +1441,7 @@ void parse_multiply(ParseState *st, AstNode *node) {
         } else {
             node->kind = K_MOD;
         }
-        node->count = 2;
         parse_unary(st, children + 1);
-        node->data.children = children;
     }
 }
 
@@ -725,17 +1449,16 @@ void parse_add(ParseState *st, AstNode *node) {
     parse_multiply(st, node);
     TokenType operators[] = {T_PLUS, T_MINUS};
     while (parse_match(st, operators, 2)) {
-        AstNode *children = malloc(2 * sizeof(AstNode));
-        children[0] = *node;
+        AstNode left = *node;
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = left;
         TokenType matched = st->prev.type;
         if (matched == T_PLUS) {
             node->kind = K_ADD;
         } else {
             node->kind = K_SUB;
         }
-        node->count = 2;
         parse_multiply(st, children + 1);
-        node->data.children = children;
     }
 }
 
@@ -743,17 +1466,16 @@ void parse_equality(ParseState *st, AstNode *node) {
     parse_add(st, node);
     TokenType operators[] = {T_EQUALS_EQUALS, T_EXCLAMATION_EQUALS};
     while (parse_match(st, operators, 2)) {
-        AstNode *children = malloc(2 * sizeof(AstNode));
-        children[0] = *node;
+        AstNode left = *node;
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = left;
         TokenType matched = st->prev.type;
         if (matched == T_EQUALS_EQUALS) {
             node->kind = K_EQUALS;
         } else {
             node->kind = K_NOT_EQUALS;
         }
-        node->count = 2;
         parse_add(st, children + 1);
-        node->data.children = children;
     }
 }
 
@@ -761,12 +1483,11 @@ void parse_and(ParseState *st, AstNode *node) {
     parse_equality(st, node);
     while (parse_check(st, T_AMPERSAND)) {
         parse_advance(st);
-        AstNode *children = malloc(2 * sizeof(AstNode));
-        children[0] = *node;
+        AstNode left = *node;
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = left;
         node->kind = K_BIT_AND;
-        node->count = 2;
         parse_equality(st, children + 1);
-        node->data.children = children;
     }
 }
 
@@ -774,12 +1495,11 @@ void parse_exclusive_or(ParseState *st, AstNode *node) {
     parse_and(st, node);
     while (parse_check(st, T_CARET)) {
         parse_advance(st);
-        AstNode *children = malloc(2 * sizeof(AstNode));
-        children[0] = *node;
+        AstNode left = *node;
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = left;
         node->kind = K_BIT_XOR;
-        node->count = 2;
         parse_and(st, children + 1);
-        node->data.children = children;
     }
 }
 
@@ -787,12 +1507,11 @@ void parse_inclusive_or(ParseState *st, AstNode *node) {
     parse_exclusive_or(st, node);
     while (parse_check(st, T_VERT_BAR)) {
         parse_advance(st);
-        AstNode *children = malloc(2 * sizeof(AstNode));
-        children[0] = *node;
+        AstNode left = *node;
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = left;
         node->kind = K_BIT_OR;
-        node->count = 2;
         parse_exclusive_or(st, children + 1);
-        node->data.children = children;
     }
 }
 
@@ -805,15 +1524,24 @@ void parse_assignment_expr(ParseState *st, AstNode *node) {
             char *identifier = st->prev.data.string;
             parse_advance(st);
             node->kind = K_ASSIGN;
-            node->count = 2;
-            AstNode *children = malloc(2 * sizeof(AstNode));
-            node->data.children = children;
+            AstNode *children = ast_alloc_children(node, 2);
             children[0].kind = K_IDENTIFIER;
             children[0].count = 0;
-            children[0].data.string = identifier;
+            ast_set_string(children, identifier);
             parse_assignment_expr(st, children + 1);
         } else {
+            // Tokens lexed since the rewind point get lexed again, so the
+            // strings they hold would otherwise leak
+            if (!rewind.has_peek) {
+                xfree(st->prev.data.string);
+            }
+            if (st->peek.type == T_IDENTIFIER) {
+                xfree(st->peek.data.string);
+            }
+            // The time spent lexing ahead still counts
+            double lex_seconds = st->lex_seconds;
             *st = rewind;
+            st->lex_seconds = lex_seconds;
             parse_inclusive_or(st, node);
         }
     } else {
@@ -821,38 +1549,29 @@ void parse_assignment_expr(ParseState *st, AstNode *node) {
     }
 }
 
-AstNode *parse_top_expr(ParseState *st) {
-    AstNode *node = malloc(sizeof(AstNode));
+void parse_top_expr(ParseState *st, AstNode *node) {
     node->kind = K_TOP_EXPR;
-    node->count = 1;
-    unsigned int allocated = BASE_CHILDREN_SIZE;
-    node->data.children = malloc(allocated * sizeof(AstNode));
-    parse_assignment_expr(st, node->data.children);
+    unsigned int start = ast_list_begin();
+    AstNode expr;
+    parse_assignment_expr(st, &expr);
+    ast_list_push(&expr);
     while (parse_check(st, T_COMMA)) {
         parse_advance(st);
-        int offset = node->count++;
-        if (node->count > allocated) {
-            allocated <<= 1;
-            size_t size = allocated * sizeof(AstNode);
-            node->data.children = realloc(node->data.children, size);
-        }
-        parse_assignment_expr(st, node->data.children + offset);
+        parse_assignment_expr(st, &expr);
+        ast_list_push(&expr);
     }
-    return node;
+    ast_list_end(node, start);
 }
 
 void parse_top_expr_opt(ParseState *st, AstNode *node) {
     if (parse_check(st, T_SEMICOLON)) {
-        node->count = 0;
-        node->data.children = NULL;
+        ast_alloc_children(node, 0);
     } else {
-        node->count = 1;
-        node->data.children = parse_top_expr(st);
+        parse_top_expr(st, ast_alloc_children(node, 1));
     }
 }
 
-AstNode *parse_declarator(ParseState *st) {
-    AstNode *node = malloc(sizeof(AstNode));
+void parse_declarator(ParseState *st, AstNode *node) {
     node->kind = K_IDENTIFIER;
     node->count = 0;
     int parens = 0;
@@ -861,91 +1580,189 @@ AstNode *parse_declarator(ParseState *st) {
         ++parens;
     }
     parse_consume(st, T_IDENTIFIER, "Declarator must contain identifier");
-    node->data.string = st->prev.data.string;
+    ast_set_string(node, st->prev.data.string);
     for (; parens > 0; --parens) {
         parse_consume(st, T_RIGHT_PARENS,
                       "Must have matching parens around identifier");
     }
-    return node;
 }
 
 void parse_declaration(ParseState *st, AstNode *node) {
-    AstNode *declarator = parse_declarator(st);
+    AstNode declarator;
+    parse_declarator(st, &declarator);
     if (parse_check(st, T_EQUALS)) {
         parse_advance(st);
         node->kind = K_INIT_DECLARATION;
-        node->count = 2;
-        node->data.children = malloc(2 * sizeof(AstNode));
-        node->data.children[0] = *declarator;
-        parse_assignment_expr(st, node->data.children + 1);
+        AstNode *children = ast_alloc_children(node, 2);
+        children[0] = declarator;
+        parse_assignment_expr(st, children + 1);
     } else {
         node->kind = K_NO_INIT_DECLARATION;
-        node->count = 1;
-        node->data.children = declarator;
+        *ast_alloc_children(node, 1) = declarator;
     }
 }
 
 void parse_block_or_statement(ParseState *st, AstNode *node);
 
-void *parse_statement(ParseState *st, AstNode *node) {
-    if (parse_check(st, T_RETURN)) {
-        parse_advance(st);
-        node->kind = K_RETURN;
-        parse_top_expr_opt(st, node);
-        parse_consume(st, T_SEMICOLON, "Expected semicolon to end statement");
-    } else if (parse_check(st, T_BREAK)) {
+// A case of a switch, which we sort by value to find where to jump
+typedef struct SwitchCase {
+    int value;
+    // The index of its label among the children of the switch
+    unsigned int item;
+} SwitchCase;
+
+int switch_case_compare(void const *a, void const *b) {
+    int left = ((SwitchCase const *)a)->value;
+    int right = ((SwitchCase const *)b)->value;
+    return (left > right) - (left < right);
+}
+
+// Gather the cases of a switch, sorted by value, writing out how many
+SwitchCase *ast_switch_cases(AstNode *node, unsigned int *count) {
+    assert(node->kind == K_SWITCH);
+    SwitchCase *cases = xmalloc(node->count * sizeof(SwitchCase));
+    *count = 0;
+    for (unsigned int i = 1; i < node->count; ++i) {
+        AstNode *item = ast_children(node) + i;
+        if (item->kind == K_CASE) {
+            cases[*count].value = ast_children(item)->data.num;
+            cases[*count].item = i;
+            ++*count;
+        }
+    }
+    qsort(cases, *count, sizeof(SwitchCase), switch_case_compare);
+    return cases;
+}
+
+// Parse a label, or a statement, in the body of a switch
+void parse_switch_item(ParseState *st, AstNode *node) {
+    int line = parse_peek(st).line;
+    if (parse_check(st, T_CASE)) {
         parse_advance(st);
-        node->kind = K_BREAK;
-        node->count = 0;
-        parse_consume(st, T_SEMICOLON, "Expected semicolon to end statement");
-    } else if (parse_check(st, T_CONTINUE)) {
+        node->kind = K_CASE;
+        AstNode *value = ast_alloc_children(node, 1);
+        bool negative = parse_check(st, T_MINUS);
+        if (negative) {
+            parse_advance(st);
+        }
+        parse_consume(st, T_LITT_NUMBER, "Expected number after `case`");
+        value->kind = K_NUMBER;
+        value->count = 0;
+        value->data.num = st->prev.data.litt;
+        if (negative) {
+            value->data.num = -(unsigned int)value->data.num;
+        }
+        parse_consume(st, T_COLON, "Expected `:` after case value");
+    } else if (parse_check(st, T_DEFAULT)) {
         parse_advance(st);
-        node->kind = K_CONTINUE;
-        node->count = 0;
+        node->kind = K_DEFAULT;
+        ast_alloc_children(node, 0);
+        parse_consume(st, T_COLON, "Expected `:` after `default`");
+    } else if (parse_check(st, T_INT)) {
+        // Jumping to a label would skip over making room for the variable
+        parse_error_position(st);
+        panic("Declarations in a switch must be inside a block");
+    } else {
+        parse_block_or_statement(st, node);
+    }
+    node->line = line;
+}
+
+void parse_switch(ParseState *st, AstNode *node) {
+    parse_consume(st, T_LEFT_PARENS, "Expected `(` after `switch`");
+    node->kind = K_SWITCH;
+    unsigned int start = ast_list_begin();
+    AstNode item;
+    parse_assignment_expr(st, &item);
+    ast_list_push(&item);
+    parse_consume(st, T_RIGHT_PARENS, "Expected `)` to close `(`");
+    parse_consume(st, T_LEFT_BRACE, "Expected `{` to start switch body");
+    bool has_default = false;
+    while (!parse_check(st, T_RIGHT_BRACE) && !parse_at_end(st)) {
+        bool is_default = parse_check(st, T_DEFAULT);
+        if (is_default && has_default) {
+            parse_error_position(st);
+            panic("Switch has more than one `default`");
+        }
+        has_default = has_default || is_default;
+        parse_switch_item(st, &item);
+        ast_list_push(&item);
+    }
+    if (parse_at_end(st)) {
+        parse_error_position(st);
+        panic("Unexpected EOF");
+    }
+    ast_list_end(node, start);
+    unsigned int count;
+    SwitchCase *cases = ast_switch_cases(node, &count);
+    for (unsigned int i = 1; i < count; ++i) {
+        if (cases[i].value == cases[i - 1].value) {
+            parse_error_position(st);
+            fprintf(errors(), "Duplicate case value %d\n", cases[i].value);
+            fail();
+        }
+    }
+    xfree(cases);
+    parse_advance(st);
+}
+
+void *parse_statement(ParseState *st, AstNode *node) {
+    if (parse_check(st, T_RETURN)) {
+        parse_advance(st);
+        node->kind = K_RETURN;
+        parse_top_expr_opt(st, node);
+        parse_consume(st, T_SEMICOLON, "Expected semicolon to end statement");
+    } else if (parse_check(st, T_BREAK)) {
+        parse_advance(st);
+        node->kind = K_BREAK;
+        ast_alloc_children(node, 0);
+        parse_consume(st, T_SEMICOLON, "Expected semicolon to end statement");
+    } else if (parse_check(st, T_CONTINUE)) {
+        parse_advance(st);
+        node->kind = K_CONTINUE;
+        ast_alloc_children(node, 0);
         parse_consume(st, T_SEMICOLON, "Expected semicolon to end statement");
     } else if (parse_check(st, T_INT)) {
         parse_advance(st);
         node->kind = K_DECLARATION;
-        node->count = 1;
-        unsigned int allocated = BASE_CHILDREN_SIZE;
-        node->data.children = malloc(allocated * sizeof(AstNode));
-        parse_declaration(st, node->data.children);
+        unsigned int start = ast_list_begin();
+        AstNode declaration;
+        parse_declaration(st, &declaration);
+        ast_list_push(&declaration);
         while (parse_check(st, T_COMMA)) {
             parse_advance(st);
-            int offset = node->count++;
-            if (node->count > allocated) {
-                allocated <<= 1;
-                size_t size = allocated * sizeof(AstNode);
-                node->data.children = realloc(node->data.children, size);
-            }
-            parse_declaration(st, node->data.children + offset);
+            parse_declaration(st, &declaration);
+            ast_list_push(&declaration);
         }
+        ast_list_end(node, start);
         parse_consume(st, T_SEMICOLON, "Expected semicolon to end statement");
     } else if (parse_check(st, T_IF)) {
         parse_advance(st);
         parse_consume(st, T_LEFT_PARENS, "Expected `(` after `if`");
         node->kind = K_IF;
-        node->count = 2;
-        node->data.children = malloc(2 * sizeof(AstNode));
-        parse_assignment_expr(st, node->data.children);
+        AstNode cond, then;
+        parse_assignment_expr(st, &cond);
         parse_consume(st, T_RIGHT_PARENS, "Expected `)` to close `(`");
-        parse_block_or_statement(st, node->data.children + 1);
-        if (parse_check(st, T_ELSE)) {
+        parse_block_or_statement(st, &then);
+        bool has_else = parse_check(st, T_ELSE);
+        AstNode *children = ast_alloc_children(node, has_else ? 3 : 2);
+        children[0] = cond;
+        children[1] = then;
+        if (has_else) {
             parse_advance(st);
-            node->count = 3;
-            node->data.children =
-                realloc(node->data.children, 3 * sizeof(AstNode));
-            parse_block_or_statement(st, node->data.children + 2);
+            parse_block_or_statement(st, children + 2);
         }
     } else if (parse_check(st, T_WHILE)) {
         parse_advance(st);
         parse_consume(st, T_LEFT_PARENS, "Expected `(` after `while`");
         node->kind = K_WHILE;
-        node->count = 2;
-        node->data.children = malloc(2 * sizeof(AstNode));
-        parse_assignment_expr(st, node->data.children);
+        AstNode *children = ast_alloc_children(node, 2);
+        parse_assignment_expr(st, children);
         parse_consume(st, T_RIGHT_PARENS, "Expected `)` to close `(`");
-        parse_block_or_statement(st, node->data.children + 1);
+        parse_block_or_statement(st, children + 1);
+    } else if (parse_check(st, T_SWITCH)) {
+        parse_advance(st);
+        parse_switch(st, node);
     } else {
         node->kind = K_EXPR_STATEMENT;
         parse_top_expr_opt(st, node);
@@ -957,31 +1774,28 @@ void *parse_statement(ParseState *st, AstNode *node) {
 void parse_block(ParseState *st, AstNode *node) {
     parse_consume(st, T_LEFT_BRACE, "Expected `{` to start block");
     node->kind = K_BLOCK;
-    node->count = 0;
-    unsigned int allocated = BASE_CHILDREN_SIZE;
-    node->data.children = malloc(allocated * sizeof(AstNode));
+    unsigned int start = ast_list_begin();
+    AstNode statement;
     while (!parse_check(st, T_RIGHT_BRACE) && !parse_at_end(st)) {
-        int offset = node->count++;
-        if (node->count > allocated) {
-            allocated <<= 1;
-            size_t size = allocated * sizeof(AstNode);
-            node->data.children = realloc(node->data.children, size);
-        }
-        parse_block_or_statement(st, node->data.children + offset);
+        parse_block_or_statement(st, &statement);
+        ast_list_push(&statement);
     }
     if (parse_at_end(st)) {
-        printf("Error at index %ld:\n", st->lex_st.index);
+        parse_error_position(st);
         panic("Unexpected EOF");
     }
     parse_advance(st);
+    ast_list_end(node, start);
 }
 
 void parse_block_or_statement(ParseState *st, AstNode *node) {
+    int line = parse_peek(st).line;
     if (parse_check(st, T_LEFT_BRACE)) {
         parse_block(st, node);
     } else {
         parse_statement(st, node);
     }
+    node->line = line;
 }
 
 void parse_param_definition(ParseState *st, AstNode *node) {
@@ -989,609 +1803,5719 @@ void parse_param_definition(ParseState *st, AstNode *node) {
     parse_consume(st, T_IDENTIFIER, "Expected a param to have an identifier");
     node->kind = K_IDENTIFIER;
     node->count = 0;
-    node->data.string = st->prev.data.string;
+    ast_set_string(node, st->prev.data.string);
 }
 
 void parse_params_def(ParseState *st, AstNode *node) {
     parse_consume(st, T_LEFT_PARENS,
                   "Expected `(` to start function param definition");
     node->kind = K_PARAMS;
-    node->count = 0;
-    unsigned int allocated = BASE_CHILDREN_SIZE;
-    node->data.children = malloc(allocated * sizeof(AstNode));
+    unsigned int start = ast_list_begin();
+    AstNode param;
     if (!parse_check(st, T_RIGHT_PARENS)) {
-        node->count = 1;
-        parse_param_definition(st, node->data.children);
+        parse_param_definition(st, &param);
+        ast_list_push(&param);
     }
     while (parse_check(st, T_COMMA)) {
         parse_advance(st);
-        int offset = node->count++;
-        if (node->count > allocated) {
-            allocated <<= 1;
-            size_t size = allocated * sizeof(AstNode);
-            node->data.children = realloc(node->data.children, size);
-        }
-        parse_param_definition(st, node->data.children + offset);
+        parse_param_definition(st, &param);
+        ast_list_push(&param);
     }
+    ast_list_end(node, start);
     parse_consume(st, T_RIGHT_PARENS, "Expected `)` to end function params");
 }
 
+// This should be called after accepting the `int` starting the function
 void parse_function(ParseState *st, AstNode *node) {
     node->kind = K_FUNCTION;
-    node->count = 3;
-    node->data.children = malloc(3 * sizeof(AstNode));
+    node->line = st->prev.line;
+    AstNode *children = ast_alloc_children(node, 3);
     parse_consume(st, T_IDENTIFIER, "Function definition must have identifier");
-    node->data.children[0].kind = K_IDENTIFIER;
-    node->data.children[0].count = 0;
-    node->data.children[0].data.string = st->prev.data.string;
-    parse_params_def(st, node->data.children + 1);
-    parse_block(st, node->data.children + 2);
+    children[0].kind = K_IDENTIFIER;
+    children[0].count = 0;
+    ast_set_string(children, st->prev.data.string);
+    parse_params_def(st, children + 1);
+    children[2].line = parse_peek(st).line;
+    parse_block(st, children + 2);
+}
+
+// Parse the next function at the top level, returning false at the end
+bool parse_next_function(ParseState *st, AstNode *node) {
+    if (!parse_check(st, T_INT)) {
+        return false;
+    }
+    parse_advance(st);
+    // Since rewinding the parser rewinds the lexer's hash too, this only sees
+    // each of the function's tokens once
+    st->lex_st.hash = HASH_BASIS;
+    parse_function(st, node);
+    st->function_hash = st->lex_st.hash;
+    return true;
 }
 
-AstNode *parse_top_level(ParseState *st) {
-    AstNode *node = malloc(sizeof(AstNode));
+void parse_top_level(ParseState *st, AstNode *node) {
     node->kind = K_TOP_LEVEL;
-    node->count = 0;
-    unsigned int allocated = BASE_CHILDREN_SIZE;
-    node->data.children = malloc(allocated * sizeof(AstNode));
-    while (parse_check(st, T_INT)) {
-        parse_advance(st);
-        int offset = node->count++;
-        if (node->count > allocated) {
-            allocated <<= 1;
-            size_t size = allocated * sizeof(AstNode);
-            node->data.children = realloc(node->data.children, size);
-        }
-        parse_function(st, node->data.children + offset);
+    unsigned int start = ast_list_begin();
+    AstNode function;
+    while (parse_next_function(st, &function)) {
+        ast_list_push(&function);
     }
-    return node;
+    ast_list_end(node, start);
 }
 
-typedef struct Identifiers {
-    // An array of strings holding our identifiers
-    char **identifiers;
-    // The number of slots we've filled
-    unsigned int count;
-    // The number of slots we have available
-    unsigned int capacity;
-} Identifiers;
+// Where a function starts in a program, and what we know about it without
+// parsing its body
+typedef struct FunctionSpan {
+    // The index of the `int` starting the function, and one past its end
+    long start;
+    long end;
+    // The line the function starts on
+    int line;
+    // The hash of its tokens, the same one the parser finds
+    uint64_t hash;
+    // The name of the function, which we own, or NULL if it has none
+    char *name;
+    int param_count;
+} FunctionSpan;
 
-void idents_init(Identifiers *idents) {
-    idents->count = 0;
-    idents->capacity = 4;
-    idents->identifiers = malloc(idents->capacity * sizeof(char *));
+// The number of functions we first make room for when skimming a program
+#define SCAN_BASE_FUNCTIONS 8
+
+// Find the functions at the top level of a program without parsing them, by
+// matching braces, returning how many we found
+unsigned int scan_functions(char const *program, FunctionSpan **spans) {
+    LexState lexer = lex_init(program);
+    unsigned int count = 0;
+    unsigned int capacity = 0;
+    *spans = NULL;
+    for (;;) {
+        lex_skip(&lexer, LONG_MAX);
+        long start = lexer.index;
+        int line = lexer.line;
+        if (lex_next(&lexer).type != T_INT) {
+            break;
+        }
+        lexer.hash = HASH_BASIS;
+        Token t = lex_next(&lexer);
+        char *name = t.type == T_IDENTIFIER ? t.data.string : NULL;
+        int param_count = 0;
+        int depth = 0;
+        bool in_body = false;
+        while (t.type != T_EOF && (!in_body || depth > 0)) {
+            t = lex_next(&lexer);
+            if (t.type == T_IDENTIFIER) {
+                xfree(t.data.string);
+            } else if (t.type == T_INT && !in_body) {
+                ++param_count;
+            } else if (t.type == T_LEFT_BRACE) {
+                ++depth;
+                in_body = true;
+            } else if (t.type == T_RIGHT_BRACE) {
+                --depth;
+            }
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? SCAN_BASE_FUNCTIONS : capacity << 1;
+            *spans = xrealloc(*spans, capacity * sizeof(FunctionSpan));
+        }
+        FunctionSpan *span = *spans + count++;
+        span->start = start;
+        span->end = lexer.index;
+        span->line = line;
+        span->hash = lexer.hash;
+        span->name = name;
+        span->param_count = param_count;
+        if (t.type == T_EOF) {
+            break;
+        }
+    }
+    return count;
 }
 
-void idents_insert(Identifiers *idents, char *new) {
-    if (idents->count == idents->capacity) {
-        idents->capacity <<= 1;
-        idents->identifiers =
-            realloc(idents->identifiers, idents->capacity * sizeof(char *));
+void spans_free(FunctionSpan *spans, unsigned int count) {
+    for (unsigned int i = 0; i < count; ++i) {
+        xfree(spans[i].name);
     }
-    idents->identifiers[idents->count++] = new;
+    xfree(spans);
 }
 
-// Returns < 0 for negative indices
-int idents_index_of(Identifiers *idents, char *target) {
-    for (unsigned int i = 0; i < idents->count; ++i) {
-        if (strcmp(idents->identifiers[i], target) == 0) {
-            return i;
+// The smallest table of functions a lazy parser looks names up in, which we
+// index with the low bits of a hash
+#define LAZY_BASE_TABLE_SIZE 8
+
+_Static_assert((LAZY_BASE_TABLE_SIZE & (LAZY_BASE_TABLE_SIZE - 1)) == 0,
+               "The table of functions is indexed with a mask");
+
+// Parses the functions reachable from a few entry points, in the order we
+// find them, skipping over the bodies of the other functions
+typedef struct LazyParser {
+    FunctionSpan *spans;
+    unsigned int count;
+    // Maps names to functions, holding the index of each function plus one,
+    // or 0 for an empty slot
+    unsigned int *table;
+    unsigned int table_size;
+    // Whether or not we've queued each function already
+    bool *queued;
+    // The functions we've found but not parsed yet, from head to tail
+    unsigned int *queue;
+    unsigned int head;
+    unsigned int tail;
+} LazyParser;
+
+// Queue the function with a given name, if it's defined and not queued yet
+void lazy_enqueue(LazyParser *lazy, char const *name, size_t length) {
+    unsigned int mask = lazy->table_size - 1;
+    unsigned int slot = hash_bytes(HASH_BASIS, name, length) & mask;
+    for (; lazy->table[slot] != 0; slot = (slot + 1) & mask) {
+        unsigned int i = lazy->table[slot] - 1;
+        char const *other = lazy->spans[i].name;
+        if (strncmp(other, name, length) == 0 && other[length] == '\0') {
+            if (!lazy->queued[i]) {
+                lazy->queued[i] = true;
+                lazy->queue[lazy->tail++] = i;
+            }
+            return;
         }
     }
-    return -1;
 }
 
-typedef struct Scope {
-    // The set of identifiers created inside this scope
-    Identifiers identifiers;
-    // The number of bytes of stack we've allocated in this scope
-    int allocated_stack;
-    // The initial offset for this scope
-    int initial_offset;
-} Scope;
+// Skim a program, starting from `main`, or from a list of functions separated
+// by commas if `roots` isn't NULL
+void lazy_init(LazyParser *lazy, char const *program, char const *roots) {
+    lazy->count = scan_functions(program, &lazy->spans);
+    lazy->table_size = LAZY_BASE_TABLE_SIZE;
+    while (lazy->table_size < 2 * lazy->count) {
+        lazy->table_size <<= 1;
+    }
+    lazy->table = xmalloc(lazy->table_size * sizeof(unsigned int));
+    memset(lazy->table, 0, lazy->table_size * sizeof(unsigned int));
+    lazy->queued = xmalloc((lazy->count + 1) * sizeof(bool));
+    lazy->queue = xmalloc((lazy->count + 1) * sizeof(unsigned int));
+    lazy->head = 0;
+    lazy->tail = 0;
+    unsigned int mask = lazy->table_size - 1;
+    for (unsigned int i = 0; i < lazy->count; ++i) {
+        lazy->queued[i] = false;
+        char const *name = lazy->spans[i].name;
+        if (name == NULL) {
+            continue;
+        }
+        unsigned int slot = hash_bytes(HASH_BASIS, name, strlen(name)) & mask;
+        while (lazy->table[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        lazy->table[slot] = i + 1;
+    }
+    if (roots == NULL) {
+        lazy_enqueue(lazy, "main", 4);
+        return;
+    }
+    while (*roots != '\0') {
+        size_t length = strcspn(roots, ",");
+        lazy_enqueue(lazy, roots, length);
+        roots += length;
+        if (*roots == ',') {
+            ++roots;
+        }
+    }
+}
 
-typedef struct Scopes {
-    // The stack of scopes
-    Scope *scopes;
-    // The number of slots filled
-    unsigned int count;
-    // The number of slots available
-    unsigned int capacity;
-} Scopes;
+void lazy_destroy(LazyParser *lazy) {
+    spans_free(lazy->spans, lazy->count);
+    xfree(lazy->table);
+    xfree(lazy->queued);
+    xfree(lazy->queue);
+}
 
-void scopes_init(Scopes *new) {
-    new->count = 0;
-    new->capacity = 2;
-    new->scopes = malloc(new->capacity * sizeof(Scope));
+// Queue the functions called somewhere inside of a node
+void lazy_enqueue_calls(LazyParser *lazy, AstNode *node) {
+    if (node->kind == K_CALL) {
+        char const *name = ast_string(ast_children(node));
+        lazy_enqueue(lazy, name, strlen(name));
+    }
+    if (node->kind == K_NUMBER || node->kind == K_IDENTIFIER) {
+        return;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        lazy_enqueue_calls(lazy, ast_children(node) + i);
+    }
 }
 
-// Enter a new scope
-void scopes_enter(Scopes *scopes) {
-    if (scopes->count == scopes->capacity) {
-        scopes->capacity <<= 1;
-        scopes->scopes =
-            realloc(scopes->scopes, scopes->capacity * sizeof(Scope));
+// Parse the next reachable function, returning false when there are none left
+bool lazy_next_function(LazyParser *lazy, ParseState *st, AstNode *node) {
+    if (lazy->head == lazy->tail) {
+        return false;
     }
-    Scope *new = scopes->scopes + scopes->count++;
-    // We don't have an old scope to look at
-    if (scopes->count == 1) {
-        // The first will take stack bytes [-4,0[
-        new->initial_offset = 4;
-    } else {
-        Scope *old = new - 1;
-        // 4 bytes for each identifier created in the previous scope
-        int previous_var_size = old->identifiers.count << 2;
-        new->initial_offset = old->initial_offset + previous_var_size;
+    FunctionSpan *span = lazy->spans + lazy->queue[lazy->head++];
+    lex_seek(&st->lex_st, span->start, span->line);
+    st->has_peek = false;
+    parse_next_function(st, node);
+    lazy_enqueue_calls(lazy, node);
+    return true;
+}
+
+// Parse the next function, either from a lazy parser, or in order
+bool parse_next(LazyParser *lazy, ParseState *st, AstNode *node) {
+    if (lazy != NULL) {
+        return lazy_next_function(lazy, st, node);
     }
-    idents_init(&new->identifiers);
-    new->allocated_stack = 0;
+    return parse_next_function(st, node);
 }
 
-void scopes_exit(Scopes *scopes) {
-    --scopes->count;
-    free(scopes->scopes[scopes->count].identifiers.identifiers);
+/** OPTIMIZATION **/
+
+// Holds the options controlling how we compile a program
+typedef struct Options {
+    // Whether or not to run the optimization passes over the AST
+    bool optimize;
+    // How many copies of a loop body to make when unrolling, 0 to disable
+    int unroll_factor;
+    // Where to keep the assembly of each function we compile, or NULL
+    char const *cache_dir;
+    // Whether or not to only parse and compile the functions we can reach
+    bool lazy;
+    // The functions we start from when lazy, separated by commas, or NULL to
+    // start from main
+    char const *exports;
+    // Whether or not to fold functions with the same code into one
+    bool fold;
+    // Whether or not to say which line of the program each instruction comes
+    // from, for debuggers and profilers
+    bool debug_info;
+} Options;
+
+// The factor we unroll by when no factor is given
+#define DEFAULT_UNROLL_FACTOR 4
+
+void options_init(Options *options) {
+    options->optimize = true;
+    options->unroll_factor = 0;
+    options->cache_dir = NULL;
+    options->lazy = false;
+    options->exports = NULL;
+    options->fold = false;
+    options->debug_info = false;
 }
 
-// Returns < 0 if no identifier found
-int scopes_offset_of(Scopes *scopes, char *identifier) {
-    for (int i = scopes->count - 1; i >= 0; --i) {
-        Scope *scope = scopes->scopes + i;
-        int index = idents_index_of(&scope->identifiers, identifier);
-        if (index >= 0) {
-            return scope->initial_offset + (index << 2);
+// Apply an option controlling how we compile, returning false if it's not one
+bool options_parse(Options *options, char const *arg) {
+    if (strcmp(arg, "-O0") == 0) {
+        options->optimize = false;
+    } else if (strcmp(arg, "-O") == 0 || strcmp(arg, "-O1") == 0) {
+        options->optimize = true;
+    } else if (strcmp(arg, "-funroll") == 0) {
+        options->unroll_factor = DEFAULT_UNROLL_FACTOR;
+    } else if (strncmp(arg, "-funroll=", 9) == 0) {
+        options->unroll_factor = atoi(arg + 9);
+        if (options->unroll_factor < 1) {
+            panic("The unroll factor must be at least 1");
         }
+    } else if (strcmp(arg, "-fno-unroll") == 0) {
+        options->unroll_factor = 0;
+    } else if (strncmp(arg, "--cache-dir=", 12) == 0) {
+        options->cache_dir = arg + 12;
+    } else if (strcmp(arg, "-flazy") == 0) {
+        options->lazy = true;
+    } else if (strcmp(arg, "-fno-lazy") == 0) {
+        options->lazy = false;
+    } else if (strcmp(arg, "-ficf") == 0) {
+        options->fold = true;
+    } else if (strcmp(arg, "-fno-icf") == 0) {
+        options->fold = false;
+    } else if (strcmp(arg, "-g") == 0) {
+        options->debug_info = true;
+    } else if (strcmp(arg, "-g0") == 0) {
+        options->debug_info = false;
+    } else if (strncmp(arg, "--export=", 9) == 0) {
+        options->lazy = true;
+        options->exports = arg + 9;
+    } else {
+        return false;
     }
-    return -1;
+    return true;
 }
 
-int scopes_total_allocated(Scopes *scopes) {
-    int total = 0;
-    for (unsigned int i = 0; i < scopes->count; ++i) {
-        total += scopes->scopes[i].allocated_stack;
-    }
-    return total;
+// Fill a node with a numeric litteral
+void ast_number(AstNode *node, int num) {
+    node->kind = K_NUMBER;
+    node->count = 0;
+    node->data.num = num;
 }
 
-typedef struct AsmState {
-    Scopes scopes;
-    // The name of the current function
-    char *function_name;
-    // The current label index
-    int label_index;
-    // The stream we're generating to
-    FILE *out;
-} AsmState;
+// Fill a node with an identifier, which gets its own copy of the name
+void ast_identifier(AstNode *node, char const *name) {
+    node->kind = K_IDENTIFIER;
+    node->count = 0;
+    ast_set_string(node, xstrdup(name));
+}
 
-AsmState *asm_init(FILE *out) {
-    AsmState *st = malloc(sizeof(AsmState));
-    st->out = out;
-    scopes_init(&st->scopes);
-    return st;
+// Fill a node with a binary operation, taking ownership of both operands
+void ast_binary(AstNode *node, AstKind kind, AstNode left, AstNode right) {
+    node->kind = kind;
+    AstNode *children = ast_alloc_children(node, 2);
+    children[0] = left;
+    children[1] = right;
 }
 
-void asm_enter_function(AsmState *st, char *function_name) {
-    st->function_name = function_name;
-    st->label_index = 0;
-    scopes_enter(&st->scopes);
+// Fill a node with the statement `name = value;`, keeping its line
+void ast_assign_statement(AstNode *node, char const *name, AstNode value) {
+    AstNode ident;
+    ast_identifier(&ident, name);
+    node->kind = K_EXPR_STATEMENT;
+    AstNode *top = ast_alloc_children(node, 1);
+    top->kind = K_TOP_EXPR;
+    ast_binary(ast_alloc_children(top, 1), K_ASSIGN, ident, value);
 }
 
-void asm_new_ident(AsmState *st, char *new) {
-    if (scopes_offset_of(&st->scopes, new) >= 0) {
-        Scope *current = st->scopes.scopes + st->scopes.count - 1;
-        bool in_current = idents_index_of(&current->identifiers, new) >= 0;
-        if (in_current) {
-            puts("Error:");
-            printf("Attempting to declare identifier %s twice\n", new);
-            exit(-1);
-        }
+// Fill a node with a deep copy of another tree
+//
+// Names never change once in the pool, so the copy shares them.
+void ast_clone(AstNode *dst, AstNode *src) {
+    *dst = *src;
+    if (src->kind == K_NUMBER || src->kind == K_IDENTIFIER) {
+        return;
     }
-    Scope *current = st->scopes.scopes + st->scopes.count - 1;
-    idents_insert(&current->identifiers, new);
-    int index = current->identifiers.count - 1;
-    int offset = current->initial_offset + (index << 2);
-    int total_allocated = scopes_total_allocated(&st->scopes);
-    if (offset >= total_allocated) {
-        current->allocated_stack += 16;
-        fputs("\tsub rsp, 16\n", st->out);
+    AstNode *children = ast_alloc_children(dst, src->count);
+    for (unsigned int i = 0; i < src->count; ++i) {
+        ast_clone(children + i, ast_children(src) + i);
     }
 }
 
-// We might not need to clear the stack if there was a return
-void asm_exit_scope(AsmState *st, bool clear_stack) {
-    Scope *current = st->scopes.scopes + st->scopes.count - 1;
-    if (clear_stack && current->allocated_stack > 0) {
-        fprintf(st->out, "\tadd\trsp, %d\n", current->allocated_stack);
+// Make room for a new child at `index`, returning a pointer to it
+AstNode *ast_insert_child(AstNode *node, unsigned int index) {
+    AstNode *old = ast_children(node);
+    unsigned int count = node->count;
+    AstNode *children = ast_alloc_children(node, count + 1);
+    memcpy(children, old, index * sizeof(AstNode));
+    memcpy(children + index + 1, old + index,
+           (count - index) * sizeof(AstNode));
+    return children + index;
+}
+
+// Count the nodes in a tree
+int ast_size(AstNode *node) {
+    int size = 1;
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return size;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        size += ast_size(ast_children(node) + i);
     }
-    scopes_exit(&st->scopes);
+    return size;
 }
 
-char *asm_reg_for_nth_function_param(bool is64, int n) {
-    switch (n) {
-    case 0:
-        return is64 ? "rdi" : "edi";
-    case 1:
-        return is64 ? "rsi" : "esi";
-    case 2:
-        return is64 ? "rdx" : "edx";
-    case 3:
-        return is64 ? "rcx" : "ecx";
-    case 4:
-        return is64 ? "r8" : "r8d";
-    case 5:
-        return is64 ? "r9" : "r9d";
-    default:
-        puts("Function has more than 6 parameters");
-        exit(-1);
+bool ast_is_identifier(AstNode *node, char const *name) {
+    return node->kind == K_IDENTIFIER && strcmp(ast_string(node), name) == 0;
+}
+
+// Check whether or not an expression might do more than produce a value
+bool ast_has_effects(AstNode *node) {
+    if (node->kind == K_CALL || node->kind == K_ASSIGN) {
+        return true;
+    }
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return false;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        if (ast_has_effects(ast_children(node) + i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Count the assignments to, or declarations of, an identifier in a tree
+int ast_count_writes(AstNode *node, char const *name) {
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return 0;
+    }
+    int writes = 0;
+    bool declares = node->kind == K_INIT_DECLARATION ||
+                    node->kind == K_NO_INIT_DECLARATION;
+    if (node->kind == K_ASSIGN || declares) {
+        if (ast_is_identifier(ast_children(node), name)) {
+            // We count shadowing declarations as writes, to stay conservative
+            writes += declares ? 2 : 1;
+        }
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        writes += ast_count_writes(ast_children(node) + i, name);
     }
+    return writes;
 }
 
-void asm_expr(AsmState *st, AstNode *node);
+// Holds the state shared by the optimization passes
+typedef struct Optimizer {
+    // The options we were given
+    Options *options;
+    // Used to create fresh names for the variables we introduce
+    int temp_index;
+} Optimizer;
 
-void asm_call(AsmState *st, AstNode *node) {
-    assert(node->kind == K_CALL);
-    AstNode *name = node->data.children;
-    AstNode *params = node->data.children + 1;
-    assert(name->kind == K_IDENTIFIER);
-    assert(params->kind == K_PARAMS);
-    for (unsigned int i = 0; i < params->count; ++i) {
-        asm_expr(st, params->data.children + i);
-        char *reg = asm_reg_for_nth_function_param(true, i);
-        fprintf(st->out, "\tpop\t%s\n", reg);
+// Create a variable name that can't conflict with the program's names
+char *opt_fresh_name(Optimizer *opt) {
+    char *name = xmalloc(BASE_STRING_SIZE);
+    // A `.` can't appear in identifiers, so this never shadows anything
+    snprintf(name, BASE_STRING_SIZE, "iv.%d", opt->temp_index++);
+    return name;
+}
+
+// Represents a variable changing by a constant amount each loop iteration
+typedef struct Induction {
+    // The variable being updated
+    char *name;
+    // How much the variable changes by in each iteration, wrapping around
+    unsigned int step;
+} Induction;
+
+// Check if a statement looks like `x = x + c`, `x = c + x` or `x = x - c`
+bool opt_match_increment(AstNode *node, char **name, unsigned int *step) {
+    if (node->kind != K_EXPR_STATEMENT || node->count != 1) {
+        return false;
+    }
+    AstNode *top = ast_children(node);
+    if (top->count != 1 || ast_children(top)->kind != K_ASSIGN) {
+        return false;
+    }
+    AstNode *assign = ast_children(top);
+    char *target = ast_string(ast_children(assign));
+    AstNode *value = ast_children(assign) + 1;
+    if (value->kind != K_ADD && value->kind != K_SUB) {
+        return false;
+    }
+    AstNode *left = ast_children(value);
+    AstNode *right = ast_children(value) + 1;
+    if (value->kind == K_ADD && left->kind == K_NUMBER) {
+        AstNode *tmp = left;
+        left = right;
+        right = tmp;
+    }
+    if (!ast_is_identifier(left, target) || right->kind != K_NUMBER) {
+        return false;
     }
-    fprintf(st->out, "\tcall\t%s\n", name->data.string);
-    fputs("\tpush\trax\n", st->out);
+    *name = target;
+    *step = right->data.num;
+    if (value->kind == K_SUB) {
+        *step = -*step;
+    }
+    return true;
 }
 
-void asm_expr(AsmState *st, AstNode *node) {
-    switch (node->kind) {
-    case K_NUMBER:
-        fprintf(st->out, "\tpush\t%d\n", node->data.num);
-        break;
-    case K_IDENTIFIER: {
-        char *ident = node->data.string;
-        int offset = scopes_offset_of(&st->scopes, ident);
-        if (offset < 0) {
-            printf("Error:\nUse of undeclared identifier %s\n", ident);
-            exit(-1);
+// The inverse of an odd number modulo 2^32
+unsigned int opt_inverse(unsigned int odd) {
+    // Each Newton step doubles the number of correct low bits
+    unsigned int inverse = odd;
+    for (int i = 0; i < 4; ++i) {
+        inverse *= 2 - odd * inverse;
+    }
+    return inverse;
+}
+
+// Replace a loop by assignments of its final values, returning true on success
+//
+// This works for loops like `while (i != n) { i = i + 1; x = x + 2; }`, where
+// each statement of the body updates a variable by a constant amount. Since
+// our arithmetic wraps, a counter moving by an odd step always reaches the
+// bound after `(n - i) * step^-1` iterations, so the closed form is exact.
+bool opt_closed_form(AstNode *node) {
+    AstNode *cond = ast_children(node);
+    AstNode *body = ast_children(node) + 1;
+    if (cond->kind != K_NOT_EQUALS) {
+        return false;
+    }
+    AstNode *statements = body;
+    unsigned int count = 1;
+    if (body->kind == K_BLOCK) {
+        statements = ast_children(body);
+        count = body->count;
+    }
+    Induction *ivs = xmalloc((count + 1) * sizeof(Induction));
+    unsigned int iv_count = 0;
+    bool matched = true;
+    for (unsigned int i = 0; i < count && matched; ++i) {
+        AstNode *statement = statements + i;
+        // Anything after this is never executed
+        if (statement->kind == K_CONTINUE) {
+            break;
         }
-        fprintf(st->out, "\tmov\teax, DWORD PTR [rbp - %d]\n", offset);
-        fputs("\tpush\trax\n", st->out);
-    } break;
-    case K_CALL:
-        asm_call(st, node);
-        break;
-    case K_ASSIGN:
-        asm_expr(st, node->data.children + 1);
-        char *ident = node->data.children->data.string;
-        int offset = scopes_offset_of(&st->scopes, ident);
-        if (offset < 0) {
-            printf("Error:\nAssignment to undeclared identifier %s\n", ident);
-            exit(-1);
-        }
-        // We can just keep the top of the stack as our eventual return
-        fputs("\tmov\trax, QWORD PTR [rsp]\n", st->out);
-        fprintf(st->out, "\tmov\tDWORD PTR [rbp - %d], eax\n", offset);
-        break;
-    case K_EQUALS:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tcmp\trax, rbx\n", st->out);
-        fputs("\tsete\tal\n", st->out);
-        fputs("\tmovzx\teax, al\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_NOT_EQUALS:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tcmp\trax, rbx\n", st->out);
-        fputs("\tsetne\tal\n", st->out);
-        fputs("\tmovzx\teax, al\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_ADD:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tadd\teax, ebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_SUB:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tsub\teax, ebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_MUL:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\timul\teax, ebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
+        if (statement->kind == K_EXPR_STATEMENT && statement->count == 0) {
+            continue;
+        }
+        char *name;
+        unsigned int step;
+        matched = opt_match_increment(statement, &name, &step);
+        if (!matched) {
+            break;
+        }
+        unsigned int j = 0;
+        while (j < iv_count && strcmp(ivs[j].name, name) != 0) {
+            ++j;
+        }
+        if (j == iv_count) {
+            ivs[iv_count].name = name;
+            ivs[iv_count].step = 0;
+            ++iv_count;
+        }
+        ivs[j].step += step;
+    }
+    AstNode *counter = ast_children(cond);
+    AstNode *bound = ast_children(cond) + 1;
+    Induction *counter_iv = NULL;
+    for (int side = 0; matched && side < 2 && counter_iv == NULL; ++side) {
+        for (unsigned int j = 0; j < iv_count; ++j) {
+            if (ast_is_identifier(counter, ivs[j].name)) {
+                counter_iv = ivs + j;
+            }
+        }
+        if (counter_iv == NULL) {
+            AstNode *tmp = counter;
+            counter = bound;
+            bound = tmp;
+        }
+    }
+    // An even step might skip over the bound, and loop forever
+    if (counter_iv == NULL || (counter_iv->step & 1) == 0) {
+        xfree(ivs);
+        return false;
+    }
+    if (bound->kind == K_IDENTIFIER) {
+        for (unsigned int j = 0; j < iv_count; ++j) {
+            if (ast_is_identifier(bound, ivs[j].name)) {
+                xfree(ivs);
+                return false;
+            }
+        }
+    } else if (bound->kind != K_NUMBER) {
+        xfree(ivs);
+        return false;
+    }
+    char *counter_name = counter_iv->name;
+    unsigned int inverse = opt_inverse(counter_iv->step);
+    AstNode block;
+    block.line = node->line;
+    AstNode *replacement = ast_alloc_children(&block, iv_count + 1);
+    unsigned int replacement_count = 0;
+    for (unsigned int j = 0; j < iv_count; ++j) {
+        unsigned int scale = ivs[j].step * inverse;
+        if (ivs + j == counter_iv || scale == 0) {
+            continue;
+        }
+        // x = x + (n - i) * scale
+        AstNode left, right, trips, delta, value;
+        if (bound->kind == K_NUMBER) {
+            ast_number(&left, bound->data.num);
+        } else {
+            ast_identifier(&left, ast_string(bound));
+        }
+        ast_identifier(&right, counter_name);
+        ast_binary(&trips, K_SUB, left, right);
+        if (scale == 1) {
+            delta = trips;
+        } else {
+            AstNode factor;
+            ast_number(&factor, scale);
+            ast_binary(&delta, K_MUL, trips, factor);
+        }
+        AstNode self;
+        ast_identifier(&self, ivs[j].name);
+        ast_binary(&value, K_ADD, self, delta);
+        replacement[replacement_count].line = node->line;
+        ast_assign_statement(replacement + replacement_count++, ivs[j].name,
+                             value);
+    }
+    AstNode final;
+    if (bound->kind == K_NUMBER) {
+        ast_number(&final, bound->data.num);
+    } else {
+        ast_identifier(&final, ast_string(bound));
+    }
+    replacement[replacement_count].line = node->line;
+    ast_assign_statement(replacement + replacement_count++, counter_name,
+                         final);
+    xfree(ivs);
+    block.kind = K_BLOCK;
+    block.count = replacement_count;
+    *node = block;
+    return true;
+}
+
+// Find a product `name * c` or `c * name` inside a tree
+AstNode *opt_find_product(AstNode *node, char const *name) {
+    if (node->kind == K_MUL) {
+        AstNode *left = ast_children(node);
+        AstNode *right = ast_children(node) + 1;
+        if ((ast_is_identifier(left, name) && right->kind == K_NUMBER) ||
+            (ast_is_identifier(right, name) && left->kind == K_NUMBER)) {
+            return node;
+        }
+    }
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return NULL;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        AstNode *found = opt_find_product(ast_children(node) + i, name);
+        if (found != NULL) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+// Replace every product `name * factor` in a tree with a variable
+void opt_replace_product(AstNode *node, char const *name, int factor,
+                         char const *replacement) {
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return;
+    }
+    if (node->kind == K_MUL) {
+        AstNode *left = ast_children(node);
+        AstNode *right = ast_children(node) + 1;
+        if ((ast_is_identifier(left, name) && right->kind == K_NUMBER &&
+             right->data.num == factor) ||
+            (ast_is_identifier(right, name) && left->kind == K_NUMBER &&
+             left->data.num == factor)) {
+            ast_identifier(node, replacement);
+            return;
+        }
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        opt_replace_product(ast_children(node) + i, name, factor,
+                            replacement);
+    }
+}
+
+// Replace products of induction variables in a loop with additions
+//
+// For each `i = i + c` at the top of the body, with `i` assigned nowhere else,
+// every `i * k` becomes a new variable `t`, initialized to `i * k` before the
+// loop and increased by `c * k` right after `i` is updated.
+void opt_strength_reduce(Optimizer *opt, AstNode *node) {
+    AstNode *cond = ast_children(node);
+    AstNode *body = ast_children(node) + 1;
+    if (body->kind != K_BLOCK) {
+        return;
+    }
+    unsigned int decl_count = 0;
+    AstNode *decls = NULL;
+    for (unsigned int i = 0; i < body->count; ++i) {
+        char *name;
+        unsigned int step;
+        if (!opt_match_increment(ast_children(body) + i, &name, &step)) {
+            continue;
+        }
+        if (ast_count_writes(body, name) != 1 ||
+            ast_count_writes(cond, name) != 0) {
+            continue;
+        }
+        AstNode *product = opt_find_product(body, name);
+        if (product == NULL) {
+            product = opt_find_product(cond, name);
+        }
+        while (product != NULL) {
+            AstNode *left = ast_children(product);
+            AstNode *right = ast_children(product) + 1;
+            int factor = (left->kind == K_NUMBER ? left : right)->data.num;
+            char *temp = opt_fresh_name(opt);
+            opt_replace_product(cond, name, factor, temp);
+            opt_replace_product(body, name, factor, temp);
+            // temp = temp + step * factor, right after the increment
+            AstNode self, delta, value;
+            ast_identifier(&self, temp);
+            ast_number(&delta, step * (unsigned int)factor);
+            ast_binary(&value, K_ADD, self, delta);
+            AstNode *update = ast_insert_child(body, i + 1);
+            update->line = ast_children(body)[i].line;
+            ast_assign_statement(update, temp, value);
+            // int temp = name * factor, before the loop
+            decls = xrealloc(decls, (decl_count + 1) * sizeof(AstNode));
+            AstNode declarator, init_left, init_right;
+            ast_identifier(&declarator, temp);
+            ast_identifier(&init_left, name);
+            ast_number(&init_right, factor);
+            AstNode init;
+            ast_binary(&init, K_MUL, init_left, init_right);
+            ast_binary(decls + decl_count++, K_INIT_DECLARATION, declarator,
+                       init);
+            xfree(temp);
+            product = opt_find_product(body, name);
+            if (product == NULL) {
+                product = opt_find_product(cond, name);
+            }
+        }
+    }
+    if (decl_count == 0) {
+        return;
+    }
+    // { int t = i * k; while (...) ... }
+    AstNode loop = *node;
+    node->kind = K_BLOCK;
+    AstNode *block = ast_alloc_children(node, 2);
+    block[0].kind = K_DECLARATION;
+    block[0].line = loop.line;
+    memcpy(ast_alloc_children(block, decl_count), decls,
+           decl_count * sizeof(AstNode));
+    xfree(decls);
+    block[1] = loop;
+}
+
+// Run the loop optimizations on every loop in a tree, innermost first
+void opt_loops(Optimizer *opt, AstNode *node) {
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        opt_loops(opt, ast_children(node) + i);
+    }
+    if (node->kind == K_WHILE && !opt_closed_form(node)) {
+        opt_strength_reduce(opt, node);
+    }
+}
+
+// The most expensive arms we'll evaluate unconditionally to avoid a branch
+#define IF_CONVERT_MAX_COST 8
+
+// Estimate the cost of evaluating an expression, or < 0 if it can't be
+// evaluated speculatively
+int opt_speculation_cost(AstNode *node) {
+    switch (node->kind) {
+    case K_NUMBER:
+    case K_IDENTIFIER:
+        return 1;
+    case K_CALL:
+    case K_ASSIGN:
+        return -1;
     case K_DIV:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tcdq\n", st->out);
-        fputs("\tidiv\tebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_MOD:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tcdq\n", st->out);
-        fputs("\tidiv\tebx\n", st->out);
-        fputs("\tpush\trdx\n", st->out);
-        break;
-    case K_BIT_AND:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tand\teax, ebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_BIT_OR:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tor\teax, ebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_BIT_XOR:
-        asm_expr(st, node->data.children);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trbx\n", st->out);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\txor\teax, ebx\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_BIT_NOT:
-        asm_expr(st, node->data.children);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tnot\teax\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_NEGATE:
-        asm_expr(st, node->data.children);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tneg\teax\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
-    case K_LOGICAL_NOT:
-        asm_expr(st, node->data.children);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\ttest\teax, eax\n", st->out);
-        fputs("\tsete\tal\n", st->out);
-        fputs("\tmovzx\teax, al\n", st->out);
-        fputs("\tpush\trax\n", st->out);
-        break;
+    case K_MOD: {
+        // Dividing by 0 would trap in a branch that was never taken
+        AstNode *divisor = ast_children(node) + 1;
+        if (divisor->kind != K_NUMBER || divisor->data.num == 0) {
+            return -1;
+        }
+    } break;
     default:
         break;
     }
+    int cost = node->kind == K_MUL ? 3 : 1;
+    if (node->kind == K_DIV || node->kind == K_MOD) {
+        cost = 20;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        int child = opt_speculation_cost(ast_children(node) + i);
+        if (child < 0) {
+            return -1;
+        }
+        cost += child;
+    }
+    return cost;
 }
 
-void asm_declare(AsmState *st, AstNode *node) {
-    if (node->kind == K_NO_INIT_DECLARATION) {
-        char *identifier = node->data.children[0].data.string;
-        asm_new_ident(st, identifier);
-    } else if (node->kind == K_INIT_DECLARATION) {
-        char *identifier = node->data.children[0].data.string;
-        asm_new_ident(st, identifier);
-        asm_expr(st, node->data.children + 1);
-        fputs("\tpop\trax\n", st->out);
-        int offset = scopes_offset_of(&st->scopes, identifier);
-        if (offset < 0) {
-            printf("Error:\nStack offset %d < 0\n", offset);
-            exit(-1);
+// Find the assignment in a statement like `x = a;` or `{ x = a; }`
+AstNode *opt_single_assignment(AstNode *node) {
+    if (node->kind == K_BLOCK && node->count == 1) {
+        node = ast_children(node);
+    }
+    if (node->kind != K_EXPR_STATEMENT || node->count != 1) {
+        return NULL;
+    }
+    AstNode *top = ast_children(node);
+    if (top->count != 1 || ast_children(top)->kind != K_ASSIGN) {
+        return NULL;
+    }
+    return ast_children(top);
+}
+
+// Replace `if (c) x = a; else x = b;` by `x = select(c, a, b);`
+void opt_if_convert(AstNode *node) {
+    AstNode *then_assign = opt_single_assignment(ast_children(node) + 1);
+    if (then_assign == NULL) {
+        return;
+    }
+    char *name = ast_string(ast_children(then_assign));
+    AstNode *then_value = ast_children(then_assign) + 1;
+    AstNode else_value;
+    if (node->count == 3) {
+        AstNode *else_assign = opt_single_assignment(ast_children(node) + 2);
+        if (else_assign == NULL ||
+            !ast_is_identifier(ast_children(else_assign), name)) {
+            return;
         }
-        fprintf(st->out, "\tmov\tDWORD PTR [rbp - %d], eax\n", offset);
+        else_value = ast_children(else_assign)[1];
     } else {
-        panic("Tried to process declaration, but kind was invalid");
+        // Without an else branch, the variable keeps its value
+        ast_identifier(&else_value, name);
+    }
+    int then_cost = opt_speculation_cost(then_value);
+    int else_cost = opt_speculation_cost(&else_value);
+    if (then_cost < 0 || else_cost < 0 ||
+        then_cost + else_cost > IF_CONVERT_MAX_COST) {
+        return;
     }
+    AstNode select;
+    select.kind = K_SELECT;
+    AstNode *children = ast_alloc_children(&select, 3);
+    children[0] = ast_children(node)[0];
+    children[1] = *then_value;
+    children[2] = else_value;
+    ast_assign_statement(node, name, select);
 }
 
-void asm_top_expr(AsmState *st, AstNode *node) {
-    assert(node->kind == K_TOP_EXPR);
+// Run if-conversion on every if statement in a tree
+void opt_branches(Optimizer *opt, AstNode *node) {
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return;
+    }
     for (unsigned int i = 0; i < node->count; ++i) {
-        asm_expr(st, node->data.children + i);
+        opt_branches(opt, ast_children(node) + i);
     }
-    // This will ignore all of the extra stack items we pushed
-    if (node->count > 1) {
-        fprintf(st->out, "\tadd\trsp, %d\n", (node->count - 1) << 3);
+    if (node->kind == K_IF) {
+        opt_if_convert(node);
     }
 }
 
-// Return true if code appearing after this statement is unreachable
-bool asm_statement(AsmState *st, AstNode *node, int start_label,
-                   int end_label) {
-    bool after_unreachable = false;
-    if (node->kind == K_RETURN) {
-        asm_top_expr(st, node->data.children);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\tmov\trsp, rbp\n", st->out);
-        fputs("\tpop\trbp\n", st->out);
-        fputs("\tret\n", st->out);
-        after_unreachable = true;
-    } else if (node->kind == K_EXPR_STATEMENT) {
-        if (node->count == 1) {
-            asm_top_expr(st, node->data.children);
-            fputs("\tadd\trsp, 8\n", st->out);
+// Loops running at most this many times are unrolled completely
+#define FULL_UNROLL_MAX_TRIPS 16
+// The most nodes we'll create when unrolling a loop completely
+#define FULL_UNROLL_MAX_NODES 512
+
+// Represents a variable we know the value of at some point in a block
+typedef struct KnownValue {
+    // The variable's name
+    char *name;
+    // The value it has
+    int value;
+} KnownValue;
+
+typedef struct KnownValues {
+    // The variables we know the value of
+    KnownValue *values;
+    // The number of slots we've filled
+    unsigned int count;
+    // The number of slots we have available
+    unsigned int capacity;
+} KnownValues;
+
+void known_set(KnownValues *known, char *name, int value) {
+    for (unsigned int i = 0; i < known->count; ++i) {
+        if (strcmp(known->values[i].name, name) == 0) {
+            known->values[i].value = value;
+            return;
         }
-    } else if (node->kind == K_DECLARATION) {
-        for (unsigned int i = 0; i < node->count; ++i) {
-            asm_declare(st, node->data.children + i);
+    }
+    if (known->count == known->capacity) {
+        known->capacity = known->capacity == 0 ? 4 : known->capacity << 1;
+        known->values =
+            xrealloc(known->values, known->capacity * sizeof(KnownValue));
+    }
+    KnownValue *new = known->values + known->count++;
+    new->name = name;
+    new->value = value;
+}
+
+// Returns NULL if we don't know the value of a variable
+KnownValue *known_get(KnownValues *known, char const *name) {
+    for (unsigned int i = 0; i < known->count; ++i) {
+        if (strcmp(known->values[i].name, name) == 0) {
+            return known->values + i;
         }
-    } else if (node->kind == K_IF) {
-        int label = st->label_index++;
-        asm_expr(st, node->data.children);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\ttest\teax, eax\n", st->out);
-        fprintf(st->out, "\tje\t.%s%d\n", st->function_name, label);
-        bool if_returns =
-            asm_statement(st, node->data.children + 1, start_label, end_label);
-        fprintf(st->out, ".%s%d:\n", st->function_name, label);
-        bool else_returns = false;
-        if (node->count == 3) {
-            else_returns = asm_statement(st, node->data.children + 2,
-                                         start_label, end_label);
+    }
+    return NULL;
+}
+
+// Forget about all the variables a statement might change
+void known_invalidate(KnownValues *known, AstNode *node) {
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < known->count; ++i) {
+        if (ast_count_writes(node, known->values[i].name) == 0) {
+            known->values[kept++] = known->values[i];
         }
-        after_unreachable = if_returns && else_returns;
-    } else if (node->kind == K_WHILE) {
-        int start_label = st->label_index++;
-        int end_label = st->label_index++;
-        fprintf(st->out, ".%s%d:\n", st->function_name, start_label);
-        asm_expr(st, node->data.children);
-        fputs("\tpop\trax\n", st->out);
-        fputs("\ttest\teax, eax\n", st->out);
-        fprintf(st->out, "\tje\t.%s%d\n", st->function_name, end_label);
-        asm_statement(st, node->data.children + 1, start_label, end_label);
-        fprintf(st->out, "\tjmp\t.%s%d\n", st->function_name, start_label);
-        fprintf(st->out, ".%s%d:\n", st->function_name, end_label);
-    } else if (node->kind == K_BLOCK) {
-        scopes_enter(&st->scopes);
+    }
+    known->count = kept;
+}
+
+// Learn the values a statement gives to variables
+void known_update(KnownValues *known, AstNode *node) {
+    known_invalidate(known, node);
+    if (node->kind == K_DECLARATION) {
         for (unsigned int i = 0; i < node->count; ++i) {
-            if (asm_statement(st, node->data.children + i, start_label,
-                              end_label)) {
-                asm_exit_scope(st, false);
-                return true;
+            AstNode *decl = ast_children(node) + i;
+            if (decl->kind == K_INIT_DECLARATION &&
+                ast_children(decl)[1].kind == K_NUMBER) {
+                known_set(known, ast_string(ast_children(decl)),
+                          ast_children(decl)[1].data.num);
             }
         }
-        asm_exit_scope(st, true);
-    } else if (node->kind == K_BREAK) {
-        fprintf(st->out, "\tjmp\t.%s%d\n", st->function_name, end_label);
-    } else if (node->kind == K_CONTINUE) {
-        fprintf(st->out, "\tjmp\t.%s%d\n", st->function_name, start_label);
     } else {
-        panic("Unable to handle statement type");
+        AstNode *assign = opt_single_assignment(node);
+        if (node->kind == K_EXPR_STATEMENT && assign != NULL &&
+            ast_children(assign)[1].kind == K_NUMBER) {
+            known_set(known, ast_string(ast_children(assign)),
+                      ast_children(assign)[1].data.num);
+        }
     }
-    return after_unreachable;
 }
 
-void asm_function(AsmState *st, AstNode *node) {
-    assert(node->kind == K_FUNCTION);
-    AstNode *name = node->data.children;
-    assert(name->kind == K_IDENTIFIER);
-    asm_enter_function(st, name->data.string);
-    fprintf(st->out, "\t.globl %s\n", name->data.string);
-    fprintf(st->out, "%s:\n", name->data.string);
-    fputs("\tpush\trbp\n", st->out);
-    fputs("\tmov\trbp, rsp\n", st->out);
-    AstNode *params = node->data.children + 1;
-    assert(params->kind == K_PARAMS);
-    for (unsigned int i = 0; i < params->count; ++i) {
-        assert(params->data.children[i].kind == K_IDENTIFIER);
-        char *param_id = params->data.children[i].data.string;
-        asm_new_ident(st, param_id);
-        int offset = scopes_offset_of(&st->scopes, param_id);
-        if (offset < 0) {
-            printf("Error:\nStack offset %d < 0\n", offset);
-            exit(-1);
-        }
-        char *reg = asm_reg_for_nth_function_param(false, i);
-        fprintf(st->out, "\tmov\tDWORD PTR [rbp - %d], %s\n", offset, reg);
+// Check if a statement can leave or restart the loop directly containing it
+bool ast_has_loop_exit(AstNode *node) {
+    if (node->kind == K_BREAK || node->kind == K_CONTINUE) {
+        return true;
     }
-    AstNode *block = node->data.children + 2;
-    assert(block->kind == K_BLOCK);
-    for (unsigned int i = 0; i < block->count; ++i) {
-        if (asm_statement(st, block->data.children + i, -1, -1)) {
-            asm_exit_scope(st, false);
-            return;
+    if (node->kind == K_WHILE || node->kind == K_IDENTIFIER ||
+        node->kind == K_NUMBER) {
+        return false;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        if (ast_has_loop_exit(ast_children(node) + i)) {
+            return true;
         }
     }
-    asm_exit_scope(st, true);
+    return false;
 }
 
-void asm_gen(AsmState *st, AstNode *root) {
-    fputs("\t.intel_syntax noprefix\n", st->out);
-    assert(root->kind == K_TOP_LEVEL);
-    for (unsigned int i = 0; i < root->count; ++i) {
-        asm_function(st, root->data.children + i);
+// Check if a statement is `if (name == end) break;`, writing out the end
+bool opt_match_exit_test(AstNode *node, char const *name, int *end) {
+    if (node->kind != K_IF || node->count != 2) {
+        return false;
+    }
+    AstNode *cond = ast_children(node);
+    AstNode *then = ast_children(node) + 1;
+    if (then->kind == K_BLOCK && then->count == 1) {
+        then = ast_children(then);
+    }
+    if (cond->kind != K_EQUALS || then->kind != K_BREAK) {
+        return false;
+    }
+    AstNode *left = ast_children(cond);
+    AstNode *right = ast_children(cond) + 1;
+    if (left->kind == K_NUMBER) {
+        AstNode *tmp = left;
+        left = right;
+        right = tmp;
+    }
+    if (!ast_is_identifier(left, name) || right->kind != K_NUMBER) {
+        return false;
     }
+    *end = right->data.num;
+    return true;
 }
 
-typedef enum CompileStage {
-    STAGE_LEX,
-    STAGE_PARSE,
-    STAGE_COMPILE
-} CompileStage;
+// Make a block holding a copy of a loop body, followed by the increment
+void opt_body_copy(AstNode *node, AstNode *statements, unsigned int count,
+                   AstNode *increment) {
+    node->kind = K_BLOCK;
+    node->line = increment->line;
+    AstNode *children = ast_alloc_children(node, count + 1);
+    for (unsigned int i = 0; i < count; ++i) {
+        ast_clone(children + i, statements + i);
+    }
+    ast_clone(children + count, increment);
+}
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        panic("Must have a file to compile as an argument.");
+// Try to unroll a loop whose counter starts with a known value
+//
+// We recognize `while (i != n) { ...; i = i + c; }` as well as
+// `while (1) { if (i == n) break; ...; i = i + c; }`, when nothing else
+// changes `i` or leaves the loop. Loops with few iterations are replaced by
+// copies of their body, others get a loop running several copies of the body
+// per test, followed by the original loop to run the remaining iterations.
+void opt_unroll(Optimizer *opt, AstNode *node, KnownValues *known) {
+    AstNode *cond = ast_children(node);
+    AstNode *body = ast_children(node) + 1;
+    if (body->kind != K_BLOCK || body->count < 1) {
+        return;
     }
-    char *in_filename = argv[1];
-    char *out_filename = "a.s";
-    if (argc > 2) {
-        out_filename = argv[2];
+    AstNode *statements = ast_children(body);
+    unsigned int count = body->count - 1;
+    AstNode *increment = statements + count;
+    char *name;
+    unsigned int step;
+    if (!opt_match_increment(increment, &name, &step) || step == 0) {
+        return;
     }
-    CompileStage stage = STAGE_COMPILE;
-    if (argc > 3) {
-        char *stage_str = argv[3];
-        if (strcmp(stage_str, "lex") == 0) {
-            stage = STAGE_LEX;
-        } else if (strcmp(stage_str, "parse") == 0) {
-            stage = STAGE_PARSE;
-        } else if (strcmp(stage_str, "compile") == 0) {
-            stage = STAGE_COMPILE;
+    KnownValue *start = known_get(known, name);
+    if (start == NULL || ast_count_writes(body, name) != 1 ||
+        ast_count_writes(cond, name) != 0) {
+        return;
+    }
+    int end;
+    if (cond->kind == K_NOT_EQUALS) {
+        AstNode *left = ast_children(cond);
+        AstNode *right = ast_children(cond) + 1;
+        if (left->kind == K_NUMBER) {
+            AstNode *tmp = left;
+            left = right;
+            right = tmp;
+        }
+        if (!ast_is_identifier(left, name) || right->kind != K_NUMBER) {
+            return;
         }
+        end = right->data.num;
+    } else if (cond->kind == K_NUMBER && cond->data.num != 0 && count >= 1 &&
+               opt_match_exit_test(statements, name, &end)) {
+        // The exit test has no effects, so copies of the body can skip it
+        ++statements;
+        --count;
+    } else {
+        return;
     }
-    FILE *in = fopen(in_filename, "r");
-    if (in == NULL) {
-        panic("Failed to open the input file.");
+    for (unsigned int i = 0; i < count; ++i) {
+        if (ast_has_loop_exit(statements + i)) {
+            return;
+        }
     }
-    size_t length;
-    if (fseek(in, 0, SEEK_END)) {
-        panic("Failed to seek to the end of the input file");
+    long long distance = (long long)end - start->value;
+    long long delta = (int)step;
+    if (distance % delta != 0 || distance / delta < 0) {
+        return;
     }
-    length = ftell(in);
-    if (fseek(in, 0, SEEK_SET)) {
-        panic("Failed to rewind input file");
+    long long trips = distance / delta;
+    int body_size = ast_size(body);
+    if (trips <= FULL_UNROLL_MAX_TRIPS &&
+        trips * body_size <= FULL_UNROLL_MAX_NODES) {
+        AstNode block;
+        block.kind = K_BLOCK;
+        block.line = node->line;
+        AstNode *copies = ast_alloc_children(&block, trips);
+        for (long long i = 0; i < trips; ++i) {
+            opt_body_copy(copies + i, statements, count, increment);
+        }
+        *node = block;
+        return;
     }
-    char *in_data = malloc(length);
-    if (in_data == NULL) {
-        panic("Failed to allocate input buffer.");
+    int factor = opt->options->unroll_factor;
+    if (factor < 2 || trips < factor) {
+        return;
     }
-    if (!fread(in_data, sizeof(char), length, in)) {
-        panic("Failed to read into input buffer.");
+    // while (i != start + (trips - trips % factor) * c) { body x factor }
+    AstNode unrolled;
+    unrolled.kind = K_WHILE;
+    unrolled.line = node->line;
+    AstNode *loop = ast_alloc_children(&unrolled, 2);
+    AstNode counter, limit;
+    ast_identifier(&counter, name);
+    ast_number(&limit, start->value + (trips - trips % factor) * delta);
+    ast_binary(loop, K_NOT_EQUALS, counter, limit);
+    loop[1].kind = K_BLOCK;
+    loop[1].line = node->line;
+    AstNode *copies = ast_alloc_children(loop + 1, factor);
+    for (int i = 0; i < factor; ++i) {
+        opt_body_copy(copies + i, statements, count, increment);
     }
-    fclose(in);
+    AstNode original = *node;
+    node->kind = K_BLOCK;
+    AstNode *block = ast_alloc_children(node, 2);
+    block[0] = unrolled;
+    block[1] = original;
+}
+
+// Unroll the loops in a tree, tracking variables with known values in blocks
+void opt_unroll_loops(Optimizer *opt, AstNode *node) {
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        opt_unroll_loops(opt, ast_children(node) + i);
+    }
+    if (node->kind != K_BLOCK) {
+        return;
+    }
+    KnownValues known = {.values = NULL, .count = 0, .capacity = 0};
+    for (unsigned int i = 0; i < node->count; ++i) {
+        AstNode *statement = ast_children(node) + i;
+        if (statement->kind == K_WHILE) {
+            opt_unroll(opt, statement, &known);
+        }
+        known_update(&known, statement);
+    }
+    xfree(known.values);
+}
+
+typedef struct Report Report;
+
+void report_phase(Report *report, char const *name, double seconds);
+
+void optimize(Options *options, AstNode *root, Report *report) {
+    if (!options->optimize) {
+        return;
+    }
+    Optimizer opt = {.options = options, .temp_index = 0};
+    double start = now_seconds();
+    opt_loops(&opt, root);
+    double end = now_seconds();
+    report_phase(report, "opt: loop induction", end - start);
+    opt_branches(&opt, root);
+    start = now_seconds();
+    report_phase(report, "opt: if-conversion", start - end);
+    if (options->unroll_factor > 0) {
+        opt_unroll_loops(&opt, root);
+        report_phase(report, "opt: unroll", now_seconds() - start);
+    }
+}
+
+typedef struct Identifiers {
+    // An array of strings holding our identifiers
+    char **identifiers;
+    // The number of slots we've filled
+    unsigned int count;
+    // The number of slots we have available
+    unsigned int capacity;
+} Identifiers;
+
+void idents_init(Identifiers *idents) {
+    idents->count = 0;
+    idents->capacity = 4;
+    idents->identifiers = xmalloc(idents->capacity * sizeof(char *));
+}
+
+void idents_insert(Identifiers *idents, char *new) {
+    if (idents->count == idents->capacity) {
+        idents->capacity <<= 1;
+        idents->identifiers =
+            xrealloc(idents->identifiers, idents->capacity * sizeof(char *));
+    }
+    idents->identifiers[idents->count++] = new;
+}
+
+// Returns < 0 for negative indices
+int idents_index_of(Identifiers *idents, char *target) {
+    for (unsigned int i = 0; i < idents->count; ++i) {
+        if (strcmp(idents->identifiers[i], target) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+typedef struct Scope {
+    // The set of identifiers created inside this scope
+    Identifiers identifiers;
+    // The initial offset for this scope
+    int initial_offset;
+} Scope;
+
+typedef struct Scopes {
+    // The stack of scopes
+    Scope *scopes;
+    // The number of slots filled
+    unsigned int count;
+    // The number of slots available
+    unsigned int capacity;
+} Scopes;
+
+void scopes_init(Scopes *new) {
+    new->count = 0;
+    new->capacity = 2;
+    new->scopes = xmalloc(new->capacity * sizeof(Scope));
+}
+
+// Enter a new scope
+void scopes_enter(Scopes *scopes) {
+    if (scopes->count == scopes->capacity) {
+        scopes->capacity <<= 1;
+        scopes->scopes =
+            xrealloc(scopes->scopes, scopes->capacity * sizeof(Scope));
+    }
+    Scope *new = scopes->scopes + scopes->count++;
+    // We don't have an old scope to look at
+    if (scopes->count == 1) {
+        // The first will take stack bytes [-4,0[
+        new->initial_offset = 4;
+    } else {
+        Scope *old = new - 1;
+        // 4 bytes for each identifier created in the previous scope
+        int previous_var_size = old->identifiers.count << 2;
+        new->initial_offset = old->initial_offset + previous_var_size;
+    }
+    idents_init(&new->identifiers);
+}
+
+void scopes_exit(Scopes *scopes) {
+    --scopes->count;
+    xfree(scopes->scopes[scopes->count].identifiers.identifiers);
+}
+
+// Returns < 0 if no identifier found
+int scopes_offset_of(Scopes *scopes, char *identifier) {
+    for (int i = scopes->count - 1; i >= 0; --i) {
+        Scope *scope = scopes->scopes + i;
+        int index = idents_index_of(&scope->identifiers, identifier);
+        if (index >= 0) {
+            return scope->initial_offset + (index << 2);
+        }
+    }
+    return -1;
+}
+
+// Before generating code for a function, we find where each of its variables
+// is live, as a range of positions in the order of its code. Variables whose
+// ranges don't overlap share a stack slot, and variables which are never read
+// don't get one at all. Code only flows backwards at the end of a loop, so a
+// variable used in a loop, but declared outside of it, lives through the
+// whole loop. A variable whose value only ends up in variables nothing reads,
+// like `c` in `d = c` when nothing reads `d`, isn't read either.
+
+// A variable of the function we're laying out
+typedef struct FrameVar {
+    char *name;
+    // The positions where the variable is first and last used
+    unsigned int start;
+    unsigned int end;
+    // Whether the variable is ever read, and so needs a slot
+    bool read;
+    // The offset of the variable's slot below rbp, or 0 if it has none
+    int offset;
+    // The first of the reads whose values end up in this variable, or -1
+    int edges;
+} FrameVar;
+
+// A read whose value ends up in another variable, and so only counts if
+// that variable is read
+typedef struct FrameEdge {
+    // The variable read
+    int var;
+    // The next read whose value ends up in the same variable, or -1
+    int next;
+} FrameEdge;
+
+// Where the value of an expression goes: it's either used, thrown away, or
+// only used if the variable with an index >= 0 is read
+#define FRAME_VALUE_USED (-1)
+#define FRAME_VALUE_UNUSED (-2)
+
+// The number of variables, uses and edges we first make room for
+#define FRAME_BASE_CAPACITY 8
+
+// An identifier in the function's code, along with what it refers to
+typedef struct FrameUse {
+    AstNode *node;
+    // The index of the variable, and then the offset of its slot
+    int var;
+} FrameUse;
+
+typedef struct Frame {
+    FrameVar *vars;
+    unsigned int var_count;
+    unsigned int var_capacity;
+    // The uses of variables, sorted by node once the slots are chosen
+    FrameUse *uses;
+    unsigned int use_count;
+    unsigned int use_capacity;
+    FrameEdge *edges;
+    unsigned int edge_count;
+    unsigned int edge_capacity;
+    // The variables in scope, innermost last
+    unsigned int *visible;
+    unsigned int visible_count;
+    unsigned int visible_capacity;
+    // Where the variables of the innermost scope start among those in scope
+    unsigned int scope_start;
+    // The position of the next use
+    unsigned int position;
+    // The number of bytes of stack the slots take, a multiple of 16
+    int size;
+} Frame;
+
+void frame_init(Frame *frame) { memset(frame, 0, sizeof(Frame)); }
+
+// Add a variable to the innermost scope, returning its index
+unsigned int frame_declare(Frame *frame, AstNode *node) {
+    char *name = ast_string(node);
+    for (unsigned int i = frame->scope_start; i < frame->visible_count; ++i) {
+        if (strcmp(frame->vars[frame->visible[i]].name, name) == 0) {
+            fputs("Error:\n", errors());
+            fprintf(errors(), "Attempting to declare identifier %s twice\n",
+                    name);
+            fail();
+        }
+    }
+    if (frame->var_count == frame->var_capacity) {
+        frame->var_capacity = 2 * frame->var_capacity + FRAME_BASE_CAPACITY;
+        frame->vars =
+            xrealloc(frame->vars, frame->var_capacity * sizeof(FrameVar));
+    }
+    if (frame->visible_count == frame->visible_capacity) {
+        frame->visible_capacity =
+            2 * frame->visible_capacity + FRAME_BASE_CAPACITY;
+        frame->visible = xrealloc(
+            frame->visible, frame->visible_capacity * sizeof(unsigned int));
+    }
+    FrameVar *var = frame->vars + frame->var_count;
+    var->name = name;
+    var->start = frame->position;
+    var->end = frame->position;
+    var->read = false;
+    var->offset = 0;
+    var->edges = -1;
+    frame->visible[frame->visible_count++] = frame->var_count;
+    return frame->var_count++;
+}
+
+// Find the variable a name refers to, or -1 if there's none in scope
+int frame_find(Frame *frame, char const *name) {
+    unsigned int i = frame->visible_count;
+    while (i > 0 && strcmp(frame->vars[frame->visible[i - 1]].name, name)) {
+        --i;
+    }
+    return i == 0 ? -1 : (int)frame->visible[i - 1];
+}
+
+// Note that the variable an identifier refers to is read or written here,
+// returning its index
+int frame_use(Frame *frame, AstNode *node, bool read, char const *what) {
+    char *name = ast_string(node);
+    int var = frame_find(frame, name);
+    if (var < 0) {
+        fprintf(errors(), "Error:\n%s undeclared identifier %s\n", what,
+                name);
+        fail();
+    }
+    frame->vars[var].end = frame->position++;
+    frame->vars[var].read = frame->vars[var].read || read;
+    if (frame->use_count == frame->use_capacity) {
+        frame->use_capacity = 2 * frame->use_capacity + FRAME_BASE_CAPACITY;
+        frame->uses =
+            xrealloc(frame->uses, frame->use_capacity * sizeof(FrameUse));
+    }
+    frame->uses[frame->use_count].node = node;
+    frame->uses[frame->use_count].var = var;
+    frame->use_count++;
+    return var;
+}
+
+// Note that a variable's value ends up in another variable
+void frame_add_edge(Frame *frame, int from, int var) {
+    if (frame->edge_count == frame->edge_capacity) {
+        frame->edge_capacity = 2 * frame->edge_capacity + FRAME_BASE_CAPACITY;
+        frame->edges =
+            xrealloc(frame->edges, frame->edge_capacity * sizeof(FrameEdge));
+    }
+    frame->edges[frame->edge_count].var = var;
+    frame->edges[frame->edge_count].next = frame->vars[from].edges;
+    frame->vars[from].edges = frame->edge_count++;
+}
+
+// Find the uses of variables in a statement or expression, in code order
+//
+// `sink` says where the value of an expression goes, like the context we
+// generate its code in: reads whose values are thrown away don't count.
+void frame_walk(Frame *frame, AstNode *node, int sink) {
+    switch (node->kind) {
+    case K_NUMBER:
+        break;
+    case K_IDENTIFIER: {
+        int var = frame_use(frame, node, sink == FRAME_VALUE_USED, "Use of");
+        if (sink >= 0) {
+            frame_add_edge(frame, sink, var);
+        }
+    } break;
+    case K_CALL:
+        frame_walk(frame, ast_children(node) + 1, FRAME_VALUE_USED);
+        break;
+    case K_ASSIGN: {
+        // When the assignment's own value is thrown away, the value assigned
+        // is only needed if the variable is read. Otherwise we don't try to
+        // be clever, since it'd take a set of variables.
+        int var = FRAME_VALUE_USED;
+        if (sink == FRAME_VALUE_UNUSED) {
+            var = frame_find(frame, ast_string(ast_children(node)));
+            var = var < 0 ? FRAME_VALUE_USED : var;
+        }
+        frame_walk(frame, ast_children(node) + 1, var);
+        frame_use(frame, ast_children(node), false, "Assignment to");
+    } break;
+    case K_NO_INIT_DECLARATION:
+        frame_declare(frame, ast_children(node));
+        break;
+    case K_INIT_DECLARATION: {
+        // The variable is in scope in its own initializer, but only needs a
+        // slot once it's written
+        unsigned int var = frame_declare(frame, ast_children(node));
+        frame_walk(frame, ast_children(node) + 1, var);
+        frame->vars[var].start = frame->position;
+        frame_use(frame, ast_children(node), false, "Declaration of");
+    } break;
+    case K_EXPR_STATEMENT:
+        if (node->count == 1) {
+            frame_walk(frame, ast_children(node), FRAME_VALUE_UNUSED);
+        }
+        break;
+    case K_TOP_EXPR:
+        // Only the last expression gives the value
+        for (unsigned int i = 0; i < node->count; ++i) {
+            frame_walk(frame, ast_children(node) + i,
+                       i + 1 < node->count ? FRAME_VALUE_UNUSED : sink);
+        }
+        break;
+    case K_BLOCK: {
+        unsigned int scope_start = frame->scope_start;
+        unsigned int visible_count = frame->visible_count;
+        frame->scope_start = visible_count;
+        for (unsigned int i = 0; i < node->count; ++i) {
+            frame_walk(frame, ast_children(node) + i, FRAME_VALUE_USED);
+        }
+        frame->scope_start = scope_start;
+        frame->visible_count = visible_count;
+    } break;
+    case K_WHILE: {
+        unsigned int start = frame->position;
+        unsigned int outer = frame->var_count;
+        frame_walk(frame, ast_children(node), FRAME_VALUE_USED);
+        frame_walk(frame, ast_children(node) + 1, FRAME_VALUE_USED);
+        unsigned int end = frame->position++;
+        // What a variable holds at the end of an iteration can be read in
+        // the next one
+        for (unsigned int i = 0; i < frame->visible_count; ++i) {
+            FrameVar *var = frame->vars + frame->visible[i];
+            if (frame->visible[i] < outer && var->end >= start) {
+                var->end = end;
+            }
+        }
+    } break;
+    default:
+        // Operators pass on where their value goes to their operands
+        for (unsigned int i = 0; i < node->count; ++i) {
+            frame_walk(frame, ast_children(node) + i, sink);
+        }
+        break;
+    }
+}
+
+int frame_use_compare(void const *a, void const *b) {
+    uintptr_t left = (uintptr_t)((FrameUse const *)a)->node;
+    uintptr_t right = (uintptr_t)((FrameUse const *)b)->node;
+    return (left > right) - (left < right);
+}
+
+// Find the variables of a function and give them slots
+void frame_plan(Frame *frame, AstNode *function) {
+    assert(function->kind == K_FUNCTION);
+    frame->var_count = 0;
+    frame->use_count = 0;
+    frame->edge_count = 0;
+    frame->visible_count = 0;
+    frame->scope_start = 0;
+    frame->position = 0;
+    // The parameters share their scope with the body of the function
+    AstNode *params = ast_children(function) + 1;
+    for (unsigned int i = 0; i < params->count; ++i) {
+        frame_declare(frame, ast_children(params) + i);
+        frame_use(frame, ast_children(params) + i, false, "Declaration of");
+    }
+    AstNode *block = ast_children(function) + 2;
+    for (unsigned int i = 0; i < block->count; ++i) {
+        frame_walk(frame, ast_children(block) + i, FRAME_VALUE_USED);
+    }
+    // A value that ends up in a variable we read is read too
+    int *work = xmalloc((frame->var_count + 1) * sizeof(int));
+    unsigned int work_count = 0;
+    for (unsigned int i = 0; i < frame->var_count; ++i) {
+        if (frame->vars[i].read) {
+            work[work_count++] = i;
+        }
+    }
+    while (work_count > 0) {
+        FrameVar *var = frame->vars + work[--work_count];
+        for (int e = var->edges; e >= 0; e = frame->edges[e].next) {
+            FrameVar *source = frame->vars + frame->edges[e].var;
+            if (!source->read) {
+                source->read = true;
+                work[work_count++] = frame->edges[e].var;
+            }
+        }
+    }
+    xfree(work);
+    // Variables are declared in order, so we can go through them like an
+    // interval graph, taking the first slot whose variable is dead by now
+    unsigned int *slot_ends =
+        xmalloc((frame->var_count + 1) * sizeof(unsigned int));
+    unsigned int slot_count = 0;
+    for (unsigned int i = 0; i < frame->var_count; ++i) {
+        FrameVar *var = frame->vars + i;
+        if (!var->read) {
+            continue;
+        }
+        unsigned int slot = 0;
+        while (slot < slot_count && slot_ends[slot] >= var->start) {
+            ++slot;
+        }
+        if (slot == slot_count) {
+            ++slot_count;
+        }
+        slot_ends[slot] = var->end;
+        var->offset = (slot + 1) << 2;
+    }
+    xfree(slot_ends);
+    frame->size = ((slot_count << 2) + 15) & ~15;
+    for (unsigned int i = 0; i < frame->use_count; ++i) {
+        frame->uses[i].var = frame->vars[frame->uses[i].var].offset;
+    }
+    qsort(frame->uses, frame->use_count, sizeof(FrameUse), frame_use_compare);
+}
+
+// The offset of the slot of the variable an identifier refers to, or 0 if
+// nothing reads it
+int frame_offset_of(Frame *frame, AstNode *node) {
+    FrameUse key = {.node = node, .var = 0};
+    FrameUse *use = bsearch(&key, frame->uses, frame->use_count,
+                            sizeof(FrameUse), frame_use_compare);
+    assert(use != NULL);
+    return use->var;
+}
+
+void frame_destroy(Frame *frame) {
+    xfree(frame->vars);
+    xfree(frame->uses);
+    xfree(frame->edges);
+    xfree(frame->visible);
+}
+
+typedef struct AsmState {
+    // Where the variables of the current function live
+    Frame frame;
+    // The name of the current function
+    char *function_name;
+    // The current label index
+    int label_index;
+    // The stream we're generating to
+    FILE *out;
+    // Whether or not to say which line each instruction comes from
+    bool debug_lines;
+    // The line we last said instructions come from in this function, or 0
+    unsigned int line;
+} AsmState;
+
+AsmState *asm_init(FILE *out, bool debug_lines) {
+    AsmState *st = xmalloc(sizeof(AsmState));
+    st->out = out;
+    st->debug_lines = debug_lines;
+    frame_init(&st->frame);
+    return st;
+}
+
+void asm_destroy(AsmState *st) {
+    frame_destroy(&st->frame);
+    xfree(st);
+}
+
+void asm_enter_function(AsmState *st, char *function_name) {
+    st->function_name = function_name;
+    st->label_index = 0;
+    st->line = 0;
+}
+
+// Say that the next instructions come from the line of a statement
+//
+// Each function starts over, so that its code doesn't depend on the
+// functions before it, which lets us cache and fold it.
+void asm_line(AsmState *st, AstNode *node) {
+    if (st->debug_lines && node->line != 0 && node->line != st->line) {
+        fprintf(st->out, "\t.loc 1 %u\n", node->line);
+        st->line = node->line;
+    }
+}
+
+char *asm_reg_for_nth_function_param(bool is64, int n) {
+    switch (n) {
+    case 0:
+        return is64 ? "rdi" : "edi";
+    case 1:
+        return is64 ? "rsi" : "esi";
+    case 2:
+        return is64 ? "rdx" : "edx";
+    case 3:
+        return is64 ? "rcx" : "ecx";
+    case 4:
+        return is64 ? "r8" : "r8d";
+    case 5:
+        return is64 ? "r9" : "r9d";
+    default:
+        fputs("Function has more than 6 parameters\n", errors());
+        fail();
+    }
+}
+
+// Describes what the code for an expression needs to produce
+typedef enum ExprContext {
+    // The value gets pushed onto the stack
+    CTX_VALUE,
+    // The value is discarded, so only side effects matter
+    CTX_EFFECT,
+    // The value is only compared with 0, so it can stay in the flags
+    CTX_CONDITION,
+    // The value is left in eax
+    CTX_REGISTER
+} ExprContext;
+
+// Describes when an expression evaluated as a condition is true
+typedef enum Condition {
+    // The expression wasn't evaluated as a condition
+    COND_NONE,
+    // The expression is true if the zero flag is set
+    COND_EQUAL,
+    // The expression is true if the zero flag is clear
+    COND_NOT_EQUAL,
+    // The expression is a constant that's always true
+    COND_ALWAYS,
+    // The expression is a constant that's always false
+    COND_NEVER
+} Condition;
+
+Condition asm_negate_condition(Condition cond) {
+    switch (cond) {
+    case COND_EQUAL:
+        return COND_NOT_EQUAL;
+    case COND_NOT_EQUAL:
+        return COND_EQUAL;
+    case COND_ALWAYS:
+        return COND_NEVER;
+    case COND_NEVER:
+        return COND_ALWAYS;
+    default:
+        return COND_NONE;
+    }
+}
+
+// Put 1 in eax if the condition holds, and 0 otherwise
+void asm_materialize_condition(AsmState *st, Condition cond) {
+    switch (cond) {
+    case COND_EQUAL:
+        fputs("\tsete\tal\n", st->out);
+        fputs("\tmovzx\teax, al\n", st->out);
+        break;
+    case COND_NOT_EQUAL:
+        fputs("\tsetne\tal\n", st->out);
+        fputs("\tmovzx\teax, al\n", st->out);
+        break;
+    case COND_ALWAYS:
+        fputs("\tmov\teax, 1\n", st->out);
+        break;
+    default:
+        fputs("\txor\teax, eax\n", st->out);
+        break;
+    }
+}
+
+// Jump to a label of the current function if a condition doesn't hold
+void asm_jump_unless(AsmState *st, Condition cond, int label) {
+    switch (cond) {
+    case COND_EQUAL:
+        fprintf(st->out, "\tjne\t.%s.%d\n", st->function_name, label);
+        break;
+    case COND_NOT_EQUAL:
+        fprintf(st->out, "\tje\t.%s.%d\n", st->function_name, label);
+        break;
+    case COND_ALWAYS:
+        break;
+    default:
+        fprintf(st->out, "\tjmp\t.%s.%d\n", st->function_name, label);
+        break;
+    }
+}
+
+// Produce what a context expects from a value held in eax
+Condition asm_finish_expr(AsmState *st, ExprContext ctx) {
+    if (ctx == CTX_VALUE) {
+        fputs("\tpush\trax\n", st->out);
+    } else if (ctx == CTX_CONDITION) {
+        fputs("\ttest\teax, eax\n", st->out);
+        return COND_NOT_EQUAL;
+    }
+    return COND_NONE;
+}
+
+Condition asm_expr(AsmState *st, AstNode *node, ExprContext ctx);
+
+// Check whether an expression can be used directly as an instruction operand
+bool asm_is_leaf(AstNode *node) {
+    return node->kind == K_NUMBER || node->kind == K_IDENTIFIER;
+}
+
+// Write a leaf as an operand, either as an immediate or as a stack slot
+void asm_leaf_operand(AsmState *st, AstNode *node) {
+    if (node->kind == K_NUMBER) {
+        fprintf(st->out, "%d", node->data.num);
+    } else {
+        int offset = frame_offset_of(&st->frame, node);
+        fprintf(st->out, "DWORD PTR [rbp - %d]", offset);
+    }
+}
+
+// Call a function, leaving the result in eax
+void asm_call(AsmState *st, AstNode *node) {
+    assert(node->kind == K_CALL);
+    AstNode *name = ast_children(node);
+    AstNode *params = ast_children(node) + 1;
+    assert(name->kind == K_IDENTIFIER);
+    assert(params->kind == K_PARAMS);
+    // Other params could contain calls, so we can only fill the registers
+    // once every complex param has been evaluated
+    for (unsigned int i = 0; i < params->count; ++i) {
+        AstNode *param = ast_children(params) + i;
+        if (!asm_is_leaf(param)) {
+            asm_expr(st, param, CTX_VALUE);
+        }
+    }
+    for (int i = params->count - 1; i >= 0; --i) {
+        if (!asm_is_leaf(ast_children(params) + i)) {
+            char *reg = asm_reg_for_nth_function_param(true, i);
+            fprintf(st->out, "\tpop\t%s\n", reg);
+        }
+    }
+    for (unsigned int i = 0; i < params->count; ++i) {
+        AstNode *param = ast_children(params) + i;
+        if (asm_is_leaf(param)) {
+            char *reg = asm_reg_for_nth_function_param(false, i);
+            fprintf(st->out, "\tmov\t%s, ", reg);
+            asm_leaf_operand(st, param);
+            fputc('\n', st->out);
+        }
+    }
+    fprintf(st->out, "\tcall\t%s\n", ast_string(name));
+}
+
+// Choose between two values, leaving the result in eax
+void asm_select(AsmState *st, AstNode *node) {
+    assert(node->kind == K_SELECT);
+    AstNode *then_value = ast_children(node) + 1;
+    AstNode *else_value = ast_children(node) + 2;
+    if (then_value->kind == K_NUMBER && else_value->kind == K_NUMBER) {
+        // With constant arms, we can work from the condition as 0 or -1
+        unsigned int difference = then_value->data.num - else_value->data.num;
+        Condition cond = asm_expr(st, ast_children(node), CTX_CONDITION);
+        asm_materialize_condition(st, cond);
+        if (difference != 1) {
+            fputs("\tneg\teax\n", st->out);
+            fprintf(st->out, "\tand\teax, %d\n", (int)difference);
+        }
+        if (else_value->data.num != 0) {
+            fprintf(st->out, "\tadd\teax, %d\n", else_value->data.num);
+        }
+        return;
+    }
+    asm_expr(st, ast_children(node), CTX_VALUE);
+    asm_expr(st, then_value, CTX_VALUE);
+    asm_expr(st, else_value, CTX_REGISTER);
+    fputs("\tmov\tecx, eax\n", st->out);
+    fputs("\tpop\trax\n", st->out);
+    fputs("\tpop\trdx\n", st->out);
+    fputs("\ttest\tedx, edx\n", st->out);
+    fputs("\tcmove\teax, ecx\n", st->out);
+}
+
+// Check whether the operands of an operation can be swapped
+bool asm_is_commutative(AstKind kind) {
+    switch (kind) {
+    case K_ADD:
+    case K_MUL:
+    case K_BIT_AND:
+    case K_BIT_OR:
+    case K_BIT_XOR:
+    case K_EQUALS:
+    case K_NOT_EQUALS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Put the left operand of a binary operation in eax, and the right operand in
+// ecx, unless it's a leaf, which gets returned to be used directly
+AstNode *asm_operands(AsmState *st, AstNode *node) {
+    AstNode *left = ast_children(node);
+    AstNode *right = ast_children(node) + 1;
+    if (asm_is_leaf(left) && !asm_is_leaf(right) &&
+        asm_is_commutative(node->kind)) {
+        AstNode *tmp = left;
+        left = right;
+        right = tmp;
+    }
+    if (asm_is_leaf(right)) {
+        asm_expr(st, left, CTX_REGISTER);
+        return right;
+    }
+    if (asm_is_leaf(left)) {
+        asm_expr(st, right, CTX_REGISTER);
+        fputs("\tmov\tecx, eax\n", st->out);
+        asm_expr(st, left, CTX_REGISTER);
+        return NULL;
+    }
+    asm_expr(st, left, CTX_VALUE);
+    asm_expr(st, right, CTX_REGISTER);
+    fputs("\tmov\tecx, eax\n", st->out);
+    fputs("\tpop\trax\n", st->out);
+    return NULL;
+}
+
+// Apply a binary operation to eax, leaving the result in eax
+void asm_binary(AsmState *st, AstNode *node) {
+    AstNode *leaf = asm_operands(st, node);
+    char const *op;
+    switch (node->kind) {
+    case K_ADD:
+        op = "add";
+        break;
+    case K_SUB:
+        op = "sub";
+        break;
+    case K_BIT_AND:
+        op = "and";
+        break;
+    case K_BIT_OR:
+        op = "or";
+        break;
+    case K_BIT_XOR:
+        op = "xor";
+        break;
+    case K_EQUALS:
+    case K_NOT_EQUALS:
+        if (leaf != NULL && leaf->kind == K_NUMBER && leaf->data.num == 0) {
+            fputs("\ttest\teax, eax\n", st->out);
+            return;
+        }
+        op = "cmp";
+        break;
+    case K_MUL:
+        // Multiplying by an immediate needs the three operand form
+        if (leaf != NULL && leaf->kind == K_NUMBER) {
+            fprintf(st->out, "\timul\teax, eax, %d\n", leaf->data.num);
+            return;
+        }
+        op = "imul";
+        break;
+    default:
+        // idiv can take a memory operand, but not an immediate
+        if (leaf != NULL && leaf->kind == K_NUMBER) {
+            fprintf(st->out, "\tmov\tecx, %d\n", leaf->data.num);
+            leaf = NULL;
+        }
+        fputs("\tcdq\n", st->out);
+        fputs("\tidiv\t", st->out);
+        if (leaf == NULL) {
+            fputs("ecx", st->out);
+        } else {
+            asm_leaf_operand(st, leaf);
+        }
+        fputc('\n', st->out);
+        if (node->kind == K_MOD) {
+            fputs("\tmov\teax, edx\n", st->out);
+        }
+        return;
+    }
+    fprintf(st->out, "\t%s\teax, ", op);
+    if (leaf == NULL) {
+        fputs("ecx", st->out);
+    } else {
+        asm_leaf_operand(st, leaf);
+    }
+    fputc('\n', st->out);
+}
+
+// Generate code for an expression, returning when it's true in CTX_CONDITION
+Condition asm_expr(AsmState *st, AstNode *node, ExprContext ctx) {
+    // Only calls and assignments have effects, other nodes just combine values
+    if (ctx == CTX_EFFECT && node->kind != K_CALL && node->kind != K_ASSIGN) {
+        for (unsigned int i = 0; i < node->count; ++i) {
+            asm_expr(st, ast_children(node) + i, CTX_EFFECT);
+        }
+        return COND_NONE;
+    }
+    switch (node->kind) {
+    case K_NUMBER:
+        if (ctx == CTX_CONDITION) {
+            return node->data.num != 0 ? COND_ALWAYS : COND_NEVER;
+        }
+        if (ctx == CTX_VALUE) {
+            fprintf(st->out, "\tpush\t%d\n", node->data.num);
+            return COND_NONE;
+        }
+        fprintf(st->out, "\tmov\teax, %d\n", node->data.num);
+        break;
+    case K_IDENTIFIER: {
+        int offset = frame_offset_of(&st->frame, node);
+        fprintf(st->out, "\tmov\teax, DWORD PTR [rbp - %d]\n", offset);
+    } break;
+    case K_CALL:
+        asm_call(st, node);
+        break;
+    case K_ASSIGN: {
+        int offset = frame_offset_of(&st->frame, ast_children(node));
+        // Nothing reads the variable, so only the value itself matters
+        if (offset == 0) {
+            return asm_expr(st, ast_children(node) + 1, ctx);
+        }
+        asm_expr(st, ast_children(node) + 1, CTX_REGISTER);
+        fprintf(st->out, "\tmov\tDWORD PTR [rbp - %d], eax\n", offset);
+    } break;
+    case K_EQUALS:
+    case K_NOT_EQUALS: {
+        asm_binary(st, node);
+        Condition cond =
+            node->kind == K_EQUALS ? COND_EQUAL : COND_NOT_EQUAL;
+        if (ctx == CTX_CONDITION) {
+            return cond;
+        }
+        asm_materialize_condition(st, cond);
+    } break;
+    case K_LOGICAL_NOT: {
+        Condition cond = asm_expr(st, ast_children(node), CTX_CONDITION);
+        cond = asm_negate_condition(cond);
+        if (ctx == CTX_CONDITION) {
+            return cond;
+        }
+        asm_materialize_condition(st, cond);
+    } break;
+    case K_ADD:
+    case K_SUB:
+    case K_MUL:
+    case K_DIV:
+    case K_MOD:
+    case K_BIT_AND:
+    case K_BIT_OR:
+    case K_BIT_XOR:
+        asm_binary(st, node);
+        break;
+    case K_BIT_NOT:
+        asm_expr(st, ast_children(node), CTX_REGISTER);
+        fputs("\tnot\teax\n", st->out);
+        break;
+    case K_NEGATE:
+        asm_expr(st, ast_children(node), CTX_REGISTER);
+        fputs("\tneg\teax\n", st->out);
+        break;
+    case K_SELECT:
+        asm_select(st, node);
+        break;
+    default:
+        panic("Unable to handle expression type");
+    }
+    return asm_finish_expr(st, ctx);
+}
+
+void asm_declare(AsmState *st, AstNode *node) {
+    if (node->kind == K_NO_INIT_DECLARATION) {
+        // The slot was made when entering the function
+    } else if (node->kind == K_INIT_DECLARATION) {
+        int offset = frame_offset_of(&st->frame, ast_children(node));
+        if (offset == 0) {
+            asm_expr(st, ast_children(node) + 1, CTX_EFFECT);
+            return;
+        }
+        asm_expr(st, ast_children(node) + 1, CTX_REGISTER);
+        fprintf(st->out, "\tmov\tDWORD PTR [rbp - %d], eax\n", offset);
+    } else {
+        panic("Tried to process declaration, but kind was invalid");
+    }
+}
+
+// Only the last expression of a comma separated list can produce a value
+Condition asm_top_expr(AsmState *st, AstNode *node, ExprContext ctx) {
+    assert(node->kind == K_TOP_EXPR);
+    for (unsigned int i = 0; i + 1 < node->count; ++i) {
+        asm_expr(st, ast_children(node) + i, CTX_EFFECT);
+    }
+    return asm_expr(st, ast_children(node) + node->count - 1, ctx);
+}
+
+// Switches with at most this many cases compare against each of them in turn
+#define SWITCH_LINEAR_MAX 3
+// Switches with at least this many cases, and at most this many values per
+// case between the smallest and the largest, jump through a table
+#define SWITCH_TABLE_MIN 4
+#define SWITCH_TABLE_SPREAD 4
+
+// Jump to the label of the case matching eax, or to `default_label`, by
+// comparing against a few cases in turn, or by halving the cases each time
+void asm_switch_search(AsmState *st, SwitchCase *cases, unsigned int count,
+                       int const *labels, int default_label) {
+    if (count <= SWITCH_LINEAR_MAX) {
+        for (unsigned int i = 0; i < count; ++i) {
+            fprintf(st->out, "\tcmp\teax, %d\n", cases[i].value);
+            fprintf(st->out, "\tje\t.%s.%d\n", st->function_name,
+                    labels[cases[i].item]);
+        }
+        fprintf(st->out, "\tjmp\t.%s.%d\n", st->function_name,
+                default_label);
+        return;
+    }
+    unsigned int middle = count / 2;
+    int below = st->label_index++;
+    fprintf(st->out, "\tcmp\teax, %d\n", cases[middle].value);
+    fprintf(st->out, "\tje\t.%s.%d\n", st->function_name,
+            labels[cases[middle].item]);
+    fprintf(st->out, "\tjl\t.%s.%d\n", st->function_name, below);
+    asm_switch_search(st, cases + middle + 1, count - middle - 1, labels,
+                      default_label);
+    fprintf(st->out, ".%s.%d:\n", st->function_name, below);
+    asm_switch_search(st, cases, middle, labels, default_label);
+}
+
+// Jump to the label of the case matching eax through a table of offsets
+// covering every value between the smallest and the largest case
+void asm_switch_table(AsmState *st, SwitchCase *cases, unsigned int count,
+                      int const *labels, int default_label) {
+    int low = cases[0].value;
+    unsigned int range = (unsigned int)cases[count - 1].value - low;
+    int table = st->label_index++;
+    // Values below the smallest case wrap around to large unsigned ones.
+    // Either way, writing eax clears the top of rax, which we index with, and
+    // which a call returning an int can leave anything in.
+    if (low != 0) {
+        fprintf(st->out, "\tsub\teax, %d\n", low);
+    } else {
+        fputs("\tmov\teax, eax\n", st->out);
+    }
+    fprintf(st->out, "\tcmp\teax, %u\n", range);
+    fprintf(st->out, "\tja\t.%s.%d\n", st->function_name, default_label);
+    fprintf(st->out, "\tlea\trdx, [rip + .%s.%d]\n", st->function_name,
+            table);
+    fputs("\tmovsxd\trax, DWORD PTR [rdx + rax*4]\n", st->out);
+    fputs("\tadd\trax, rdx\n", st->out);
+    fputs("\tjmp\trax\n", st->out);
+    // Offsets from the table keep the code position independent
+    fputs("\t.pushsection .rodata\n", st->out);
+    fputs("\t.p2align 2\n", st->out);
+    fprintf(st->out, ".%s.%d:\n", st->function_name, table);
+    unsigned int next = 0;
+    for (unsigned int i = 0; i <= range; ++i) {
+        int label = default_label;
+        if ((unsigned int)cases[next].value - low == i) {
+            label = labels[cases[next++].item];
+        }
+        fprintf(st->out, "\t.long\t.%s.%d - .%s.%d\n", st->function_name,
+                label, st->function_name, table);
+    }
+    fputs("\t.popsection\n", st->out);
+}
+
+bool asm_statement(AsmState *st, AstNode *node, int start_label,
+                   int end_label);
+
+// Jump to the right label in the body of a switch, and then generate it
+void asm_switch(AsmState *st, AstNode *node, int start_label) {
+    unsigned int count;
+    SwitchCase *cases = ast_switch_cases(node, &count);
+    int *labels = xmalloc(node->count * sizeof(int));
+    int end_label = st->label_index++;
+    int default_label = end_label;
+    for (unsigned int i = 1; i < node->count; ++i) {
+        AstNode *item = ast_children(node) + i;
+        if (item->kind == K_CASE || item->kind == K_DEFAULT) {
+            labels[i] = st->label_index++;
+        }
+        if (item->kind == K_DEFAULT) {
+            default_label = labels[i];
+        }
+    }
+    asm_expr(st, ast_children(node), CTX_REGISTER);
+    // Dense cases are worth a table, and sparse ones a search
+    if (count >= SWITCH_TABLE_MIN &&
+        (uint64_t)((unsigned int)cases[count - 1].value - cases[0].value) <
+            (uint64_t)count * SWITCH_TABLE_SPREAD) {
+        asm_switch_table(st, cases, count, labels, default_label);
+    } else {
+        asm_switch_search(st, cases, count, labels, default_label);
+    }
+    // Any label can be jumped to, so even code after a return is reachable
+    for (unsigned int i = 1; i < node->count; ++i) {
+        AstNode *item = ast_children(node) + i;
+        if (item->kind == K_CASE || item->kind == K_DEFAULT) {
+            fprintf(st->out, ".%s.%d:\n", st->function_name, labels[i]);
+        } else {
+            asm_statement(st, item, start_label, end_label);
+        }
+    }
+    fprintf(st->out, ".%s.%d:\n", st->function_name, end_label);
+    xfree(labels);
+    xfree(cases);
+}
+
+// Return true if code appearing after this statement is unreachable
+bool asm_statement(AsmState *st, AstNode *node, int start_label,
+                   int end_label) {
+    bool after_unreachable = false;
+    if (node->kind != K_BLOCK) {
+        asm_line(st, node);
+    }
+    if (node->kind == K_RETURN) {
+        if (node->count == 1) {
+            asm_top_expr(st, ast_children(node), CTX_REGISTER);
+        }
+        // The code after this still has the frame, so unwinders need to know
+        // it only goes away for the `ret`
+        fputs("\t.cfi_remember_state\n", st->out);
+        fputs("\tmov\trsp, rbp\n", st->out);
+        fputs("\tpop\trbp\n", st->out);
+        fputs("\t.cfi_def_cfa rsp, 8\n", st->out);
+        fputs("\tret\n", st->out);
+        fputs("\t.cfi_restore_state\n", st->out);
+        after_unreachable = true;
+    } else if (node->kind == K_EXPR_STATEMENT) {
+        if (node->count == 1) {
+            asm_top_expr(st, ast_children(node), CTX_EFFECT);
+        }
+    } else if (node->kind == K_DECLARATION) {
+        for (unsigned int i = 0; i < node->count; ++i) {
+            asm_declare(st, ast_children(node) + i);
+        }
+    } else if (node->kind == K_IF) {
+        int label = st->label_index++;
+        Condition cond = asm_expr(st, ast_children(node), CTX_CONDITION);
+        asm_jump_unless(st, cond, label);
+        bool if_returns =
+            asm_statement(st, ast_children(node) + 1, start_label, end_label);
+        bool else_returns = false;
+        if (node->count == 3) {
+            // The then branch needs to skip over the else branch
+            int after_label = st->label_index++;
+            if (!if_returns) {
+                fprintf(st->out, "\tjmp\t.%s.%d\n", st->function_name,
+                        after_label);
+            }
+            fprintf(st->out, ".%s.%d:\n", st->function_name, label);
+            else_returns = asm_statement(st, ast_children(node) + 2,
+                                         start_label, end_label);
+            fprintf(st->out, ".%s.%d:\n", st->function_name, after_label);
+        } else {
+            fprintf(st->out, ".%s.%d:\n", st->function_name, label);
+        }
+        after_unreachable = if_returns && else_returns;
+    } else if (node->kind == K_WHILE) {
+        int start_label = st->label_index++;
+        int end_label = st->label_index++;
+        fprintf(st->out, ".%s.%d:\n", st->function_name, start_label);
+        Condition cond = asm_expr(st, ast_children(node), CTX_CONDITION);
+        asm_jump_unless(st, cond, end_label);
+        asm_statement(st, ast_children(node) + 1, start_label, end_label);
+        fprintf(st->out, "\tjmp\t.%s.%d\n", st->function_name, start_label);
+        fprintf(st->out, ".%s.%d:\n", st->function_name, end_label);
+    } else if (node->kind == K_SWITCH) {
+        // A break leaves the switch, but a continue still restarts the loop
+        asm_switch(st, node, start_label);
+    } else if (node->kind == K_BLOCK) {
+        for (unsigned int i = 0; i < node->count; ++i) {
+            if (asm_statement(st, ast_children(node) + i, start_label,
+                              end_label)) {
+                return true;
+            }
+        }
+    } else if (node->kind == K_BREAK) {
+        fprintf(st->out, "\tjmp\t.%s.%d\n", st->function_name, end_label);
+    } else if (node->kind == K_CONTINUE) {
+        fprintf(st->out, "\tjmp\t.%s.%d\n", st->function_name, start_label);
+    } else {
+        panic("Unable to handle statement type");
+    }
+    return after_unreachable;
+}
+
+void asm_function(AsmState *st, AstNode *node) {
+    assert(node->kind == K_FUNCTION);
+    AstNode *name = ast_children(node);
+    assert(name->kind == K_IDENTIFIER);
+    asm_enter_function(st, ast_string(name));
+    frame_plan(&st->frame, node);
+    fprintf(st->out, "\t.globl %s\n", ast_string(name));
+    fprintf(st->out, "\t.type %s, @function\n", ast_string(name));
+    fprintf(st->out, "%s:\n", ast_string(name));
+    asm_line(st, node);
+    // Describe the frame to unwinders, for debuggers and profilers
+    fputs("\t.cfi_startproc\n", st->out);
+    fputs("\tpush\trbp\n", st->out);
+    fputs("\t.cfi_def_cfa_offset 16\n", st->out);
+    fputs("\t.cfi_offset rbp, -16\n", st->out);
+    fputs("\tmov\trbp, rsp\n", st->out);
+    fputs("\t.cfi_def_cfa_register rbp\n", st->out);
+    // The whole frame is made here, keeping calls aligned to 16 bytes
+    if (st->frame.size > 0) {
+        fprintf(st->out, "\tsub\trsp, %d\n", st->frame.size);
+    }
+    AstNode *params = ast_children(node) + 1;
+    assert(params->kind == K_PARAMS);
+    for (unsigned int i = 0; i < params->count; ++i) {
+        assert(ast_children(params)[i].kind == K_IDENTIFIER);
+        // Parameters nothing reads stay in their registers
+        int offset = frame_offset_of(&st->frame, ast_children(params) + i);
+        if (offset == 0) {
+            continue;
+        }
+        char *reg = asm_reg_for_nth_function_param(false, i);
+        fprintf(st->out, "\tmov\tDWORD PTR [rbp - %d], %s\n", offset, reg);
+    }
+    AstNode *block = ast_children(node) + 2;
+    assert(block->kind == K_BLOCK);
+    bool returned = false;
+    for (unsigned int i = 0; i < block->count && !returned; ++i) {
+        returned = asm_statement(st, ast_children(block) + i, -1, -1);
+    }
+    fputs("\t.cfi_endproc\n", st->out);
+    fprintf(st->out, "\t.size %s, .-%s\n", ast_string(name),
+            ast_string(name));
+}
+
+// Emit what comes before the first function, `filename` being the name of
+// the program's file
+void asm_begin(AsmState *st, char const *filename) {
+    fputs("\t.intel_syntax noprefix\n", st->out);
+    if (st->debug_lines) {
+        fputs("\t.file 1 \"", st->out);
+        for (char const *c = filename; *c != 0; ++c) {
+            if (*c == '"' || *c == '\\') {
+                fputc('\\', st->out);
+            }
+            fputc(*c, st->out);
+        }
+        fputs("\"\n", st->out);
+    }
+}
+
+/** BYTECODE **/
+// The instructions of our bytecode. Each function works on a stack of values,
+// sitting right above its local variables. Operands follow the opcode.
+typedef enum Opcode {
+    // PUSH value: push an immediate
+    OP_PUSH,
+    // LOAD slot: push the value of a local
+    OP_LOAD,
+    // STORE slot: pop a value into a local
+    OP_STORE,
+    // TEE slot: copy the top of the stack into a local, without popping it
+    OP_TEE,
+    // Discard the top of the stack
+    OP_POP,
+    // Binary operations, popping the right operand, then the left operand
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_EQ,
+    OP_NE,
+    // ADD_IMM value: add an immediate to the top of the stack
+    OP_ADD_IMM,
+    // Unary operations, replacing the top of the stack
+    OP_NOT,
+    OP_BIT_NOT,
+    OP_NEGATE,
+    // Pop the else value, the then value, and the condition, pushing one
+    OP_SELECT,
+    // JUMP target: continue at an offset into the function's code
+    OP_JUMP,
+    // JUMP_IF_ZERO target: pop a value, jumping if it's 0
+    OP_JUMP_IF_ZERO,
+    // JUMP_IF_NOT_ZERO target: pop a value, jumping unless it's 0
+    OP_JUMP_IF_NOT_ZERO,
+    // JUMP_IF_EQ target: pop two values, jumping if they're equal
+    OP_JUMP_IF_EQ,
+    // JUMP_IF_NE target: pop two values, jumping if they're different
+    OP_JUMP_IF_NE,
+    // SWITCH count default (value target)...: pop a value, jumping to the
+    // target paired with it, or to default, with the values sorted
+    OP_SWITCH,
+    // CALL function: call a function on the arguments at the top of the stack
+    OP_CALL,
+    // Pop the return value, and go back to the caller
+    OP_RETURN,
+    // The number of opcodes
+    OP_COUNT
+} Opcode;
+
+// A function lowered to bytecode
+typedef struct BcFunction {
+    // The name of this function, which we own
+    char *name;
+    // Whether we've seen the body of this function, and not just calls to it
+    bool defined;
+    // The number of parameters, or < 0 if we haven't seen it used yet
+    int param_count;
+    // The number of locals, including the parameters
+    int slot_count;
+    // The most values this function's code has on the stack at once
+    int max_depth;
+    // The instructions, followed by their operands
+    int32_t *code;
+    unsigned int length;
+    unsigned int capacity;
+} BcFunction;
+
+// A program lowered to bytecode, with functions referenced by index
+typedef struct BcProgram {
+    BcFunction *functions;
+    unsigned int count;
+    unsigned int capacity;
+    // An open addressing table from names to function index + 1, or 0
+    unsigned int *table;
+    // The number of buckets in the table, a power of 2
+    unsigned int table_size;
+} BcProgram;
+
+// How many functions, and words of code in each, we first make room for
+#define BC_BASE_CAPACITY 8
+
+void bc_program_init(BcProgram *program) {
+    program->functions = NULL;
+    program->count = 0;
+    program->capacity = 0;
+    program->table_size = 64;
+    program->table = xmalloc(program->table_size * sizeof(unsigned int));
+    memset(program->table, 0, program->table_size * sizeof(unsigned int));
+}
+
+void bc_program_destroy(BcProgram *program) {
+    for (unsigned int i = 0; i < program->count; ++i) {
+        xfree(program->functions[i].name);
+        xfree(program->functions[i].code);
+    }
+    xfree(program->functions);
+    xfree(program->table);
+}
+
+// FNV-1a, which is plenty for function names
+uint32_t bc_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != 0; ++name) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+// Find the bucket holding a name, or the empty bucket where it would go
+unsigned int *bc_bucket(BcProgram *program, char const *name) {
+    unsigned int mask = program->table_size - 1;
+    for (uint32_t i = bc_hash(name);; ++i) {
+        unsigned int *bucket = program->table + (i & mask);
+        if (*bucket == 0 ||
+            strcmp(program->functions[*bucket - 1].name, name) == 0) {
+            return bucket;
+        }
+    }
+}
+
+// Get the index of a function, adding it if we haven't seen it before
+int bc_function_index(BcProgram *program, char const *name) {
+    unsigned int *bucket = bc_bucket(program, name);
+    if (*bucket != 0) {
+        return *bucket - 1;
+    }
+    if (program->count == program->capacity) {
+        program->capacity =
+            program->capacity == 0 ? BC_BASE_CAPACITY : program->capacity << 1;
+        program->functions = xrealloc(program->functions,
+                                      program->capacity * sizeof(BcFunction));
+    }
+    BcFunction *function = program->functions + program->count++;
+    memset(function, 0, sizeof(BcFunction));
+    function->name = xstrdup(name);
+    function->param_count = -1;
+    *bucket = program->count;
+    // Keep the table at most half full
+    if (program->count * 2 > program->table_size) {
+        xfree(program->table);
+        program->table_size <<= 1;
+        program->table = xmalloc(program->table_size * sizeof(unsigned int));
+        memset(program->table, 0, program->table_size * sizeof(unsigned int));
+        for (unsigned int i = 0; i < program->count; ++i) {
+            *bc_bucket(program, program->functions[i].name) = i + 1;
+        }
+    }
+    return program->count - 1;
+}
+
+// Check that a function is always used with the same number of arguments
+void bc_check_arity(BcFunction *function, int param_count) {
+    if (function->param_count >= 0 && function->param_count != param_count) {
+        fputs("Error:\n", errors());
+        fprintf(errors(), "Function %s used with %d and %d parameters\n",
+                function->name, function->param_count, param_count);
+        fail();
+    }
+    function->param_count = param_count;
+}
+
+// Holds what we need while lowering a function to bytecode
+typedef struct BcEmitter {
+    BcProgram *program;
+    // The index of the function we're lowering
+    int function;
+    // Maps the variables in scope to their slots
+    Scopes scopes;
+    // The number of values on the stack at this point in the code
+    int depth;
+    // The jumps out of the current loop, chained through their operands
+    int breaks;
+    // The jumps to the condition of the current loop, chained the same way
+    int continues;
+} BcEmitter;
+
+BcFunction *bc_current(BcEmitter *e) {
+    return e->program->functions + e->function;
+}
+
+// Append a word to the current function, returning its position
+int bc_word(BcEmitter *e, int32_t word) {
+    BcFunction *function = bc_current(e);
+    if (function->length == function->capacity) {
+        function->capacity = function->capacity == 0 ? BC_BASE_CAPACITY
+                                                     : function->capacity << 1;
+        function->code =
+            xrealloc(function->code, function->capacity * sizeof(int32_t));
+    }
+    function->code[function->length] = word;
+    return function->length++;
+}
+
+// Append an instruction, which changes the number of values on the stack
+void bc_op(BcEmitter *e, Opcode op, int effect) {
+    bc_word(e, op);
+    e->depth += effect;
+    if (e->depth > bc_current(e)->max_depth) {
+        bc_current(e)->max_depth = e->depth;
+    }
+}
+
+// Append an instruction with one operand
+int bc_op_arg(BcEmitter *e, Opcode op, int effect, int32_t arg) {
+    bc_op(e, op, effect);
+    return bc_word(e, arg);
+}
+
+// Point the jumps in a chain, linked through their operands, at a target
+void bc_patch(BcEmitter *e, int chain, int target) {
+    int32_t *code = bc_current(e)->code;
+    while (chain >= 0) {
+        int next = code[chain];
+        code[chain] = target;
+        chain = next;
+    }
+}
+
+int bc_here(BcEmitter *e) { return bc_current(e)->length; }
+
+// Find the slot of a variable, failing if it wasn't declared
+int bc_slot_of(BcEmitter *e, char *ident, char const *what) {
+    int offset = scopes_offset_of(&e->scopes, ident);
+    if (offset < 0) {
+        fprintf(errors(), "Error:\n%s undeclared identifier %s\n", what,
+                ident);
+        fail();
+    }
+    // Slots are laid out like the stack offsets we use when generating code
+    return (offset >> 2) - 1;
+}
+
+// Declare a variable in the current scope, returning its slot
+int bc_new_local(BcEmitter *e, char *new) {
+    Scope *current = e->scopes.scopes + e->scopes.count - 1;
+    if (idents_index_of(&current->identifiers, new) >= 0) {
+        fputs("Error:\n", errors());
+        fprintf(errors(), "Attempting to declare identifier %s twice\n",
+                new);
+        fail();
+    }
+    idents_insert(&current->identifiers, new);
+    int slot = bc_slot_of(e, new, "Declaration of");
+    if (slot >= bc_current(e)->slot_count) {
+        bc_current(e)->slot_count = slot + 1;
+    }
+    return slot;
+}
+
+void bc_expr(BcEmitter *e, AstNode *node, bool keep);
+
+// Emit a jump taken when a condition is `when`, returning the position of its
+// target to patch, or -1 if the jump can never be taken
+int bc_branch(BcEmitter *e, AstNode *node, bool when) {
+    switch (node->kind) {
+    case K_NUMBER:
+        if ((node->data.num != 0) != when) {
+            return -1;
+        }
+        return bc_op_arg(e, OP_JUMP, 0, -1);
+    case K_LOGICAL_NOT:
+        return bc_branch(e, ast_children(node), !when);
+    case K_EQUALS:
+    case K_NOT_EQUALS: {
+        AstNode *right = ast_children(node) + 1;
+        bool equal = (node->kind == K_EQUALS) == when;
+        bc_expr(e, ast_children(node), true);
+        if (right->kind == K_NUMBER && right->data.num == 0) {
+            Opcode op = equal ? OP_JUMP_IF_ZERO : OP_JUMP_IF_NOT_ZERO;
+            return bc_op_arg(e, op, -1, -1);
+        }
+        bc_expr(e, right, true);
+        return bc_op_arg(e, equal ? OP_JUMP_IF_EQ : OP_JUMP_IF_NE, -2, -1);
+    }
+    default:
+        bc_expr(e, node, true);
+        Opcode op = when ? OP_JUMP_IF_NOT_ZERO : OP_JUMP_IF_ZERO;
+        return bc_op_arg(e, op, -1, -1);
+    }
+}
+
+void bc_call(BcEmitter *e, AstNode *node) {
+    AstNode *params = ast_children(node) + 1;
+    for (unsigned int i = 0; i < params->count; ++i) {
+        bc_expr(e, ast_children(params) + i, true);
+    }
+    int index = bc_function_index(e->program, ast_string(ast_children(node)));
+    bc_check_arity(e->program->functions + index, params->count);
+    bc_op_arg(e, OP_CALL, 1 - (int)params->count, index);
+}
+
+Opcode bc_binary_op(AstKind kind) {
+    switch (kind) {
+    case K_ADD:
+        return OP_ADD;
+    case K_SUB:
+        return OP_SUB;
+    case K_MUL:
+        return OP_MUL;
+    case K_DIV:
+        return OP_DIV;
+    case K_MOD:
+        return OP_MOD;
+    case K_BIT_AND:
+        return OP_AND;
+    case K_BIT_OR:
+        return OP_OR;
+    case K_BIT_XOR:
+        return OP_XOR;
+    case K_EQUALS:
+        return OP_EQ;
+    default:
+        return OP_NE;
+    }
+}
+
+// Lower an expression, pushing its value if we keep it
+void bc_expr(BcEmitter *e, AstNode *node, bool keep) {
+    // Only calls and assignments have effects, other nodes just combine values
+    if (!keep && node->kind != K_CALL && node->kind != K_ASSIGN) {
+        for (unsigned int i = 0; i < node->count; ++i) {
+            bc_expr(e, ast_children(node) + i, false);
+        }
+        return;
+    }
+    switch (node->kind) {
+    case K_NUMBER:
+        bc_op_arg(e, OP_PUSH, 1, node->data.num);
+        break;
+    case K_IDENTIFIER:
+        bc_op_arg(e, OP_LOAD, 1, bc_slot_of(e, ast_string(node), "Use of"));
+        break;
+    case K_CALL:
+        bc_call(e, node);
+        if (!keep) {
+            bc_op(e, OP_POP, -1);
+        }
+        break;
+    case K_ASSIGN: {
+        char *ident = ast_string(ast_children(node));
+        int slot = bc_slot_of(e, ident, "Assignment to");
+        bc_expr(e, ast_children(node) + 1, true);
+        bc_op_arg(e, keep ? OP_TEE : OP_STORE, keep ? 0 : -1, slot);
+    } break;
+    case K_ADD:
+    case K_SUB: {
+        // Adding a constant is common enough to get its own instruction
+        AstNode *left = ast_children(node);
+        AstNode *right = ast_children(node) + 1;
+        if (node->kind == K_ADD && left->kind == K_NUMBER) {
+            AstNode *tmp = left;
+            left = right;
+            right = tmp;
+        }
+        if (right->kind == K_NUMBER) {
+            unsigned int value = right->data.num;
+            bc_expr(e, left, true);
+            bc_op_arg(e, OP_ADD_IMM, 0, node->kind == K_ADD ? value : -value);
+            break;
+        }
+        bc_expr(e, left, true);
+        bc_expr(e, right, true);
+        bc_op(e, bc_binary_op(node->kind), -1);
+    } break;
+    case K_MUL:
+    case K_DIV:
+    case K_MOD:
+    case K_BIT_AND:
+    case K_BIT_OR:
+    case K_BIT_XOR:
+    case K_EQUALS:
+    case K_NOT_EQUALS:
+        bc_expr(e, ast_children(node), true);
+        bc_expr(e, ast_children(node) + 1, true);
+        bc_op(e, bc_binary_op(node->kind), -1);
+        break;
+    case K_LOGICAL_NOT:
+        bc_expr(e, ast_children(node), true);
+        bc_op(e, OP_NOT, 0);
+        break;
+    case K_BIT_NOT:
+        bc_expr(e, ast_children(node), true);
+        bc_op(e, OP_BIT_NOT, 0);
+        break;
+    case K_NEGATE:
+        bc_expr(e, ast_children(node), true);
+        bc_op(e, OP_NEGATE, 0);
+        break;
+    case K_SELECT:
+        for (unsigned int i = 0; i < 3; ++i) {
+            bc_expr(e, ast_children(node) + i, true);
+        }
+        bc_op(e, OP_SELECT, -2);
+        break;
+    default:
+        panic("Unable to handle expression type");
+    }
+}
+
+// Only the last expression of a comma separated list can produce a value
+void bc_top_expr(BcEmitter *e, AstNode *node, bool keep) {
+    assert(node->kind == K_TOP_EXPR);
+    for (unsigned int i = 0; i + 1 < node->count; ++i) {
+        bc_expr(e, ast_children(node) + i, false);
+    }
+    bc_expr(e, ast_children(node) + node->count - 1, keep);
+}
+
+void bc_statement(BcEmitter *e, AstNode *node);
+
+void bc_switch(BcEmitter *e, AstNode *node) {
+    unsigned int count;
+    SwitchCase *cases = ast_switch_cases(node, &count);
+    // Where the target of each label goes in the instruction
+    int *targets = xmalloc(node->count * sizeof(int));
+    bc_expr(e, ast_children(node), true);
+    bc_op_arg(e, OP_SWITCH, -1, count);
+    int default_target = bc_word(e, -1);
+    for (unsigned int i = 0; i < count; ++i) {
+        bc_word(e, cases[i].value);
+        targets[cases[i].item] = bc_word(e, -1);
+    }
+    int outer_breaks = e->breaks;
+    e->breaks = -1;
+    bool has_default = false;
+    for (unsigned int i = 1; i < node->count; ++i) {
+        AstNode *item = ast_children(node) + i;
+        if (item->kind == K_CASE) {
+            bc_current(e)->code[targets[i]] = bc_here(e);
+        } else if (item->kind == K_DEFAULT) {
+            bc_current(e)->code[default_target] = bc_here(e);
+            has_default = true;
+        } else {
+            bc_statement(e, item);
+        }
+    }
+    if (!has_default) {
+        bc_current(e)->code[default_target] = bc_here(e);
+    }
+    bc_patch(e, e->breaks, bc_here(e));
+    e->breaks = outer_breaks;
+    xfree(targets);
+    xfree(cases);
+}
+
+void bc_statement(BcEmitter *e, AstNode *node) {
+    if (node->kind == K_RETURN) {
+        if (node->count == 1) {
+            bc_top_expr(e, ast_children(node), true);
+        } else {
+            bc_op_arg(e, OP_PUSH, 1, 0);
+        }
+        bc_op(e, OP_RETURN, -1);
+    } else if (node->kind == K_EXPR_STATEMENT) {
+        if (node->count == 1) {
+            bc_top_expr(e, ast_children(node), false);
+        }
+    } else if (node->kind == K_DECLARATION) {
+        for (unsigned int i = 0; i < node->count; ++i) {
+            AstNode *declaration = ast_children(node) + i;
+            int slot = bc_new_local(e, ast_string(ast_children(declaration)));
+            if (declaration->kind == K_INIT_DECLARATION) {
+                bc_expr(e, ast_children(declaration) + 1, true);
+                bc_op_arg(e, OP_STORE, -1, slot);
+            }
+        }
+    } else if (node->kind == K_IF) {
+        int skip_then = bc_branch(e, ast_children(node), false);
+        bc_statement(e, ast_children(node) + 1);
+        if (node->count == 3) {
+            int skip_else = bc_op_arg(e, OP_JUMP, 0, -1);
+            bc_patch(e, skip_then, bc_here(e));
+            bc_statement(e, ast_children(node) + 2);
+            bc_patch(e, skip_else, bc_here(e));
+        } else {
+            bc_patch(e, skip_then, bc_here(e));
+        }
+    } else if (node->kind == K_WHILE) {
+        // The condition goes after the body, so each iteration takes one jump
+        int outer_breaks = e->breaks;
+        int outer_continues = e->continues;
+        e->breaks = -1;
+        e->continues = bc_op_arg(e, OP_JUMP, 0, -1);
+        int body = bc_here(e);
+        bc_statement(e, ast_children(node) + 1);
+        bc_patch(e, e->continues, bc_here(e));
+        bc_patch(e, bc_branch(e, ast_children(node), true), body);
+        bc_patch(e, e->breaks, bc_here(e));
+        e->breaks = outer_breaks;
+        e->continues = outer_continues;
+    } else if (node->kind == K_SWITCH) {
+        bc_switch(e, node);
+    } else if (node->kind == K_BLOCK) {
+        scopes_enter(&e->scopes);
+        for (unsigned int i = 0; i < node->count; ++i) {
+            bc_statement(e, ast_children(node) + i);
+        }
+        scopes_exit(&e->scopes);
+    } else if (node->kind == K_BREAK) {
+        e->breaks = bc_op_arg(e, OP_JUMP, 0, e->breaks);
+    } else if (node->kind == K_CONTINUE) {
+        e->continues = bc_op_arg(e, OP_JUMP, 0, e->continues);
+    } else {
+        panic("Unable to handle statement type");
+    }
+}
+
+// Lower a function to bytecode, adding it to a program
+void bc_function(BcProgram *program, AstNode *node) {
+    assert(node->kind == K_FUNCTION);
+    BcEmitter e;
+    e.program = program;
+    e.function = bc_function_index(program, ast_string(ast_children(node)));
+    e.depth = 0;
+    e.breaks = -1;
+    e.continues = -1;
+    BcFunction *function = bc_current(&e);
+    if (function->defined) {
+        fputs("Error:\n", errors());
+        fprintf(errors(), "Function %s defined twice\n", function->name);
+        fail();
+    }
+    function->defined = true;
+    AstNode *params = ast_children(node) + 1;
+    bc_check_arity(function, params->count);
+    scopes_init(&e.scopes);
+    scopes_enter(&e.scopes);
+    for (unsigned int i = 0; i < params->count; ++i) {
+        bc_new_local(&e, ast_string(ast_children(params) + i));
+    }
+    AstNode *block = ast_children(node) + 2;
+    for (unsigned int i = 0; i < block->count; ++i) {
+        bc_statement(&e, ast_children(block) + i);
+    }
+    // Falling off the end of a function returns 0
+    bc_op_arg(&e, OP_PUSH, 1, 0);
+    bc_op(&e, OP_RETURN, -1);
+    scopes_exit(&e.scopes);
+    xfree(e.scopes.scopes);
+}
+
+// The state of a call we'll return to
+typedef struct BcFrame {
+    BcFunction *function;
+    // Where to continue in the caller
+    int32_t const *pc;
+    // Where the caller's locals start on the stack
+    size_t base;
+} BcFrame;
+
+// Runaway recursion stops where it would overflow the 8 MB stack programs
+// usually get natively, where each call takes at least 16 bytes
+#define BC_MAX_STACK ((8 << 20) / sizeof(int32_t))
+#define BC_MAX_FRAMES ((8 << 20) / 16)
+
+// Run a program from its main function, returning what main returned
+int bc_run(BcProgram *program) {
+    for (unsigned int i = 0; i < program->count; ++i) {
+        if (!program->functions[i].defined) {
+            fputs("Error:\n", errors());
+            fprintf(errors(), "Call to undefined function %s\n",
+                    program->functions[i].name);
+            fail();
+        }
+    }
+    unsigned int *bucket = bc_bucket(program, "main");
+    if (*bucket == 0) {
+        panic("Error:\nThe program has no main function");
+    }
+    BcFunction *function = program->functions + *bucket - 1;
+    size_t capacity = 1024;
+    while (capacity < (size_t)function->slot_count + function->max_depth) {
+        capacity <<= 1;
+    }
+    int32_t *stack = xmalloc(capacity * sizeof(int32_t));
+    // The arguments of main are all 0
+    memset(stack, 0, function->slot_count * sizeof(int32_t));
+    int32_t *locals = stack;
+    int32_t *sp = stack + function->slot_count;
+    BcFrame *frames = NULL;
+    size_t frame_count = 0;
+    size_t frame_capacity = 0;
+    int32_t const *code = function->code;
+    int32_t const *pc = code;
+    // Computed gotos jump straight to the next instruction's handler, which
+    // is quite a bit faster than going through a switch
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static void *const dispatch[OP_COUNT] = {
+        [OP_PUSH] = &&op_push,
+        [OP_LOAD] = &&op_load,
+        [OP_STORE] = &&op_store,
+        [OP_TEE] = &&op_tee,
+        [OP_POP] = &&op_pop,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_MUL] = &&op_mul,
+        [OP_DIV] = &&op_div,
+        [OP_MOD] = &&op_mod,
+        [OP_AND] = &&op_and,
+        [OP_OR] = &&op_or,
+        [OP_XOR] = &&op_xor,
+        [OP_EQ] = &&op_eq,
+        [OP_NE] = &&op_ne,
+        [OP_ADD_IMM] = &&op_add_imm,
+        [OP_NOT] = &&op_not,
+        [OP_BIT_NOT] = &&op_bit_not,
+        [OP_NEGATE] = &&op_negate,
+        [OP_SELECT] = &&op_select,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMP_IF_ZERO] = &&op_jump_if_zero,
+        [OP_JUMP_IF_NOT_ZERO] = &&op_jump_if_not_zero,
+        [OP_JUMP_IF_EQ] = &&op_jump_if_eq,
+        [OP_JUMP_IF_NE] = &&op_jump_if_ne,
+        [OP_SWITCH] = &&op_switch,
+        [OP_CALL] = &&op_call,
+        [OP_RETURN] = &&op_return,
+    };
+#define DISPATCH() goto *dispatch[*pc++]
+// Arithmetic wraps around, like the code we generate
+#define BINARY(op)                                                             \
+    --sp;                                                                      \
+    sp[-1] = (uint32_t)sp[-1] op (uint32_t)sp[0];                              \
+    DISPATCH()
+// The processor traps on these, so we stop the program instead
+#define BC_CHECK_DIVISION()                                                    \
+    if (sp[0] == 0 || (sp[0] == -1 && sp[-1] == INT32_MIN)) {                  \
+        panic("Error:\nDivision overflow");                                   \
+    }
+    DISPATCH();
+op_push:
+    *sp++ = *pc++;
+    DISPATCH();
+op_load:
+    *sp++ = locals[*pc++];
+    DISPATCH();
+op_store:
+    locals[*pc++] = *--sp;
+    DISPATCH();
+op_tee:
+    locals[*pc++] = sp[-1];
+    DISPATCH();
+op_pop:
+    --sp;
+    DISPATCH();
+op_add:
+    BINARY(+);
+op_sub:
+    BINARY(-);
+op_mul:
+    BINARY(*);
+op_and:
+    BINARY(&);
+op_or:
+    BINARY(|);
+op_xor:
+    BINARY(^);
+op_div:
+    --sp;
+    BC_CHECK_DIVISION();
+    sp[-1] /= sp[0];
+    DISPATCH();
+op_mod:
+    --sp;
+    BC_CHECK_DIVISION();
+    sp[-1] %= sp[0];
+    DISPATCH();
+op_eq:
+    --sp;
+    sp[-1] = sp[-1] == sp[0];
+    DISPATCH();
+op_ne:
+    --sp;
+    sp[-1] = sp[-1] != sp[0];
+    DISPATCH();
+op_add_imm:
+    sp[-1] = (uint32_t)sp[-1] + (uint32_t)*pc++;
+    DISPATCH();
+op_not:
+    sp[-1] = !sp[-1];
+    DISPATCH();
+op_bit_not:
+    sp[-1] = ~sp[-1];
+    DISPATCH();
+op_negate:
+    sp[-1] = -(uint32_t)sp[-1];
+    DISPATCH();
+op_select:
+    sp -= 2;
+    sp[-1] = sp[-1] ? sp[0] : sp[1];
+    DISPATCH();
+op_jump:
+    pc = code + *pc;
+    DISPATCH();
+op_jump_if_zero:
+    pc = *--sp == 0 ? code + *pc : pc + 1;
+    DISPATCH();
+op_jump_if_not_zero:
+    pc = *--sp != 0 ? code + *pc : pc + 1;
+    DISPATCH();
+op_jump_if_eq:
+    sp -= 2;
+    pc = sp[0] == sp[1] ? code + *pc : pc + 1;
+    DISPATCH();
+op_jump_if_ne:
+    sp -= 2;
+    pc = sp[0] != sp[1] ? code + *pc : pc + 1;
+    DISPATCH();
+op_switch: {
+    int32_t value = *--sp;
+    int32_t const *pairs = pc + 2;
+    unsigned int low = 0;
+    unsigned int high = pc[0];
+    pc = code + pc[1];
+    while (low < high) {
+        unsigned int middle = (low + high) / 2;
+        if (pairs[2 * middle] == value) {
+            pc = code + pairs[2 * middle + 1];
+            break;
+        } else if (pairs[2 * middle] < value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    DISPATCH();
+}
+op_call: {
+    BcFunction *callee = program->functions + *pc++;
+    if (frame_count == BC_MAX_FRAMES) {
+        panic("Error:\nStack overflow");
+    }
+    if (frame_count == frame_capacity) {
+        frame_capacity = frame_capacity == 0 ? 64 : frame_capacity << 1;
+        frames = xrealloc(frames, frame_capacity * sizeof(BcFrame));
+    }
+    frames[frame_count++] = (BcFrame){function, pc, locals - stack};
+    // The arguments become the callee's first locals
+    size_t base = sp - stack - callee->param_count;
+    size_t needed = base + callee->slot_count + callee->max_depth;
+    if (needed > BC_MAX_STACK) {
+        panic("Error:\nStack overflow");
+    }
+    if (needed > capacity) {
+        while (needed > capacity) {
+            capacity <<= 1;
+        }
+        stack = xrealloc(stack, capacity * sizeof(int32_t));
+    }
+    locals = stack + base;
+    sp = locals + callee->slot_count;
+    memset(locals + callee->param_count, 0,
+           (callee->slot_count - callee->param_count) * sizeof(int32_t));
+    function = callee;
+    code = callee->code;
+    pc = code;
+    DISPATCH();
+}
+op_return: {
+    int32_t value = sp[-1];
+    if (frame_count == 0) {
+        xfree(stack);
+        xfree(frames);
+        return value;
+    }
+    BcFrame *frame = frames + --frame_count;
+    sp = locals;
+    *sp++ = value;
+    function = frame->function;
+    code = function->code;
+    pc = frame->pc;
+    locals = stack + frame->base;
+    DISPATCH();
+}
+#undef BINARY
+#undef BC_CHECK_DIVISION
+#undef DISPATCH
+#pragma GCC diagnostic pop
+}
+
+/** REPORTING **/
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The most phases a report can hold
+#define MAX_REPORT_PHASES 16
+
+// Holds what we measured about a compilation, for --time-report/--mem-report
+struct Report {
+    // Whether or not to print the time taken by each phase
+    bool time;
+    // Whether or not to print the memory used
+    bool mem;
+    // Whether or not to print the report as JSON instead of a table
+    bool json;
+    // The name of each phase we timed
+    char const *phase_names[MAX_REPORT_PHASES];
+    // The time each phase took, in seconds
+    double phase_seconds[MAX_REPORT_PHASES];
+    // The number of phases we timed
+    int phase_count;
+    // The size of the input, in bytes
+    long input_bytes;
+    // The number of tokens the lexer produced
+    long tokens;
+    // The number of nodes in the syntax tree, after optimization
+    long ast_nodes;
+    // The size of the output, in bytes, or < 0 if we couldn't find it
+    long output_bytes;
+    // The number of functions we found, and didn't find, in the cache
+    long cache_hits;
+    long cache_misses;
+    // The number of functions we turned into aliases of identical ones
+    long functions_folded;
+};
+
+void report_init(Report *report) {
+    memset(report, 0, sizeof(Report));
+    report->output_bytes = -1;
+}
+
+// Phases reported more than once, e.g. for each function, add up
+void report_phase(Report *report, char const *name, double seconds) {
+    for (int i = 0; i < report->phase_count; ++i) {
+        if (strcmp(report->phase_names[i], name) == 0) {
+            report->phase_seconds[i] += seconds;
+            return;
+        }
+    }
+    if (report->phase_count < MAX_REPORT_PHASES) {
+        report->phase_names[report->phase_count] = name;
+        report->phase_seconds[report->phase_count] = seconds;
+        report->phase_count++;
+    }
+}
+
+// The most memory we've had resident at once, in KiB
+long report_peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+void report_print_json(Report *report, FILE *fp) {
+    fputs("{", fp);
+    char const *separator = "";
+    if (report->time) {
+        double total = 0;
+        fputs("\"phases\": [", fp);
+        for (int i = 0; i < report->phase_count; ++i) {
+            fprintf(fp, "%s{\"name\": \"%s\", \"ms\": %.3f}",
+                    i == 0 ? "" : ", ", report->phase_names[i],
+                    report->phase_seconds[i] * 1e3);
+            total += report->phase_seconds[i];
+        }
+        fprintf(fp, "], \"total_ms\": %.3f", total * 1e3);
+        separator = ", ";
+    }
+    if (report->mem) {
+        fprintf(fp, "%s\"input_bytes\": %ld, \"tokens\": %ld", separator,
+                report->input_bytes, report->tokens);
+        fprintf(fp, ", \"ast_nodes\": %ld, \"bytes_allocated\": %zu",
+                report->ast_nodes, atomic_load(&bytes_allocated));
+        fprintf(fp, ", \"peak_rss_kib\": %ld", report_peak_rss());
+        fprintf(fp, ", \"functions_folded\": %ld", report->functions_folded);
+        if (report->output_bytes >= 0) {
+            fprintf(fp, ", \"output_bytes\": %ld", report->output_bytes);
+        } else {
+            fputs(", \"output_bytes\": null", fp);
+        }
+        separator = ", ";
+    }
+    if (report->cache_hits + report->cache_misses > 0) {
+        fprintf(fp, "%s\"cache_hits\": %ld, \"cache_misses\": %ld", separator,
+                report->cache_hits, report->cache_misses);
+    }
+    fputs("}\n", fp);
+}
+
+void report_print_table(Report *report, FILE *fp) {
+    if (report->time) {
+        double total = 0;
+        for (int i = 0; i < report->phase_count; ++i) {
+            total += report->phase_seconds[i];
+        }
+        fprintf(fp, "%-24s %12s %8s\n", "Phase", "Time (ms)", "%");
+        for (int i = 0; i < report->phase_count; ++i) {
+            double seconds = report->phase_seconds[i];
+            double percent = total > 0 ? 100 * seconds / total : 0;
+            fprintf(fp, "%-24s %12.3f %7.1f%%\n", report->phase_names[i],
+                    seconds * 1e3, percent);
+        }
+        fprintf(fp, "%-24s %12.3f %7.1f%%\n", "total", total * 1e3, 100.0);
+    }
+    if (report->mem) {
+        fprintf(fp, "%-24s %12ld\n", "Input bytes", report->input_bytes);
+        fprintf(fp, "%-24s %12ld\n", "Tokens lexed", report->tokens);
+        fprintf(fp, "%-24s %12ld\n", "AST nodes", report->ast_nodes);
+        fprintf(fp, "%-24s %12zu\n", "Bytes allocated",
+                atomic_load(&bytes_allocated));
+        fprintf(fp, "%-24s %12ld\n", "Peak RSS (KiB)", report_peak_rss());
+        fprintf(fp, "%-24s %12ld\n", "Functions folded",
+                report->functions_folded);
+        if (report->output_bytes >= 0) {
+            fprintf(fp, "%-24s %12ld\n", "Output bytes",
+                    report->output_bytes);
+        } else {
+            fprintf(fp, "%-24s %12s\n", "Output bytes", "n/a");
+        }
+    }
+    if (report->cache_hits + report->cache_misses > 0) {
+        fprintf(fp, "%-24s %12ld\n", "Cache hits", report->cache_hits);
+        fprintf(fp, "%-24s %12ld\n", "Cache misses", report->cache_misses);
+    }
+}
+
+// Count the bytes written to an output, if we can tell
+void report_output(Report *report, FILE *out) {
+    if (fflush(out) != 0) {
+        return;
+    }
+    long size = ftell(out);
+    if (size >= 0) {
+        report->output_bytes = report->output_bytes < 0
+                                   ? size
+                                   : report->output_bytes + size;
+    }
+}
+
+// Add what another report measured, e.g. on another thread, to this one
+void report_merge(Report *report, Report *other) {
+    for (int i = 0; i < other->phase_count; ++i) {
+        report_phase(report, other->phase_names[i], other->phase_seconds[i]);
+    }
+    report->input_bytes += other->input_bytes;
+    report->tokens += other->tokens;
+    report->ast_nodes += other->ast_nodes;
+    report->cache_hits += other->cache_hits;
+    report->cache_misses += other->cache_misses;
+    report->functions_folded += other->functions_folded;
+    if (other->output_bytes >= 0) {
+        report->output_bytes = report->output_bytes < 0
+                                   ? other->output_bytes
+                                   : report->output_bytes + other->output_bytes;
+    }
+}
+
+// Print the parts of the report that were asked for to stderr
+void report_print(Report *report) {
+    if (!report->time && !report->mem) {
+        return;
+    }
+    if (report->json) {
+        report_print_json(report, stderr);
+    } else {
+        report_print_table(report, stderr);
+    }
+}
+
+/** PARALLEL PARSING **/
+// Copy a node from another pool into this thread's pool, along with the nodes
+// beneath it, taking the names it uses from the other pool
+void ast_copy_from(AstNode *dst, AstPool *from, AstNode *src) {
+    AstPool *to = ast_pool;
+    *dst = *src;
+    if (src->kind == K_IDENTIFIER) {
+        ast_set_string(dst, from->strings[src->data.string]);
+        from->strings[src->data.string] = NULL;
+        return;
+    }
+    if (src->kind == K_NUMBER) {
+        return;
+    }
+    AstNode *children = ast_alloc_children(dst, src->count);
+    ast_pool = from;
+    AstNode *src_children = src->count > 0 ? ast_children(src) : NULL;
+    ast_pool = to;
+    for (unsigned int i = 0; i < src->count; ++i) {
+        ast_copy_from(children + i, from, src_children + i);
+    }
+}
+
+// Parse the function starting at `start`, on `line`, into this thread's pool,
+// returning the messages of the error we ran into, or NULL if there wasn't one
+//
+// This lets several threads parse functions at once, with the caller picking
+// which error to report, rather than whichever thread fails first.
+char *parse_function_at(char const *program, long start, int line,
+                        AstNode *node, Report *report) {
+    jmp_buf *outer_handler = error_handler;
+    FILE *outer_stream = error_stream;
+    char *messages;
+    size_t size;
+    error_stream = open_memstream(&messages, &size);
+    if (error_stream == NULL) {
+        error_stream = outer_stream;
+        panic("Failed to open a buffer for errors");
+    }
+    jmp_buf handler;
+    error_handler = &handler;
+    bool failed = true;
+    if (setjmp(handler) == 0) {
+        LexState lexer = lex_init(program);
+        lex_seek(&lexer, start, line);
+        ParseState parser = parse_init(lexer);
+        parser.time_lexing = report->time;
+        double before = now_seconds();
+        parse_next_function(&parser, node);
+        report_phase(report, "lex", parser.lex_seconds);
+        report_phase(report, "parse",
+                     now_seconds() - before - parser.lex_seconds);
+        report->tokens += parser.lex_st.token_count;
+        failed = false;
+    }
+    fclose(error_stream);
+    error_stream = outer_stream;
+    error_handler = outer_handler;
+    if (!failed) {
+        free(messages);
+        return NULL;
+    }
+    return messages;
+}
+
+// A function for a parsing thread to parse
+typedef struct ParseTask {
+    long start;
+    int line;
+    // The pool holding the function's tree, and the tree itself
+    AstPool tree;
+    AstNode function;
+    // The messages of the error we ran into parsing it, if any
+    char *error;
+} ParseTask;
+
+typedef struct ParseWorkers {
+    char const *program;
+    ParseTask *tasks;
+    unsigned int count;
+    // The next task for a thread to take
+    atomic_uint next;
+} ParseWorkers;
+
+typedef struct ParseWorker {
+    ParseWorkers *workers;
+    pthread_t thread;
+    Report report;
+} ParseWorker;
+
+void *parse_worker(void *arg) {
+    ParseWorker *worker = arg;
+    ParseWorkers *workers = worker->workers;
+    for (;;) {
+        unsigned int i = atomic_fetch_add(&workers->next, 1);
+        if (i >= workers->count) {
+            break;
+        }
+        ParseTask *task = workers->tasks + i;
+        ast_pool = &task->tree;
+        task->error =
+            parse_function_at(workers->program, task->start, task->line,
+                              &task->function, &worker->report);
+    }
+    ast_pool = NULL;
+    return NULL;
+}
+
+// Parse a whole program like parse_top_level, on `jobs` threads
+//
+// We find where each function starts by matching braces, and each thread
+// then parses whole functions into their own pools. Once they're done, the
+// functions are copied into this thread's pool in order. If any function has
+// an error, we report the first one, like parsing on a single thread would.
+void parse_top_level_parallel(char const *program, int jobs, AstNode *node,
+                              Report *report) {
+    double start = now_seconds();
+    FunctionSpan *spans;
+    ParseWorkers workers;
+    workers.program = program;
+    workers.count = scan_functions(program, &spans);
+    report_phase(report, "scan", now_seconds() - start);
+    workers.tasks = xmalloc((workers.count + 1) * sizeof(ParseTask));
+    atomic_init(&workers.next, 0);
+    for (unsigned int i = 0; i < workers.count; ++i) {
+        workers.tasks[i].start = spans[i].start;
+        workers.tasks[i].line = spans[i].line;
+        ast_pool_init(&workers.tasks[i].tree);
+    }
+    spans_free(spans, workers.count);
+    ParseWorker *threads = xmalloc(jobs * sizeof(ParseWorker));
+    for (int i = 0; i < jobs; ++i) {
+        threads[i].workers = &workers;
+        report_init(&threads[i].report);
+        threads[i].report.time = report->time;
+        if (pthread_create(&threads[i].thread, NULL, parse_worker,
+                           threads + i)) {
+            panic("Failed to start a parsing thread");
+        }
+    }
+    for (int i = 0; i < jobs; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        report_merge(report, &threads[i].report);
+    }
+    xfree(threads);
+    for (unsigned int i = 0; i < workers.count; ++i) {
+        if (workers.tasks[i].error != NULL) {
+            fputs(workers.tasks[i].error, errors());
+            fail();
+        }
+    }
+    start = now_seconds();
+    node->kind = K_TOP_LEVEL;
+    AstNode *functions = ast_alloc_children(node, workers.count);
+    for (unsigned int i = 0; i < workers.count; ++i) {
+        ParseTask *task = workers.tasks + i;
+        ast_copy_from(functions + i, &task->tree, &task->function);
+        ast_pool_destroy(&task->tree);
+    }
+    xfree(workers.tasks);
+    report_phase(report, "assemble", now_seconds() - start);
+}
+
+/** COMPILE CACHE **/
+// The assembly we generate changes between builds of cici, so entries are only
+// used by the build that wrote them
+#define CACHE_VERSION "cici " __DATE__ " " __TIME__
+
+// Makes the names of temporary files unique between the threads of a process
+atomic_uint cache_temp_counter = 0;
+
+// Make the cache directory if it doesn't exist yet
+void cache_init(Options *options) {
+    if (options->cache_dir != NULL) {
+        mkdir(options->cache_dir, 0777);
+    }
+}
+
+// Combine the hash of a function's tokens with everything else that changes
+// the code we generate for it
+uint64_t cache_key(Options *options, uint64_t function_hash) {
+    uint64_t key =
+        hash_bytes(function_hash, CACHE_VERSION, sizeof(CACHE_VERSION));
+    key = hash_bytes(key, &options->optimize, sizeof(bool));
+    key = hash_bytes(key, &options->debug_info, sizeof(bool));
+    return hash_bytes(key, &options->unroll_factor, sizeof(int));
+}
+
+// Fold the lines of the statements in a tree into a hash
+//
+// The hash of a function's tokens ignores spacing, but the lines we say its
+// code comes from don't, so we need these too when we describe lines.
+uint64_t ast_hash_lines(uint64_t hash, AstNode *node) {
+    if (ast_has_line(node)) {
+        hash = hash_bytes(hash, &node->line, sizeof(node->line));
+    }
+    if (node->kind == K_IDENTIFIER || node->kind == K_NUMBER) {
+        return hash;
+    }
+    for (unsigned int i = 0; i < node->count; ++i) {
+        hash = ast_hash_lines(hash, ast_children(node) + i);
+    }
+    return hash;
+}
+
+char *cache_path(Options *options, uint64_t key, char const *suffix) {
+    size_t size = strlen(options->cache_dir) + strlen(suffix) + 18;
+    char *path = xmalloc(size);
+    snprintf(path, size, "%s/%016llx%s", options->cache_dir,
+             (unsigned long long)key, suffix);
+    return path;
+}
+
+// The line each entry starts with, saying which function it's for
+//
+// Keys are hashes, so two functions could share one. Checking the name and
+// the hash of the tokens too means that we'd have to be unlucky twice over to
+// use the code of another function.
+char *cache_header(uint64_t hash, char const *name) {
+    size_t size = strlen(name) + 22;
+    char *header = xmalloc(size);
+    snprintf(header, size, "# %016llx %s\n", (unsigned long long)hash, name);
+    return header;
+}
+
+// Read the assembly for a key, returning false if it's not in the cache
+//
+// `hash` and `name` are the hash of the function's tokens, and its name,
+// which the entry has to match. Like the buffers from open_memstream, this
+// one comes straight from malloc.
+bool cache_load(Options *options, uint64_t key, uint64_t hash,
+                char const *name, char **buffer, size_t *size) {
+    char *path = cache_path(options, key, ".s");
+    FILE *fp = fopen(path, "rb");
+    xfree(path);
+    if (fp == NULL) {
+        return false;
+    }
+    long length = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        length = ftell(fp);
+    }
+    if (length < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return false;
+    }
+    *buffer = malloc(length + 1);
+    if (*buffer == NULL) {
+        panic("Out of memory");
+    }
+    *size = fread(*buffer, 1, length, fp);
+    fclose(fp);
+    char *header = cache_header(hash, name);
+    size_t header_size = strlen(header);
+    bool matches = *size == (size_t)length && *size >= header_size &&
+                   memcmp(*buffer, header, header_size) == 0;
+    xfree(header);
+    if (!matches) {
+        free(*buffer);
+        return false;
+    }
+    *size -= header_size;
+    memmove(*buffer, *buffer + header_size, *size);
+    return true;
+}
+
+// Save the assembly for a key, for a function with a given hash and name
+//
+// Other processes might be reading or writing the same entry, so we write to
+// a temporary file first, and then rename it into place, which is atomic: an
+// entry is either missing or complete. Failing to save an entry isn't an
+// error, since we'll just compile the function again next time.
+void cache_store(Options *options, uint64_t key, uint64_t hash,
+                 char const *name, char const *buffer, size_t size) {
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", (long)getpid(),
+             atomic_fetch_add(&cache_temp_counter, 1));
+    char *temp = cache_path(options, key, suffix);
+    FILE *fp = fopen(temp, "wb");
+    if (fp != NULL) {
+        char *header = cache_header(hash, name);
+        bool written = fputs(header, fp) >= 0 &&
+                       fwrite(buffer, 1, size, fp) == size;
+        xfree(header);
+        if (fclose(fp) == 0 && written) {
+            char *path = cache_path(options, key, ".s");
+            if (rename(temp, path) == 0) {
+                xfree(temp);
+                temp = NULL;
+            }
+            xfree(path);
+        }
+        if (temp != NULL) {
+            remove(temp);
+        }
+    }
+    xfree(temp);
+}
+
+/** CODE FOLDING **/
+// The smallest table of functions we've written, which we index with the low
+// bits of a hash
+#define FOLD_BASE_CAPACITY 8
+
+_Static_assert((FOLD_BASE_CAPACITY & (FOLD_BASE_CAPACITY - 1)) == 0,
+               "The table of functions is indexed with a mask");
+
+// A function we've written out, which later functions can become aliases of
+typedef struct FoldedBody {
+    // The hash of the function's code, leaving out its name
+    uint64_t hash;
+    // The name of the function, which we own, or NULL for an empty slot
+    char *name;
+    // The code we hashed, which we own, so that a function only becomes an
+    // alias if its code is the same, and not just its hash
+    char *code;
+    size_t size;
+} FoldedBody;
+
+// Remembers the code of each function we write out, so that functions with
+// the same code as an earlier one can become aliases of it instead
+typedef struct CodeFolder {
+    // An open addressing table of the functions we've written
+    FoldedBody *bodies;
+    unsigned int capacity;
+    unsigned int count;
+    // The number of functions we've turned into aliases
+    long folded;
+} CodeFolder;
+
+void folder_init(CodeFolder *folder) {
+    folder->capacity = FOLD_BASE_CAPACITY;
+    folder->bodies = xmalloc(folder->capacity * sizeof(FoldedBody));
+    memset(folder->bodies, 0, folder->capacity * sizeof(FoldedBody));
+    folder->count = 0;
+    folder->folded = 0;
+}
+
+void folder_destroy(CodeFolder *folder) {
+    for (unsigned int i = 0; i < folder->capacity; ++i) {
+        xfree(folder->bodies[i].name);
+        xfree(folder->bodies[i].code);
+    }
+    xfree(folder->bodies);
+}
+
+// Find the slot for some code, which is empty if we haven't seen it yet
+FoldedBody *folder_slot(CodeFolder *folder, uint64_t hash, char const *code,
+                        size_t size) {
+    unsigned int mask = folder->capacity - 1;
+    unsigned int slot = hash & mask;
+    for (FoldedBody *body = folder->bodies + slot; body->name != NULL;
+         body = folder->bodies + slot) {
+        if (body->hash == hash && body->size == size &&
+            memcmp(body->code, code, size) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return folder->bodies + slot;
+}
+
+void folder_grow(CodeFolder *folder) {
+    FoldedBody *old = folder->bodies;
+    unsigned int old_capacity = folder->capacity;
+    folder->capacity <<= 1;
+    folder->bodies = xmalloc(folder->capacity * sizeof(FoldedBody));
+    memset(folder->bodies, 0, folder->capacity * sizeof(FoldedBody));
+    for (unsigned int i = 0; i < old_capacity; ++i) {
+        if (old[i].name != NULL) {
+            *folder_slot(folder, old[i].hash, old[i].code, old[i].size) =
+                old[i];
+        }
+    }
+    xfree(old);
+}
+
+// Copy the code of a function, replacing each use of its own name, in its
+// labels or in recursive calls, with the same placeholder
+char *fold_normalize(char const *code, size_t size, char const *name,
+                     size_t name_length, size_t *normalized_size) {
+    // The placeholder is never longer than the name
+    char *normalized = xmalloc(size);
+    size_t length = 0;
+    size_t start = 0;
+    for (size_t i = 0; i + name_length <= size; ++i) {
+        char const *next =
+            memchr(code + i, name[0], size - name_length + 1 - i);
+        if (next == NULL) {
+            break;
+        }
+        i = next - code;
+        if (memcmp(code + i, name, name_length) != 0 ||
+            (i > 0 && (IS_ALPHA_NUMERIC(code[i - 1]) || code[i - 1] == '_')) ||
+            (i + name_length < size &&
+             (IS_ALPHA_NUMERIC(code[i + name_length]) ||
+              code[i + name_length] == '_'))) {
+            continue;
+        }
+        memcpy(normalized + length, code + start, i - start);
+        length += i - start;
+        normalized[length++] = '\0';
+        i += name_length - 1;
+        start = i + 1;
+    }
+    memcpy(normalized + length, code + start, size - start);
+    *normalized_size = length + size - start;
+    return normalized;
+}
+
+// Write out the assembly of a function, or an alias to an earlier function
+// with the same code, if we fold functions
+void fold_write(CodeFolder *folder, FILE *out, char const *buffer,
+                size_t size) {
+    // The assembly always starts with `.globl name`
+    char const *directive = "\t.globl ";
+    size_t prefix = strlen(directive);
+    if (folder == NULL || size < prefix ||
+        memcmp(buffer, directive, prefix) != 0) {
+        fwrite(buffer, 1, size, out);
+        return;
+    }
+    char const *name = buffer + prefix;
+    size_t name_length = strcspn(name, "\n");
+    if (prefix + name_length >= size) {
+        fwrite(buffer, 1, size, out);
+        return;
+    }
+    // The name itself is replaced like any other use of it
+    size_t code_size;
+    char *code = fold_normalize(buffer, size, name, name_length, &code_size);
+    uint64_t hash = hash_bytes(HASH_BASIS, code, code_size);
+    FoldedBody *body = folder_slot(folder, hash, code, code_size);
+    if (body->name != NULL) {
+        xfree(code);
+        // The alias gets the type and size of what it refers to
+        fprintf(out, "\t.globl %.*s\n", (int)name_length, name);
+        fprintf(out, "\t.set %.*s, %s\n", (int)name_length, name, body->name);
+        ++folder->folded;
+        return;
+    }
+    fwrite(buffer, 1, size, out);
+    body->hash = hash;
+    body->code = code;
+    body->size = code_size;
+    body->name = xmalloc(name_length + 1);
+    memcpy(body->name, name, name_length);
+    body->name[name_length] = '\0';
+    if (2 * ++folder->count > folder->capacity) {
+        folder_grow(folder);
+    }
+}
+
+/** PARALLEL CODEGEN **/
+// How many functions can wait to be written out, for each worker
+#define JOBS_PER_WORKER 4
+
+// Optimize a function and generate its code
+void compile_function(Options *options, AsmState *st, AstNode *function,
+                      Report *report) {
+    optimize(options, function, report);
+    report->ast_nodes += ast_size(function);
+    double start = now_seconds();
+    asm_function(st, function);
+    report_phase(report, "codegen", now_seconds() - start);
+}
+
+// Compile a function into a buffer, or find it in the cache if we use one
+//
+// `hash` is the hash of the function's tokens.
+void compile_function_cached(Options *options, AsmState *st,
+                             AstNode *function, uint64_t hash, Report *report,
+                             char **buffer, size_t *size) {
+    uint64_t key = cache_key(options, hash);
+    if (options->debug_info) {
+        key = ast_hash_lines(key, function);
+    }
+    char const *name = ast_string(ast_children(function));
+    if (options->cache_dir != NULL) {
+        double start = now_seconds();
+        bool hit = cache_load(options, key, hash, name, buffer, size);
+        report_phase(report, "cache", now_seconds() - start);
+        if (hit) {
+            ++report->cache_hits;
+            return;
+        }
+        ++report->cache_misses;
+    }
+    st->out = open_memstream(buffer, size);
+    if (st->out == NULL) {
+        panic("Failed to open a buffer for a function");
+    }
+    compile_function(options, st, function, report);
+    fclose(st->out);
+    st->out = NULL;
+    if (options->cache_dir != NULL) {
+        double start = now_seconds();
+        cache_store(options, key, hash, name, *buffer, *size);
+        report_phase(report, "cache", now_seconds() - start);
+    }
+}
+
+// A function to compile, along with the assembly we generated for it
+typedef struct CodegenJob {
+    AstNode function;
+    // Where the function starts, if the worker needs to parse it, or -1, and
+    // the line it starts on
+    long start;
+    int line;
+    // The messages of the error we ran into parsing or compiling the
+    // function, if any
+    char *error;
+    // The hash of the function's tokens, to look it up in the cache
+    uint64_t hash;
+    // The pool holding the function's tree, reused by later functions
+    AstPool tree;
+    // The assembly for this function, once it's done
+    char *buffer;
+    size_t size;
+    bool done;
+} CodegenJob;
+
+typedef struct CodegenPool CodegenPool;
+
+typedef struct CodegenWorker {
+    CodegenPool *pool;
+    pthread_t thread;
+    // What this worker measured, merged into the main report at the end
+    Report report;
+} CodegenWorker;
+
+// Compiles functions on several threads, writing them out in source order
+//
+// The jobs form a ring buffer: the parser queues functions at `queued`,
+// workers take them at `taken`, and we write them out at `written`, which
+// bounds how many functions we hold at once.
+struct CodegenPool {
+    Options *options;
+    // The program we're compiling, for workers parsing functions themselves
+    char const *program;
     FILE *out;
-    if (strcmp(out_filename, "stdout") == 0) {
+    // Where we fold functions we write out, or NULL
+    CodeFolder *folder;
+    CodegenWorker *workers;
+    int worker_count;
+    CodegenJob *jobs;
+    unsigned int capacity;
+    unsigned long queued;
+    unsigned long taken;
+    unsigned long written;
+    // Set once no more functions will be queued
+    bool closing;
+    pthread_mutex_t lock;
+    // Signalled when a function is queued, or the pool is closing
+    pthread_cond_t has_work;
+    // Signalled when a worker finishes a function
+    pthread_cond_t job_done;
+};
+
+// Compile a function on a worker, returning the messages of the error we ran
+// into, if any, like parse_function_at
+//
+// Only the thread writing functions out stops at an error, once it gets to
+// the function, so that we report the same error as with a single thread.
+char *codegen_try(CodegenPool *pool, AsmState *st, CodegenJob *job,
+                  Report *report) {
+    jmp_buf *outer_handler = error_handler;
+    FILE *outer_stream = error_stream;
+    char *messages;
+    size_t size;
+    error_stream = open_memstream(&messages, &size);
+    if (error_stream == NULL) {
+        error_stream = outer_stream;
+        panic("Failed to open a buffer for errors");
+    }
+    jmp_buf handler;
+    error_handler = &handler;
+    bool failed = true;
+    st->out = NULL;
+    if (setjmp(handler) == 0) {
+        compile_function_cached(pool->options, st, &job->function, job->hash,
+                                report, &job->buffer, &job->size);
+        failed = false;
+    } else if (st->out != NULL) {
+        // The function's assembly was cut short, so there's nothing to keep
+        fclose(st->out);
+        free(job->buffer);
+        job->buffer = NULL;
+    }
+    fclose(error_stream);
+    error_stream = outer_stream;
+    error_handler = outer_handler;
+    if (!failed) {
+        free(messages);
+        return NULL;
+    }
+    return messages;
+}
+
+void *codegen_worker(void *arg) {
+    CodegenWorker *worker = arg;
+    CodegenPool *pool = worker->pool;
+    AsmState *st = asm_init(NULL, pool->options->debug_info);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->taken == pool->queued && !pool->closing) {
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        }
+        if (pool->taken == pool->queued) {
+            break;
+        }
+        CodegenJob *job = pool->jobs + pool->taken++ % pool->capacity;
+        pthread_mutex_unlock(&pool->lock);
+        ast_pool = &job->tree;
+        if (job->start >= 0) {
+            job->error =
+                parse_function_at(pool->program, job->start, job->line,
+                                  &job->function, &worker->report);
+        }
+        if (job->error == NULL) {
+            job->error = codegen_try(pool, st, job, &worker->report);
+        }
+        ast_pool_reset(&job->tree);
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        pthread_cond_broadcast(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    asm_destroy(st);
+    return NULL;
+}
+
+// Start the workers of a pool
+//
+// `time` says whether workers time lexing apart from parsing, when they parse
+// functions themselves.
+void pool_init(CodegenPool *pool, Options *options, char const *program,
+               FILE *out, CodeFolder *folder, int worker_count, bool time) {
+    pool->options = options;
+    pool->program = program;
+    pool->out = out;
+    pool->folder = folder;
+    pool->worker_count = worker_count;
+    pool->capacity = worker_count * JOBS_PER_WORKER;
+    pool->jobs = xmalloc(pool->capacity * sizeof(CodegenJob));
+    for (unsigned int i = 0; i < pool->capacity; ++i) {
+        ast_pool_init(&pool->jobs[i].tree);
+    }
+    pool->queued = 0;
+    pool->taken = 0;
+    pool->written = 0;
+    pool->closing = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+    pool->workers = xmalloc(worker_count * sizeof(CodegenWorker));
+    for (int i = 0; i < worker_count; ++i) {
+        CodegenWorker *worker = pool->workers + i;
+        worker->pool = pool;
+        report_init(&worker->report);
+        worker->report.time = time;
+        if (pthread_create(&worker->thread, NULL, codegen_worker, worker)) {
+            panic("Failed to start a codegen thread");
+        }
+    }
+}
+
+// Wait for the oldest function we haven't written out, and write it out
+void pool_write_oldest(CodegenPool *pool) {
+    CodegenJob *job = pool->jobs + pool->written % pool->capacity;
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    // Since we write functions out in order, the error we report is always
+    // the first one in the program
+    if (job->error != NULL) {
+        fputs(job->error, errors());
+        fail();
+    }
+    fold_write(pool->folder, pool->out, job->buffer, job->size);
+    free(job->buffer);
+    ++pool->written;
+}
+
+// Find the pool to parse the next function into, waiting for room if needed
+AstPool *pool_reserve(CodegenPool *pool) {
+    if (pool->queued - pool->written == pool->capacity) {
+        pool_write_oldest(pool);
+    }
+    return &pool->jobs[pool->queued % pool->capacity].tree;
+}
+
+// Queue a function to be compiled, parsed into the pool we reserved for it
+void pool_submit(CodegenPool *pool, AstNode *function, uint64_t hash) {
+    CodegenJob *job = pool->jobs + pool->queued % pool->capacity;
+    job->function = *function;
+    job->start = -1;
+    job->error = NULL;
+    job->hash = hash;
+    job->done = false;
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Queue a function for a worker to parse and then compile, after reserving
+// room for it
+void pool_submit_span(CodegenPool *pool, FunctionSpan *span) {
+    CodegenJob *job = pool->jobs + pool->queued % pool->capacity;
+    job->start = span->start;
+    job->line = span->line;
+    job->error = NULL;
+    job->hash = span->hash;
+    job->done = false;
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Write out every remaining function, and stop the workers
+//
+// The time each worker spent is added to the report, so with several
+// workers the optimization and codegen phases add up the time of each thread.
+void pool_finish(CodegenPool *pool, Report *report) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = true;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+    while (pool->written < pool->queued) {
+        pool_write_oldest(pool);
+    }
+    for (int i = 0; i < pool->worker_count; ++i) {
+        CodegenWorker *worker = pool->workers + i;
+        pthread_join(worker->thread, NULL);
+        report_merge(report, &worker->report);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_cond_destroy(&pool->job_done);
+    for (unsigned int i = 0; i < pool->capacity; ++i) {
+        ast_pool_destroy(&pool->jobs[i].tree);
+    }
+    xfree(pool->workers);
+    xfree(pool->jobs);
+}
+
+/** SERIALIZED SYNTAX TREES **/
+// Bump this whenever the layout of these files, or of AstNode, changes
+#define AST_FILE_VERSION 3
+// The magic bytes, including the null byte, at the start of these files
+#define AST_FILE_MAGIC "CICIAST"
+
+// The start of a file holding the syntax trees of a program's functions
+//
+// It's followed by the hash of each function's tokens, the nodes, the index
+// of each function's root node, the offset of each name along with one past
+// the last, and finally the names, each ending with a null byte. Nodes refer
+// to their children by index in the file, like in a pool, so the file can be
+// mapped in and used as a pool as is. Everything is in the byte order of the
+// machine that wrote it.
+typedef struct AstFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t function_count;
+    uint32_t node_count;
+    uint32_t string_count;
+    uint32_t string_bytes;
+    // The index of the name of the program's file, or UINT32_MAX
+    uint32_t source_name;
+} AstFileHeader;
+
+_Static_assert(sizeof(AstFileHeader) == 32,
+               "The hashes after the header should stay aligned");
+
+// Gathers the trees of functions as we parse them, to write them out at once
+typedef struct AstWriter {
+    AstNode *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint64_t *hashes;
+    uint32_t *roots;
+    uint32_t function_count;
+    uint32_t function_capacity;
+    // Each name only appears once, the offsets saying where each one starts
+    char *bytes;
+    uint32_t byte_count;
+    uint32_t byte_capacity;
+    uint32_t *offsets;
+    uint32_t string_count;
+    uint32_t string_capacity;
+    // An open addressing table holding one past the index of each name
+    uint32_t *slots;
+    uint32_t slot_capacity;
+    uint32_t source_name;
+} AstWriter;
+
+uint32_t ast_writer_intern(AstWriter *writer, char const *name);
+
+// Start a file of syntax trees for a program, whose file name can be NULL
+void ast_writer_init(AstWriter *writer, char const *filename) {
+    memset(writer, 0, sizeof(AstWriter));
+    writer->string_capacity = BASE_STRING_SIZE;
+    writer->offsets = xmalloc(writer->string_capacity * sizeof(uint32_t));
+    writer->slot_capacity = 2 * BASE_STRING_SIZE;
+    writer->slots = xmalloc(writer->slot_capacity * sizeof(uint32_t));
+    memset(writer->slots, 0, writer->slot_capacity * sizeof(uint32_t));
+    writer->source_name = UINT32_MAX;
+    if (filename != NULL) {
+        writer->source_name = ast_writer_intern(writer, filename);
+    }
+}
+
+void ast_writer_destroy(AstWriter *writer) {
+    xfree(writer->nodes);
+    xfree(writer->hashes);
+    xfree(writer->roots);
+    xfree(writer->bytes);
+    xfree(writer->offsets);
+    xfree(writer->slots);
+}
+
+// Find the slot for a name, which either holds that name or is empty
+uint32_t *ast_writer_slot(AstWriter *writer, char const *name) {
+    uint32_t mask = writer->slot_capacity - 1;
+    uint32_t i = hash_bytes(HASH_BASIS, name, strlen(name)) & mask;
+    for (;; i = (i + 1) & mask) {
+        uint32_t index = writer->slots[i];
+        if (index == 0 ||
+            strcmp(writer->bytes + writer->offsets[index - 1], name) == 0) {
+            return writer->slots + i;
+        }
+    }
+}
+
+// Give the index of a name in the file, adding it if it's new
+uint32_t ast_writer_intern(AstWriter *writer, char const *name) {
+    uint32_t *slot = ast_writer_slot(writer, name);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    uint32_t size = strlen(name) + 1;
+    if (size > UINT32_MAX - writer->byte_count) {
+        panic("Too many names to write out");
+    }
+    if (writer->byte_count + size > writer->byte_capacity) {
+        writer->byte_capacity = 2 * writer->byte_capacity + size;
+        writer->bytes = xrealloc(writer->bytes, writer->byte_capacity);
+    }
+    memcpy(writer->bytes + writer->byte_count, name, size);
+    // We keep room for the offset one past the last name
+    if (writer->string_count + 1 == writer->string_capacity) {
+        writer->string_capacity *= 2;
+        writer->offsets = xrealloc(writer->offsets,
+                                   writer->string_capacity * sizeof(uint32_t));
+    }
+    writer->offsets[writer->string_count] = writer->byte_count;
+    writer->byte_count += size;
+    uint32_t index = writer->string_count++;
+    *slot = index + 1;
+    if (2 * writer->string_count > writer->slot_capacity) {
+        xfree(writer->slots);
+        writer->slot_capacity *= 2;
+        writer->slots = xmalloc(writer->slot_capacity * sizeof(uint32_t));
+        memset(writer->slots, 0, writer->slot_capacity * sizeof(uint32_t));
+        for (uint32_t i = 0; i < writer->string_count; ++i) {
+            *ast_writer_slot(writer, writer->bytes + writer->offsets[i]) =
+                i + 1;
+        }
+    }
+    return index;
+}
+
+// Copy nodes to the end of the file, returning the index of the first
+uint32_t ast_writer_push(AstWriter *writer, AstNode const *nodes,
+                         uint32_t count) {
+    if (count > UINT32_MAX - AST_CHUNK_SIZE - writer->node_count) {
+        panic("Too many syntax nodes to write out");
+    }
+    if (writer->node_count + count > writer->node_capacity) {
+        writer->node_capacity = 2 * writer->node_capacity + count;
+        writer->nodes = xrealloc(writer->nodes,
+                                 writer->node_capacity * sizeof(AstNode));
+    }
+    uint32_t start = writer->node_count;
+    memcpy(writer->nodes + start, nodes, count * sizeof(AstNode));
+    writer->node_count += count;
+    return start;
+}
+
+// Add the tree of a function, held in this thread's pool, to the file
+//
+// `hash` is the hash of the function's tokens, so that compiling from the
+// file can use the same cache entries as compiling from the source.
+void ast_writer_add(AstWriter *writer, AstNode *function, uint64_t hash) {
+    uint32_t root = ast_writer_push(writer, function, 1);
+    // The children of each node we copy get copied after all the nodes
+    // before them, so children always come after their parents
+    for (uint32_t i = root; i < writer->node_count; ++i) {
+        AstNode node = writer->nodes[i];
+        if (!ast_has_line(&node)) {
+            writer->nodes[i].line = 0;
+        }
+        if (node.kind == K_IDENTIFIER) {
+            writer->nodes[i].data.string =
+                ast_writer_intern(writer, ast_string(&node));
+        } else if (node.kind != K_NUMBER) {
+            uint32_t children = 0;
+            if (node.count > 0) {
+                children =
+                    ast_writer_push(writer, ast_children(&node), node.count);
+            }
+            writer->nodes[i].data.children = children;
+        }
+    }
+    if (writer->function_count == writer->function_capacity) {
+        writer->function_capacity = 2 * writer->function_capacity + 8;
+        writer->hashes = xrealloc(
+            writer->hashes, writer->function_capacity * sizeof(uint64_t));
+        writer->roots = xrealloc(writer->roots, writer->function_capacity *
+                                                    sizeof(uint32_t));
+    }
+    writer->hashes[writer->function_count] = hash;
+    writer->roots[writer->function_count++] = root;
+}
+
+void ast_writer_write(AstWriter *writer, FILE *out) {
+    AstFileHeader header = {.version = AST_FILE_VERSION,
+                            .function_count = writer->function_count,
+                            .node_count = writer->node_count,
+                            .string_count = writer->string_count,
+                            .string_bytes = writer->byte_count,
+                            .source_name = writer->source_name};
+    memcpy(header.magic, AST_FILE_MAGIC, sizeof(header.magic));
+    writer->offsets[writer->string_count] = writer->byte_count;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(writer->hashes, sizeof(uint64_t), writer->function_count, out);
+    fwrite(writer->nodes, sizeof(AstNode), writer->node_count, out);
+    fwrite(writer->roots, sizeof(uint32_t), writer->function_count, out);
+    fwrite(writer->offsets, sizeof(uint32_t), writer->string_count + 1, out);
+    fwrite(writer->bytes, 1, writer->byte_count, out);
+}
+
+// A file of syntax trees, mapped into memory
+typedef struct AstFile {
+    void *map;
+    size_t size;
+    uint32_t function_count;
+    uint64_t const *hashes;
+    uint32_t const *roots;
+    // Where the nodes and names added to the pool by later passes start
+    unsigned int chunk_count;
+    uint32_t string_count;
+    // The name of the program's file, if the file has it, or NULL
+    char const *source_name;
+} AstFile;
+
+bool ast_kind_is_expression(unsigned int kind) {
+    return kind == K_CALL || (kind >= K_ASSIGN && kind <= K_NUMBER);
+}
+
+bool ast_kind_is_statement(unsigned int kind) {
+    return kind >= K_BLOCK && kind <= K_SWITCH;
+}
+
+// Check that each of a range of nodes is an expression, or an identifier
+bool ast_file_all(AstNode const *nodes, uint32_t first, uint32_t count,
+                  bool identifiers) {
+    for (uint32_t i = first; i < first + count; ++i) {
+        if (identifiers ? nodes[i].kind != K_IDENTIFIER
+                        : !ast_kind_is_expression(nodes[i].kind)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that the children of a node in a file are ones our parser could have
+// given it, whose own children have been checked to be in range
+bool ast_file_node_fits(AstNode const *nodes, AstNode const *node) {
+    uint32_t count = node->count;
+    // Leaves hold their value where other nodes hold their children
+    bool leaf = node->kind == K_IDENTIFIER || node->kind == K_NUMBER;
+    uint32_t first = leaf || count == 0 ? 0 : node->data.children;
+    AstNode const *children = nodes + first;
+    switch (node->kind) {
+    case K_IDENTIFIER:
+    case K_NUMBER:
+        return count == 0;
+    case K_FUNCTION:
+        return count == 3 && children[0].kind == K_IDENTIFIER &&
+               children[1].kind == K_PARAMS &&
+               ast_file_all(nodes, children[1].data.children,
+                            children[1].count, true) &&
+               children[2].kind == K_BLOCK;
+    case K_PARAMS:
+        return ast_file_all(nodes, first, count, false);
+    case K_CALL:
+        return count == 2 && children[0].kind == K_IDENTIFIER &&
+               children[1].kind == K_PARAMS;
+    case K_BLOCK:
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!ast_kind_is_statement(children[i].kind)) {
+                return false;
+            }
+        }
+        return true;
+    case K_EXPR_STATEMENT:
+    case K_RETURN:
+        return count == 0 || (count == 1 && children[0].kind == K_TOP_EXPR);
+    case K_DECLARATION:
+        for (uint32_t i = 0; i < count; ++i) {
+            if (children[i].kind != K_INIT_DECLARATION &&
+                children[i].kind != K_NO_INIT_DECLARATION) {
+                return false;
+            }
+        }
+        return count > 0;
+    case K_INIT_DECLARATION:
+        return count == 2 && children[0].kind == K_IDENTIFIER &&
+               ast_kind_is_expression(children[1].kind);
+    case K_NO_INIT_DECLARATION:
+        return count == 1 && children[0].kind == K_IDENTIFIER;
+    case K_BREAK:
+    case K_CONTINUE:
+    case K_DEFAULT:
+        return count == 0;
+    case K_IF:
+        return (count == 2 || count == 3) &&
+               ast_kind_is_expression(children[0].kind) &&
+               ast_kind_is_statement(children[1].kind) &&
+               (count == 2 || ast_kind_is_statement(children[2].kind));
+    case K_WHILE:
+        return count == 2 && ast_kind_is_expression(children[0].kind) &&
+               ast_kind_is_statement(children[1].kind);
+    case K_SWITCH:
+        if (count == 0 || !ast_kind_is_expression(children[0].kind)) {
+            return false;
+        }
+        // Declarations have to be in a block, see parse_switch_item
+        for (uint32_t i = 1; i < count; ++i) {
+            unsigned int kind = children[i].kind;
+            if (kind != K_CASE && kind != K_DEFAULT &&
+                (!ast_kind_is_statement(kind) || kind == K_DECLARATION)) {
+                return false;
+            }
+        }
+        return true;
+    case K_CASE:
+        return count == 1 && children[0].kind == K_NUMBER;
+    case K_TOP_EXPR:
+        return count > 0 && ast_file_all(nodes, first, count, false);
+    case K_ASSIGN:
+        return count == 2 && children[0].kind == K_IDENTIFIER &&
+               ast_kind_is_expression(children[1].kind);
+    case K_LOGICAL_NOT:
+    case K_BIT_NOT:
+    case K_NEGATE:
+        return count == 1 && ast_kind_is_expression(children[0].kind);
+    case K_SELECT:
+        return count == 3 && ast_file_all(nodes, first, count, false);
+    case K_EQUALS:
+    case K_NOT_EQUALS:
+    case K_ADD:
+    case K_SUB:
+    case K_MUL:
+    case K_DIV:
+    case K_MOD:
+    case K_BIT_AND:
+    case K_BIT_OR:
+    case K_BIT_XOR:
+        return count == 2 && ast_file_all(nodes, first, count, false);
+    default:
+        // The top level is never written out, only its functions
+        return false;
+    }
+}
+
+// Check a mapped file of syntax trees, returning what's wrong with it, if
+// anything
+//
+// This makes sure that following the nodes keeps us inside the file, and
+// can't go around in circles, since children come after their parents. Each
+// node has at most one parent, and children of the kinds our parser would
+// give it, so that compiling the trees can trust their shape.
+char const *ast_file_check(void const *map, size_t size) {
+    AstFileHeader const *header = map;
+    if (size < sizeof(AstFileHeader) ||
+        memcmp(header->magic, AST_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        return "not a syntax tree file";
+    }
+    if (header->version != AST_FILE_VERSION) {
+        return "written by an incompatible version of cici";
+    }
+    uint64_t node_count = header->node_count;
+    uint64_t function_count = header->function_count;
+    uint64_t string_count = header->string_count;
+    uint64_t expected = sizeof(AstFileHeader) + 12 * node_count +
+                        12 * function_count + 4 * (string_count + 1) +
+                        header->string_bytes;
+    if (expected != size) {
+        return "truncated or corrupted";
+    }
+    if (node_count > UINT32_MAX - AST_CHUNK_SIZE) {
+        return "too many nodes";
+    }
+    if (header->source_name != UINT32_MAX &&
+        header->source_name >= string_count) {
+        return "name out of range";
+    }
+    AstNode const *nodes =
+        (AstNode const *)((uint64_t const *)(header + 1) + function_count);
+    for (uint64_t i = 0; i < node_count; ++i) {
+        AstNode const *node = nodes + i;
+        if (node->kind > K_NUMBER) {
+            return "unknown kind of node";
+        }
+        if (node->kind == K_IDENTIFIER) {
+            if (node->data.string >= string_count) {
+                return "name out of range";
+            }
+        } else if (node->kind != K_NUMBER && node->count > 0 &&
+                   (node->data.children <= i ||
+                    (uint64_t)node->data.children + node->count >
+                        node_count)) {
+            return "children out of range";
+        }
+    }
+    // With their children in range, we can look at the shape of each tree
+    bool *has_parent = xmalloc(node_count + 1);
+    memset(has_parent, 0, node_count + 1);
+    char const *problem = NULL;
+    for (uint64_t i = 0; i < node_count && problem == NULL; ++i) {
+        AstNode const *node = nodes + i;
+        if (!ast_file_node_fits(nodes, node)) {
+            problem = "malformed tree";
+        } else if (node->kind != K_IDENTIFIER && node->kind != K_NUMBER) {
+            for (uint32_t j = 0; j < node->count; ++j) {
+                if (has_parent[node->data.children + j]) {
+                    problem = "malformed tree";
+                }
+                has_parent[node->data.children + j] = true;
+            }
+        }
+    }
+    uint32_t const *roots = (uint32_t const *)(nodes + node_count);
+    for (uint64_t i = 0; i < function_count && problem == NULL; ++i) {
+        if (roots[i] >= node_count || nodes[roots[i]].kind != K_FUNCTION) {
+            problem = "function out of range";
+        } else if (has_parent[roots[i]]) {
+            problem = "malformed tree";
+        } else {
+            // Two functions can't share a root either
+            has_parent[roots[i]] = true;
+        }
+    }
+    xfree(has_parent);
+    if (problem != NULL) {
+        return problem;
+    }
+    uint32_t const *offsets = roots + function_count;
+    char const *bytes = (char const *)(offsets + string_count + 1);
+    if (offsets[string_count] != header->string_bytes) {
+        return "names out of range";
+    }
+    for (uint64_t i = 0; i < string_count; ++i) {
+        if (offsets[i] >= offsets[i + 1] ||
+            offsets[i + 1] > header->string_bytes ||
+            bytes[offsets[i + 1] - 1] != 0) {
+            return "names out of range";
+        }
+    }
+    return NULL;
+}
+
+// Map a file of syntax trees into memory, and fill a new pool with its nodes
+// and names, without copying any of them
+void ast_file_open(AstFile *file, AstPool *pool, char const *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(errors(), "Failed to open %s\n", filename);
+        panic("Failed to open the input file.");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 1) {
+        close(fd);
+        fprintf(errors(), "%s: not a syntax tree file\n", filename);
+        fail();
+    }
+    file->size = info.st_size;
+    // The mapping is private, so passes can rewrite nodes in place without
+    // touching the file, only the pages they write to getting copied
+    file->map =
+        mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED) {
+        panic("Failed to map the input file");
+    }
+    char const *error = ast_file_check(file->map, file->size);
+    if (error != NULL) {
+        munmap(file->map, file->size);
+        fprintf(errors(), "%s: %s\n", filename, error);
+        fail();
+    }
+    AstFileHeader *header = file->map;
+    file->function_count = header->function_count;
+    file->hashes = (uint64_t const *)(header + 1);
+    AstNode *nodes = (AstNode *)(file->hashes + file->function_count);
+    file->roots = (uint32_t const *)(nodes + header->node_count);
+    uint32_t const *offsets = file->roots + file->function_count;
+    char *bytes = (char *)(offsets + header->string_count + 1);
+    // The chunks point into the file, and new nodes go into chunks after them
+    file->chunk_count = (header->node_count + AST_CHUNK_MASK) >> AST_CHUNK_BITS;
+    pool->chunk_capacity = file->chunk_count;
+    pool->chunks = xmalloc(file->chunk_count * sizeof(AstChunk));
+    for (unsigned int i = 0; i < file->chunk_count; ++i) {
+        pool->chunks[i].nodes = nodes + i * AST_CHUNK_SIZE;
+        pool->chunks[i].owned = false;
+    }
+    pool->chunk_count = file->chunk_count;
+    pool->used = file->chunk_count * AST_CHUNK_SIZE;
+    file->string_count = header->string_count;
+    pool->string_capacity = file->string_count;
+    pool->strings = xmalloc(file->string_count * sizeof(char *));
+    for (uint32_t i = 0; i < file->string_count; ++i) {
+        pool->strings[i] = bytes + offsets[i];
+    }
+    pool->string_count = file->string_count;
+    pool->borrowed_strings = file->string_count;
+    file->source_name = NULL;
+    if (header->source_name != UINT32_MAX) {
+        file->source_name = pool->strings[header->source_name];
+    }
+}
+
+// Unmap a file, once the pool using it is gone
+void ast_file_close(AstFile *file) { munmap(file->map, file->size); }
+
+// Compile a file of syntax trees written by the `ast` stage to `out`, like
+// compile_source
+//
+// Each function gets optimized and compiled straight from the mapped file.
+void compile_tree_file(Options *options, char const *in_filename, FILE *out,
+                       Report *report) {
+    double start = now_seconds();
+    AstPool tree;
+    ast_pool_init(&tree);
+    AstFile file;
+    ast_file_open(&file, &tree, in_filename);
+    ast_pool = &tree;
+    report->input_bytes += file.size;
+    report_phase(report, "load", now_seconds() - start);
+    AsmState *generator = asm_init(out, options->debug_info);
+    // Files written without a name for the program can only name themselves
+    asm_begin(generator,
+              file.source_name != NULL ? file.source_name : in_filename);
+    CodeFolder code_folder;
+    CodeFolder *folder = NULL;
+    if (options->fold) {
+        folder_init(&code_folder);
+        folder = &code_folder;
+    }
+    for (uint32_t i = 0; i < file.function_count; ++i) {
+        AstNode *function = ast_node_at(file.roots[i]);
+        if (options->cache_dir != NULL || folder != NULL) {
+            char *buffer;
+            size_t size;
+            compile_function_cached(options, generator, function,
+                                    file.hashes[i], report, &buffer, &size);
+            generator->out = out;
+            fold_write(folder, out, buffer, size);
+            free(buffer);
+        } else {
+            compile_function(options, generator, function, report);
+        }
+        // Whatever the passes added is only used by this function
+        ast_pool_rewind(&tree, file.chunk_count, file.string_count);
+        fflush(out);
+    }
+    if (folder != NULL) {
+        report->functions_folded += folder->folded;
+        folder_destroy(folder);
+    }
+    asm_destroy(generator);
+    ast_pool_destroy(&tree);
+    ast_pool = NULL;
+    ast_file_close(&file);
+}
+
+// Read a whole file, ending it with a null byte, which the lexer relies on
+char *read_file(char const *filename, size_t *length) {
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) {
+        fprintf(errors(), "Failed to open %s\n", filename);
+        panic("Failed to open the input file.");
+    }
+    if (fseek(in, 0, SEEK_END)) {
+        fclose(in);
+        panic("Failed to seek to the end of the input file");
+    }
+    *length = ftell(in);
+    if (fseek(in, 0, SEEK_SET)) {
+        fclose(in);
+        panic("Failed to rewind input file");
+    }
+    char *data = xmalloc(*length + 1);
+    if (!fread(data, sizeof(char), *length, in)) {
+        fclose(in);
+        xfree(data);
+        panic("Failed to read into input buffer.");
+    }
+    data[*length] = 0;
+    fclose(in);
+    return data;
+}
+
+typedef enum CompileStage {
+    STAGE_LEX,
+    STAGE_PARSE,
+    STAGE_COMPILE,
+    // Run the program with our bytecode interpreter instead of compiling it
+    STAGE_INTERP,
+    // Write out the syntax tree of each function, to compile them later
+    STAGE_AST,
+    // Compile syntax trees written out by STAGE_AST, rather than a program
+    STAGE_COMPILE_AST
+} CompileStage;
+
+// Compile a program, held in memory and ending with a null byte, to `out`,
+// adding what we measured to the report, and returning what main returned if
+// we interpreted it, or 0 otherwise
+//
+// `jobs` is the number of threads generating code for this program, and
+// `filename` the name of the file it comes from.
+int compile_source(Options *options, int jobs, CompileStage stage,
+                   char const *filename, char const *program, FILE *out,
+                   Report *report) {
+    double start;
+    double end = now_seconds();
+    int status = 0;
+    LexState lexer = lex_init(program);
+    ParseState parser = parse_init(lexer);
+    AstPool tree;
+    ast_pool_init(&tree);
+    ast_pool = &tree;
+    // Lexing happens on demand while parsing, so we time it separately
+    parser.time_lexing = report->time;
+    // When lazy, we skim over the whole program first, and then only parse
+    // the bodies of the functions we find calls to
+    LazyParser lazy_parser;
+    LazyParser *lazy = NULL;
+    if (options->lazy && stage != STAGE_LEX && stage != STAGE_PARSE) {
+        start = now_seconds();
+        lazy_init(&lazy_parser, program, options->exports);
+        report_phase(report, "skim", now_seconds() - start);
+        lazy = &lazy_parser;
+    }
+    if (stage == STAGE_LEX && jobs > 1) {
+        int count;
+        LexChunk *chunks = lex_parallel(program, jobs, &count);
+        start = now_seconds();
+        report_phase(report, "lex", start - end);
+        for (int i = 0; i < count; ++i) {
+            report->tokens += lex_chunk_count(chunks + i);
+        }
+        lex_chunks_print(chunks, count, out);
+        report_phase(report, "print", now_seconds() - start);
+        lex_chunks_free(chunks, count);
+    } else if (stage == STAGE_LEX) {
+        for (Token t = lex_next(&lexer); t.type != T_EOF;
+             t = lex_next(&lexer)) {
+            token_print(t, out);
+        }
+        report_phase(report, "lex", now_seconds() - end);
+        report->tokens += lexer.token_count;
+    } else if (stage == STAGE_PARSE && jobs > 1) {
+        AstNode root;
+        parse_top_level_parallel(program, jobs, &root, report);
+        ast_print(&root, out);
+        report->ast_nodes += ast_size(&root);
+    } else if (stage == STAGE_PARSE) {
+        start = now_seconds();
+        AstNode root;
+        parse_top_level(&parser, &root);
+        end = now_seconds();
+        report_phase(report, "lex", parser.lex_seconds);
+        report_phase(report, "parse", end - start - parser.lex_seconds);
+        report->tokens += parser.lex_st.token_count;
+        ast_print(&root, out);
+        report->ast_nodes += ast_size(&root);
+    } else if (stage == STAGE_INTERP) {
+        // Like when compiling, we only hold one function's tree at a time
+        BcProgram program;
+        bc_program_init(&program);
+        AstNode function;
+        for (;;) {
+            start = now_seconds();
+            double lex_before = parser.lex_seconds;
+            bool more = parse_next(lazy, &parser, &function);
+            end = now_seconds();
+            double lex_seconds = parser.lex_seconds - lex_before;
+            report_phase(report, "lex", lex_seconds);
+            report_phase(report, "parse", end - start - lex_seconds);
+            if (!more) {
+                break;
+            }
+            optimize(options, &function, report);
+            report->ast_nodes += ast_size(&function);
+            start = now_seconds();
+            bc_function(&program, &function);
+            report_phase(report, "bytecode", now_seconds() - start);
+            ast_pool_reset(&tree);
+        }
+        report->tokens += parser.lex_st.token_count;
+        start = now_seconds();
+        status = bc_run(&program);
+        report_phase(report, "interp", now_seconds() - start);
+        bc_program_destroy(&program);
+    } else if (stage == STAGE_AST) {
+        AstWriter writer;
+        ast_writer_init(&writer, filename);
+        AstNode function;
+        for (;;) {
+            start = now_seconds();
+            double lex_before = parser.lex_seconds;
+            bool more = parse_next(lazy, &parser, &function);
+            end = now_seconds();
+            double lex_seconds = parser.lex_seconds - lex_before;
+            report_phase(report, "lex", lex_seconds);
+            report_phase(report, "parse", end - start - lex_seconds);
+            if (!more) {
+                break;
+            }
+            report->ast_nodes += ast_size(&function);
+            ast_writer_add(&writer, &function, parser.function_hash);
+            ast_pool_reset(&tree);
+        }
+        report->tokens += parser.lex_st.token_count;
+        start = now_seconds();
+        ast_writer_write(&writer, out);
+        report_phase(report, "write", now_seconds() - start);
+        ast_writer_destroy(&writer);
+    } else {
+        // Each function is compiled, written out, and freed before we parse
+        // the next one, so we only ever hold the syntax tree of a single
+        // function, or a few per worker when compiling on several threads.
+        // Each of these trees has its own pool, which later functions reuse.
+        AsmState *generator = asm_init(out, options->debug_info);
+        asm_begin(generator, filename);
+        // Folding needs the whole assembly of each function before writing it
+        CodeFolder code_folder;
+        CodeFolder *folder = NULL;
+        if (options->fold) {
+            folder_init(&code_folder);
+            folder = &code_folder;
+        }
+        CodegenPool pool;
+        if (jobs > 1) {
+            pool_init(&pool, options, program, out, folder, jobs,
+                      report->time);
+        }
+        AstNode function;
+        if (jobs > 1 && lazy == NULL) {
+            // The workers parse the functions themselves, once we've found
+            // where each one starts
+            start = now_seconds();
+            FunctionSpan *spans;
+            unsigned int count = scan_functions(program, &spans);
+            report_phase(report, "scan", now_seconds() - start);
+            for (unsigned int i = 0; i < count; ++i) {
+                pool_reserve(&pool);
+                pool_submit_span(&pool, spans + i);
+            }
+            spans_free(spans, count);
+        } else {
+            for (;;) {
+                start = now_seconds();
+                double lex_before = parser.lex_seconds;
+                if (jobs > 1) {
+                    ast_pool = pool_reserve(&pool);
+                }
+                bool more = parse_next(lazy, &parser, &function);
+                end = now_seconds();
+                double lex_seconds = parser.lex_seconds - lex_before;
+                report_phase(report, "lex", lex_seconds);
+                report_phase(report, "parse", end - start - lex_seconds);
+                if (!more) {
+                    break;
+                }
+                if (jobs > 1) {
+                    pool_submit(&pool, &function, parser.function_hash);
+                } else if (options->cache_dir != NULL || folder != NULL) {
+                    char *buffer;
+                    size_t size;
+                    compile_function_cached(options, generator, &function,
+                                            parser.function_hash, report,
+                                            &buffer, &size);
+                    generator->out = out;
+                    ast_pool_reset(&tree);
+                    fold_write(folder, out, buffer, size);
+                    free(buffer);
+                    fflush(out);
+                } else {
+                    compile_function(options, generator, &function, report);
+                    ast_pool_reset(&tree);
+                    fflush(out);
+                }
+            }
+        }
+        if (jobs > 1) {
+            pool_finish(&pool, report);
+        }
+        if (folder != NULL) {
+            report->functions_folded += folder->folded;
+            folder_destroy(folder);
+        }
+        asm_destroy(generator);
+        report->tokens += parser.lex_st.token_count;
+    }
+    if (lazy != NULL) {
+        lazy_destroy(lazy);
+    }
+    ast_pool_destroy(&tree);
+    ast_pool = NULL;
+    return status;
+}
+
+// Compile a file to an output that's already open, like compile_source
+//
+// The output is NULL when interpreting, since there's nothing to write.
+int compile_file_to(Options *options, int jobs, CompileStage stage,
+                    char const *in_filename, FILE *out, Report *report) {
+    double start = now_seconds();
+    size_t length;
+    char *in_data = NULL;
+    // Files of syntax trees get mapped in rather than read
+    if (stage != STAGE_COMPILE_AST) {
+        in_data = read_file(in_filename, &length);
+        report->input_bytes += length;
+    }
+    report_phase(report, "read", now_seconds() - start);
+    int status = 0;
+    if (stage == STAGE_COMPILE_AST) {
+        compile_tree_file(options, in_filename, out, report);
+    } else {
+        status = compile_source(options, jobs, stage, in_filename, in_data,
+                                out, report);
+    }
+    if (out != NULL) {
+        report_output(report, out);
+    }
+    xfree(in_data);
+    return status;
+}
+
+// Compile a file, like compile_source
+int compile_file(Options *options, int jobs, CompileStage stage,
+                 char const *in_filename, char const *out_filename,
+                 Report *report) {
+    FILE *out = NULL;
+    if (stage == STAGE_INTERP) {
+        // The program's result is our exit code, so there's nothing to write
+    } else if (strcmp(out_filename, "stdout") == 0) {
         out = stdout;
     } else {
         out = fopen(out_filename, "w");
         if (out == NULL) {
+            fprintf(errors(), "Failed to open %s\n", out_filename);
             panic("Failed to open output file");
         }
     }
-    LexState lexer = lex_init(in_data);
-    if (stage == STAGE_LEX) {
-        for (Token t = lex_next(&lexer); t.type != T_EOF;
-             t = lex_next(&lexer)) {
-            token_print(t, out);
+    int status =
+        compile_file_to(options, jobs, stage, in_filename, out, report);
+    if (out != NULL && out != stdout) {
+        fclose(out);
+    }
+    return status;
+}
+
+/** BATCH DRIVER **/
+typedef struct Batch Batch;
+
+// A thread compiling files, with the range of files it has left to compile
+typedef struct BatchWorker {
+    Batch *batch;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // The next file to take from the front, and the end of our range
+    int next;
+    int end;
+    // What this worker measured, merged into the main report at the end
+    Report report;
+} BatchWorker;
+
+// Compiles many files in one process, each to its own output
+//
+// Each worker starts with an even share of the files, and takes them from
+// the front of its range. Once it runs out, it steals files from the back of
+// the other workers' ranges, so a few large files don't hold the rest back.
+struct Batch {
+    Options *options;
+    char **inputs;
+    char **outputs;
+    int count;
+    BatchWorker *workers;
+    int worker_count;
+    // The number of files we failed to compile
+    atomic_int failed;
+};
+
+// Find the next file a worker should compile, or -1 if there are none left
+int batch_take(Batch *batch, int self) {
+    for (int i = 0; i < batch->worker_count; ++i) {
+        BatchWorker *victim = batch->workers + (self + i) % batch->worker_count;
+        int file = -1;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            file = i == 0 ? victim->next++ : --victim->end;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (file >= 0) {
+            return file;
         }
-        return 0;
     }
-    ParseState parser = parse_init(lexer);
-    AstNode *root = parse_top_level(&parser);
-    if (stage == STAGE_PARSE) {
-        ast_print(root, out);
-        return 0;
+    return -1;
+}
+
+// Compile one file of a batch, returning false if it had an error
+//
+// An error shouldn't stop the other files, so we go back here instead of
+// exiting, free whatever the file left behind, and remove its half written
+// output.
+bool batch_try_compile(Batch *batch, int file, Report *report) {
+    char const *out_filename = batch->outputs[file];
+    FILE *out = fopen(out_filename, "w");
+    if (out == NULL) {
+        fprintf(errors(), "Failed to open %s\n", out_filename);
+        return false;
+    }
+    BlockHeader blocks;
+    blocks_init(&blocks);
+    owned_blocks = &blocks;
+    jmp_buf handler;
+    error_handler = &handler;
+    if (setjmp(handler) != 0) {
+        error_handler = NULL;
+        owned_blocks = NULL;
+        ast_pool = NULL;
+        blocks_free_all(&blocks);
+        fclose(out);
+        unlink(out_filename);
+        return false;
+    }
+    compile_file_to(batch->options, 1, STAGE_COMPILE, batch->inputs[file], out,
+                    report);
+    error_handler = NULL;
+    owned_blocks = NULL;
+    blocks_release(&blocks);
+    fclose(out);
+    return true;
+}
+
+void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+    int self = worker - batch->workers;
+    for (int file = batch_take(batch, self); file >= 0;
+         file = batch_take(batch, self)) {
+        if (!batch_try_compile(batch, file, &worker->report)) {
+            fprintf(errors(), "Failed to compile %s\n", batch->inputs[file]);
+            atomic_fetch_add(&batch->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+// The output for an input: `foo.c` becomes `foo.s`, in `dir` if given
+char *batch_output_name(char const *input, char const *dir) {
+    char const *base = input;
+    if (dir != NULL) {
+        char const *slash = strrchr(input, '/');
+        base = slash == NULL ? input : slash + 1;
+    } else {
+        dir = "";
+    }
+    size_t length = strlen(base);
+    if (length >= 2 && strcmp(base + length - 2, ".c") == 0) {
+        length -= 2;
+    }
+    size_t dir_length = strlen(dir);
+    bool needs_slash = dir_length > 0 && dir[dir_length - 1] != '/';
+    size_t size = dir_length + needs_slash + length + 3;
+    char *output = xmalloc(size);
+    snprintf(output, size, "%s%s%.*s.s", dir, needs_slash ? "/" : "",
+             (int)length, base);
+    return output;
+}
+
+int batch_compare_names(void const *a, void const *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Stop before compiling anything if two inputs would share an output, e.g.
+// `a/foo.c` and `b/foo.c` with an output directory
+void batch_check_outputs(char **outputs, int count) {
+    char **sorted = xmalloc(count * sizeof(char *));
+    memcpy(sorted, outputs, count * sizeof(char *));
+    qsort(sorted, count, sizeof(char *), batch_compare_names);
+    for (int i = 1; i < count; ++i) {
+        if (strcmp(sorted[i - 1], sorted[i]) == 0) {
+            fprintf(errors(), "Several inputs would be compiled to %s\n",
+                    sorted[i]);
+            panic("Two inputs have the same output file.");
+        }
+    }
+    xfree(sorted);
+}
+
+// Compile each input to its own output, on several threads
+//
+// Returns the number of files that failed to compile.
+int batch_compile(Options *options, int jobs, char **inputs, int count,
+                  char const *dir, Report *report) {
+    Batch batch = {.options = options, .inputs = inputs, .count = count};
+    batch.outputs = xmalloc(count * sizeof(char *));
+    for (int i = 0; i < count; ++i) {
+        batch.outputs[i] = batch_output_name(inputs[i], dir);
+    }
+    batch_check_outputs(batch.outputs, count);
+    atomic_init(&batch.failed, 0);
+    batch.worker_count = jobs < count ? jobs : count;
+    batch.workers = xmalloc(batch.worker_count * sizeof(BatchWorker));
+    for (int i = 0; i < batch.worker_count; ++i) {
+        BatchWorker *worker = batch.workers + i;
+        worker->batch = &batch;
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->next = (long)count * i / batch.worker_count;
+        worker->end = (long)count * (i + 1) / batch.worker_count;
+        report_init(&worker->report);
+        worker->report.time = report->time;
+    }
+    // The first worker is this thread
+    for (int i = 1; i < batch.worker_count; ++i) {
+        BatchWorker *worker = batch.workers + i;
+        if (pthread_create(&worker->thread, NULL, batch_worker, worker)) {
+            panic("Failed to start a compilation thread");
+        }
+    }
+    batch_worker(batch.workers);
+    report_merge(report, &batch.workers[0].report);
+    for (int i = 1; i < batch.worker_count; ++i) {
+        pthread_join(batch.workers[i].thread, NULL);
+        report_merge(report, &batch.workers[i].report);
+    }
+    for (int i = 0; i < batch.worker_count; ++i) {
+        pthread_mutex_destroy(&batch.workers[i].lock);
+    }
+    for (int i = 0; i < count; ++i) {
+        xfree(batch.outputs[i]);
+    }
+    xfree(batch.outputs);
+    xfree(batch.workers);
+    return atomic_load(&batch.failed);
+}
+
+// The number of inputs we first make room for
+#define BATCH_BASE_INPUTS 8
+
+// Add the file names in a response file, separated by whitespace, to a list
+void read_response_file(char const *path, char ***list, int *count,
+                        int *capacity) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(errors(), "Failed to open %s\n", path);
+        panic("Failed to open the response file.");
+    }
+    char name[4096];
+    while (fscanf(fp, "%4095s", name) == 1) {
+        if (*count == *capacity) {
+            *capacity = *capacity == 0 ? BATCH_BASE_INPUTS : *capacity << 1;
+            *list = xrealloc(*list, *capacity * sizeof(char *));
+        }
+        (*list)[(*count)++] = xstrdup(name);
+    }
+    fclose(fp);
+}
+
+/** COMPILE SERVER **/
+// The socket we listen on when no path is given
+#define DEFAULT_SOCKET "cici.sock"
+
+// The assembly we generated for a function
+typedef struct CompiledFunction {
+    uint64_t hash;
+    char *buffer;
+    size_t size;
+} CompiledFunction;
+
+// What we remember about a file between requests
+typedef struct ServedFile {
+    // The absolute path of the file, which we own
+    char *path;
+    // Each function, in the order they appeared in the last request
+    CompiledFunction *functions;
+    unsigned int count;
+    // The functions we're building for the current request
+    CompiledFunction *next;
+    unsigned int next_count;
+} ServedFile;
+
+// The number of files we first make room for
+#define SERVER_BASE_FILES 8
+
+typedef struct Server {
+    Options *options;
+    ServedFile *files;
+    unsigned int count;
+    unsigned int capacity;
+    // The syntax tree of the function we're compiling
+    AstPool tree;
+    AsmState *generator;
+    // The program we're compiling, and where its functions are
+    char *in_data;
+    FunctionSpan *spans;
+    unsigned int span_count;
+} Server;
+
+void served_functions_free(CompiledFunction *functions, unsigned int count) {
+    for (unsigned int i = 0; i < count; ++i) {
+        free(functions[i].buffer);
+    }
+    xfree(functions);
+}
+
+ServedFile *server_file(Server *server, char const *path) {
+    for (unsigned int i = 0; i < server->count; ++i) {
+        if (strcmp(server->files[i].path, path) == 0) {
+            return server->files + i;
+        }
+    }
+    if (server->count == server->capacity) {
+        server->capacity =
+            server->capacity == 0 ? SERVER_BASE_FILES : server->capacity << 1;
+        server->files =
+            xrealloc(server->files, server->capacity * sizeof(ServedFile));
+    }
+    ServedFile *file = server->files + server->count++;
+    memset(file, 0, sizeof(ServedFile));
+    file->path = xstrdup(path);
+    return file;
+}
+
+// Take the assembly of an unchanged function from the last request, if any
+//
+// Functions usually stay in the same place, so we look there first.
+bool served_reuse(ServedFile *file, unsigned int index, uint64_t hash,
+                  CompiledFunction *function) {
+    for (unsigned int i = 0; i < file->count; ++i) {
+        CompiledFunction *old =
+            file->functions + (index + i) % file->count;
+        if (old->hash == hash && old->buffer != NULL) {
+            *function = *old;
+            old->buffer = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compile a file, only compiling the functions that changed since we last did
+//
+// This returns the number of functions we compiled, and puts the total number
+// of functions in `count`.
+unsigned int server_compile(Server *server, char const *in_filename,
+                            char const *out_filename, unsigned int *count) {
+    ServedFile *file = server_file(server, in_filename);
+    size_t length;
+    server->in_data = read_file(in_filename, &length);
+    *count = scan_functions(server->in_data, &server->spans);
+    server->span_count = *count;
+    file->next = xmalloc(*count * sizeof(CompiledFunction));
+    file->next_count = 0;
+    unsigned int compiled = 0;
+    Report report;
+    report_init(&report);
+    for (unsigned int i = 0; i < *count; ++i) {
+        CompiledFunction *function = file->next + file->next_count;
+        FunctionSpan *span = server->spans + i;
+        uint64_t hash = span->hash;
+        // The lines we describe change with spacing, unlike the tokens, so
+        // the code can only be reused if the text and where it starts didn't
+        if (server->options->debug_info) {
+            hash = hash_bytes(hash, &span->line, sizeof(int));
+            hash = hash_bytes(hash, server->in_data + span->start,
+                              span->end - span->start);
+        }
+        if (served_reuse(file, i, hash, function)) {
+            ++file->next_count;
+            continue;
+        }
+        LexState lexer = lex_init(server->in_data);
+        lex_seek(&lexer, span->start, span->line);
+        ParseState parser = parse_init(lexer);
+        AstNode node;
+        parse_next_function(&parser, &node);
+        function->hash = hash;
+        function->buffer = NULL;
+        ++file->next_count;
+        compile_function_cached(server->options, server->generator, &node,
+                                parser.function_hash, &report,
+                                &function->buffer, &function->size);
+        ast_pool_reset(&server->tree);
+        ++compiled;
+    }
+    spans_free(server->spans, server->span_count);
+    xfree(server->in_data);
+    server->spans = NULL;
+    server->span_count = 0;
+    server->in_data = NULL;
+    FILE *out = fopen(out_filename, "w");
+    if (out == NULL) {
+        fprintf(errors(), "Failed to open %s\n", out_filename);
+        panic("Failed to open output file");
+    }
+    server->generator->out = out;
+    asm_begin(server->generator, in_filename);
+    CodeFolder code_folder;
+    CodeFolder *folder = NULL;
+    if (server->options->fold) {
+        folder_init(&code_folder);
+        folder = &code_folder;
+    }
+    for (unsigned int i = 0; i < file->next_count; ++i) {
+        fold_write(folder, out, file->next[i].buffer, file->next[i].size);
+    }
+    if (folder != NULL) {
+        folder_destroy(folder);
+    }
+    fclose(out);
+    served_functions_free(file->functions, file->count);
+    file->functions = file->next;
+    file->count = file->next_count;
+    file->next = NULL;
+    file->next_count = 0;
+    return compiled;
+}
+
+// Forget what we know about a file, after an error left it half done
+void server_forget(Server *server, char const *path) {
+    ServedFile *file = server_file(server, path);
+    served_functions_free(file->functions, file->count);
+    served_functions_free(file->next, file->next_count);
+    file->functions = NULL;
+    file->count = 0;
+    file->next = NULL;
+    file->next_count = 0;
+    spans_free(server->spans, server->span_count);
+    xfree(server->in_data);
+    server->spans = NULL;
+    server->span_count = 0;
+    server->in_data = NULL;
+    ast_pool_reset(&server->tree);
+}
+
+// Read a line from a socket, without the newline, or NULL at the end
+char *socket_read_line(int fd) {
+    size_t size = 0;
+    size_t capacity = BASE_STRING_SIZE;
+    char *line = xmalloc(capacity);
+    char c;
+    for (;;) {
+        ssize_t got = read(fd, &c, 1);
+        if (got <= 0) {
+            xfree(line);
+            return NULL;
+        }
+        if (c == '\n') {
+            break;
+        }
+        if (size + 1 >= capacity) {
+            capacity <<= 1;
+            line = xrealloc(line, capacity);
+        }
+        line[size++] = c;
+    }
+    line[size] = 0;
+    return line;
+}
+
+// Compile the file of a request, returning false if that failed, with the
+// error messages in error_stream
+//
+// Only this function is live across the setjmp, so that the longjmp can't
+// clobber the locals of the function handling the request.
+bool server_try_compile(Server *server, char const *in_filename,
+                        char const *out_filename, unsigned int *count,
+                        unsigned int *compiled) {
+    jmp_buf handler;
+    error_handler = &handler;
+    if (setjmp(handler) != 0) {
+        error_handler = NULL;
+        return false;
+    }
+    *compiled = server_compile(server, in_filename, out_filename, count);
+    error_handler = NULL;
+    return true;
+}
+
+// Handle a request, which is `compile\t<input>\t<output>`, with absolute paths
+//
+// We reply with `ok\t<functions>\t<compiled>\t<milliseconds>`, or with an
+// `error` line followed by the error messages.
+void server_handle(Server *server, int client) {
+    char *request = socket_read_line(client);
+    if (request == NULL) {
+        return;
+    }
+    char *in_filename = strchr(request, '\t');
+    char *out_filename =
+        in_filename == NULL ? NULL : strchr(in_filename + 1, '\t');
+    if (strncmp(request, "compile\t", 8) != 0 || out_filename == NULL) {
+        dprintf(client, "error\nMalformed request\n");
+        xfree(request);
+        return;
+    }
+    *out_filename++ = 0;
+    ++in_filename;
+    double start = now_seconds();
+    // The client gets the error messages, rather than our output
+    char *messages;
+    size_t size;
+    error_stream = open_memstream(&messages, &size);
+    if (error_stream == NULL) {
+        panic("Failed to open a buffer for errors");
+    }
+    unsigned int count;
+    unsigned int compiled;
+    if (server_try_compile(server, in_filename, out_filename, &count,
+                           &compiled)) {
+        dprintf(client, "ok\t%u\t%u\t%.3f\n", count, compiled,
+                (now_seconds() - start) * 1e3);
+        fclose(error_stream);
+    } else {
+        server_forget(server, in_filename);
+        fclose(error_stream);
+        dprintf(client, "error\n");
+        write(client, messages, size);
+    }
+    error_stream = NULL;
+    free(messages);
+    xfree(request);
+}
+
+// The path of the socket we're listening on, to remove it when we're stopped
+char const *serve_socket_path;
+
+void serve_stop(int signal) {
+    (void)signal;
+    unlink(serve_socket_path);
+    _exit(0);
+}
+
+// Listen for compile requests on a Unix socket, until we're stopped
+//
+// Between requests, we keep the assembly of each function of each file we've
+// compiled, along with the hash of its tokens. A request only scans a file for
+// its functions, and compiles the ones whose tokens changed.
+void serve(Options *options, char const *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(path) >= sizeof(address.sun_path)) {
+        panic("Failed to create the server's socket");
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    // Clients can have us read and write any file we can, so only our own
+    // user gets to connect, which the socket's permissions decide
+    mode_t mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (bound != 0 || listen(fd, 16) != 0) {
+        fprintf(errors(), "Failed to listen on %s\n", path);
+        panic("Failed to start the server");
+    }
+    serve_socket_path = path;
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+    // Clients leaving early shouldn't stop us
+    signal(SIGPIPE, SIG_IGN);
+    Server server;
+    memset(&server, 0, sizeof(Server));
+    server.options = options;
+    ast_pool_init(&server.tree);
+    ast_pool = &server.tree;
+    server.generator = asm_init(NULL, options->debug_info);
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        server_handle(&server, client);
+        close(client);
+        fflush(stdout);
+    }
+}
+
+// Make a path absolute, since the server might be running somewhere else
+char *absolute_path(char const *path) {
+    if (path[0] == '/') {
+        return xstrdup(path);
+    }
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        panic("Failed to find the current directory");
+    }
+    size_t size = strlen(cwd) + strlen(path) + 2;
+    char *absolute = xmalloc(size);
+    snprintf(absolute, size, "%s/%s", cwd, path);
+    return absolute;
+}
+
+// Ask a server to compile a file, returning 0 if it succeeded
+int serve_request(char const *path, char const *in_filename,
+                  char const *out_filename, Report *report) {
+    if (strcmp(out_filename, "stdout") == 0) {
+        panic("The server can only compile to a file");
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(path) >= sizeof(address.sun_path)) {
+        panic("Failed to create a socket");
+    }
+    strcpy(address.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(errors(), "Failed to connect to %s\n", path);
+        panic("Is the server running? Start it with cici --serve");
+    }
+    char *in = absolute_path(in_filename);
+    char *out = absolute_path(out_filename);
+    dprintf(fd, "compile\t%s\t%s\n", in, out);
+    xfree(in);
+    xfree(out);
+    char *reply = socket_read_line(fd);
+    if (reply == NULL) {
+        close(fd);
+        panic("The server closed the connection");
+    }
+    int status = 0;
+    unsigned int count;
+    unsigned int compiled;
+    double ms;
+    if (sscanf(reply, "ok\t%u\t%u\t%lf", &count, &compiled, &ms) == 3) {
+        report_phase(report, "server", ms * 1e-3);
+        if (report->time || report->mem) {
+            fprintf(stderr, "Compiled %u of %u functions\n", compiled, count);
+        }
+    } else {
+        // The rest of the reply is what the server would have printed
+        char buffer[4096];
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, got, stdout);
+        }
+        status = -1;
+    }
+    close(fd);
+    xfree(reply);
+    return status;
+}
+
+/** LIBRARY **/
+struct CiciContext {
+    Options options;
+    // Our copies of the cache directory and the exported functions, if any
+    char *cache_dir;
+    char *exports;
+    // The blocks allocated by the current call, freed when it returns
+    BlockHeader blocks;
+    // What the last call produced, from open_memstream
+    char *output;
+    size_t output_size;
+    char *error;
+    size_t error_size;
+};
+
+// What a thread was doing before it started working for a context
+typedef struct ContextScope {
+    BlockHeader *blocks;
+    jmp_buf *handler;
+    FILE *errors;
+    AstPool *pool;
+} ContextScope;
+
+// Start a call on a context
+//
+// The errors go to the context, and the blocks we allocate belong to it, until
+// the call ends with context_exit. The caller then points error_handler at
+// its own jmp_buf, which only lives as long as the caller does.
+bool context_enter(CiciContext *ctx, ContextScope *outer) {
+    free(ctx->output);
+    free(ctx->error);
+    ctx->output = NULL;
+    ctx->output_size = 0;
+    FILE *errors = open_memstream(&ctx->error, &ctx->error_size);
+    if (errors == NULL) {
+        return false;
+    }
+    outer->blocks = owned_blocks;
+    outer->handler = error_handler;
+    outer->errors = error_stream;
+    outer->pool = ast_pool;
+    owned_blocks = &ctx->blocks;
+    error_stream = errors;
+    return true;
+}
+
+// Finish a call on a context, freeing whatever it left behind
+void context_exit(CiciContext *ctx, ContextScope *outer) {
+    fclose(error_stream);
+    blocks_free_all(&ctx->blocks);
+    owned_blocks = outer->blocks;
+    error_handler = outer->handler;
+    error_stream = outer->errors;
+    ast_pool = outer->pool;
+}
+
+// Replace a string a context owns with a copy of another, returning the copy
+char *context_copy(char **owned, char const *string) {
+    size_t size = strlen(string) + 1;
+    char *copy = malloc(size);
+    if (copy == NULL) {
+        panic("Out of memory");
+    }
+    memcpy(copy, string, size);
+    free(*owned);
+    *owned = copy;
+    return copy;
+}
+
+CiciContext *cici_new(void) {
+    CiciContext *ctx = malloc(sizeof(CiciContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    options_init(&ctx->options);
+    ctx->cache_dir = NULL;
+    ctx->exports = NULL;
+    blocks_init(&ctx->blocks);
+    ctx->output = NULL;
+    ctx->output_size = 0;
+    ctx->error = NULL;
+    ctx->error_size = 0;
+    return ctx;
+}
+
+void cici_free(CiciContext *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    free(ctx->cache_dir);
+    free(ctx->exports);
+    free(ctx->output);
+    free(ctx->error);
+    free(ctx);
+}
+
+int cici_option(CiciContext *ctx, char const *option) {
+    ContextScope outer;
+    if (!context_enter(ctx, &outer)) {
+        return -1;
+    }
+    jmp_buf handler;
+    error_handler = &handler;
+    int status;
+    if (setjmp(handler) == 0) {
+        status = options_parse(&ctx->options, option) ? 0 : -1;
+        if (status != 0) {
+            fprintf(errors(), "Unknown option %s\n", option);
+        } else if (ctx->options.cache_dir == option + 12) {
+            // The caller's string might not live as long as we do
+            ctx->options.cache_dir = context_copy(&ctx->cache_dir, option + 12);
+            cache_init(&ctx->options);
+        } else if (ctx->options.exports == option + 9) {
+            ctx->options.exports = context_copy(&ctx->exports, option + 9);
+        }
+    } else {
+        status = -1;
+    }
+    context_exit(ctx, &outer);
+    return status;
+}
+
+// Run a stage on a program for a library user, returning 0 on success
+int context_compile(CiciContext *ctx, CompileStage stage, char const *source,
+                    size_t length, int *result) {
+    ContextScope outer;
+    if (!context_enter(ctx, &outer)) {
+        return -1;
+    }
+    jmp_buf handler;
+    error_handler = &handler;
+    // This changes before we might jump back, so it can't live in a register
+    FILE *volatile out = NULL;
+    int status;
+    if (setjmp(handler) == 0) {
+        if (stage != STAGE_INTERP) {
+            out = open_memstream(&ctx->output, &ctx->output_size);
+            if (out == NULL) {
+                panic("Failed to open a buffer for the output");
+            }
+        }
+        // The lexer relies on the program ending with a null byte
+        char *program = xmalloc(length + 1);
+        memcpy(program, source, length);
+        program[length] = 0;
+        Report report;
+        report_init(&report);
+        int value = compile_source(&ctx->options, 1, stage, "<input>",
+                                   program, out, &report);
+        if (result != NULL) {
+            *result = value;
+        }
+        status = 0;
+    } else {
+        status = -1;
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    if (status != 0) {
+        free(ctx->output);
+        ctx->output = NULL;
+        ctx->output_size = 0;
+    }
+    context_exit(ctx, &outer);
+    return status;
+}
+
+int cici_compile(CiciContext *ctx, char const *source, size_t length) {
+    return context_compile(ctx, STAGE_COMPILE, source, length, NULL);
+}
+
+int cici_run(CiciContext *ctx, char const *source, size_t length,
+             int *result) {
+    return context_compile(ctx, STAGE_INTERP, source, length, result);
+}
+
+char const *cici_output(CiciContext *ctx, size_t *size) {
+    if (size != NULL) {
+        *size = ctx->output_size;
+    }
+    return ctx->output == NULL ? "" : ctx->output;
+}
+
+char const *cici_error(CiciContext *ctx) {
+    return ctx->error == NULL ? "" : ctx->error;
+}
+
+#ifndef CICI_LIBRARY
+int main(int argc, char **argv) {
+    Options options;
+    options_init(&options);
+    Report report;
+    report_init(&report);
+    // The number of threads generating code, or compiling files in a batch
+    int jobs = 1;
+    // Whether every positional argument is an input to compile on its own
+    bool batch = false;
+    // Where to put the outputs of a batch, next to the inputs by default
+    char *output_dir = NULL;
+    // The socket to serve compile requests on, or of the server to ask
+    char const *serve_path = NULL;
+    char const *connect_path = NULL;
+    // Options can appear anywhere, the remaining arguments are positional
+    char **positional = NULL;
+    int positional_count = 0;
+    int positional_capacity = 0;
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        if (arg[0] == '@' && arg[1] != 0) {
+            read_response_file(arg + 1, &positional, &positional_count,
+                               &positional_capacity);
+        } else if (arg[0] != '-' || arg[1] == 0) {
+            if (positional_count == positional_capacity) {
+                positional_capacity = positional_capacity == 0
+                                          ? BATCH_BASE_INPUTS
+                                          : positional_capacity << 1;
+                positional = xrealloc(positional,
+                                      positional_capacity * sizeof(char *));
+            }
+            positional[positional_count++] = arg;
+        } else if (options_parse(&options, arg)) {
+            // Options controlling how we compile are shared with the library
+        } else if (strcmp(arg, "-j") == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = cpus > 0 ? cpus : 1;
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            jobs = atoi(arg + 2);
+            if (jobs < 1) {
+                panic("The number of jobs must be at least 1");
+            }
+        } else if (strcmp(arg, "--serve") == 0) {
+            serve_path = DEFAULT_SOCKET;
+        } else if (strncmp(arg, "--serve=", 8) == 0) {
+            serve_path = arg + 8;
+        } else if (strcmp(arg, "--connect") == 0) {
+            connect_path = DEFAULT_SOCKET;
+        } else if (strncmp(arg, "--connect=", 10) == 0) {
+            connect_path = arg + 10;
+        } else if (strcmp(arg, "--batch") == 0) {
+            batch = true;
+        } else if (strncmp(arg, "--output-dir=", 13) == 0) {
+            output_dir = arg + 13;
+        } else if (strcmp(arg, "--time-report") == 0) {
+            report.time = true;
+        } else if (strcmp(arg, "--mem-report") == 0) {
+            report.mem = true;
+        } else if (strcmp(arg, "--report-format=json") == 0) {
+            report.json = true;
+        } else if (strcmp(arg, "--report-format=table") == 0) {
+            report.json = false;
+        } else {
+            printf("Unknown option %s\n", arg);
+            panic("Usage: cici [options] <input> [output] [stage]\n"
+                  "       cici [options] --batch <inputs or @file>...\n"
+                  "       cici [options] --serve[=socket]\n"
+                  "       cici [options] --connect[=socket] <input> [output]");
+        }
+    }
+    cache_init(&options);
+    if (serve_path != NULL) {
+        serve(&options, serve_path);
+    }
+    if (positional_count < 1) {
+        panic("Must have a file to compile as an argument.");
+    }
+    if (connect_path != NULL) {
+        char *out_filename = positional_count > 1 ? positional[1] : "a.s";
+        int status =
+            serve_request(connect_path, positional[0], out_filename, &report);
+        report_print(&report);
+        return status;
+    }
+    if (batch) {
+        int failed = batch_compile(&options, jobs, positional,
+                                   positional_count, output_dir, &report);
+        report_print(&report);
+        return failed == 0 ? 0 : -1;
+    }
+    char *in_filename = positional[0];
+    char *out_filename = positional_count > 1 ? positional[1] : "a.s";
+    CompileStage stage = STAGE_COMPILE;
+    if (positional_count > 2) {
+        char *stage_str = positional[2];
+        if (strcmp(stage_str, "lex") == 0) {
+            stage = STAGE_LEX;
+        } else if (strcmp(stage_str, "parse") == 0) {
+            stage = STAGE_PARSE;
+        } else if (strcmp(stage_str, "compile") == 0) {
+            stage = STAGE_COMPILE;
+        } else if (strcmp(stage_str, "interp") == 0) {
+            stage = STAGE_INTERP;
+        } else if (strcmp(stage_str, "ast") == 0) {
+            stage = STAGE_AST;
+        } else if (strcmp(stage_str, "compile-ast") == 0) {
+            stage = STAGE_COMPILE_AST;
+        }
     }
-    AsmState *generator = asm_init(out);
-    asm_gen(generator, root);
-    return 0;
+    int status = compile_file(&options, jobs, stage, in_filename,
+                              out_filename, &report);
+    report_print(&report);
+    return status;
 }
+#endif
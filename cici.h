@@ -0,0 +1,37 @@
+#ifndef CICI_H
+#define CICI_H
+
+#include "stddef.h"
+
+// A compiler, which compiles programs held in memory, and owns everything it
+// allocates while doing so
+//
+// A context can only be used by one thread at a time, but different threads
+// can each use their own context at the same time. Errors don't stop the
+// process: the function that failed returns -1, and cici_error tells why.
+typedef struct CiciContext CiciContext;
+
+CiciContext *cici_new(void);
+
+// Free a context, along with its output and error messages
+void cici_free(CiciContext *ctx);
+
+// Apply an option controlling how we compile, like `-O0`, `-funroll=N` or
+// `--cache-dir=DIR`, returning -1 if it's not one
+int cici_option(CiciContext *ctx, char const *option);
+
+// Compile `length` bytes of source code to assembly, returning 0 on success
+int cici_compile(CiciContext *ctx, char const *source, size_t length);
+
+// Run the main function of a program with the interpreter, putting what it
+// returned in `result`, and returning 0 on success
+int cici_run(CiciContext *ctx, char const *source, size_t length, int *result);
+
+// The assembly from the last successful compilation, and its size, which stay
+// valid until the context is used again
+char const *cici_output(CiciContext *ctx, size_t *size);
+
+// The error messages from the last call that failed, or an empty string
+char const *cici_error(CiciContext *ctx);
+
+#endif
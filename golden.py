@@ -1,9 +1,17 @@
 #!/usr/bin/python
+import argparse
+import json
 import os
-from subprocess import PIPE, run
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+from subprocess import PIPE, STDOUT, run
 
 C_EXTENSION = ".c"
 TEST_DIR = "tests"
+CICI = os.path.abspath("cici")
+BASELINE = os.path.join(TEST_DIR, "timings.json")
 
 
 def get_c_files(path):
@@ -40,21 +48,31 @@ def get_expected_return(file):
     return None
 
 
-def test_lex(file):
-    expected = join_split(get_expected("LEX", file))
-    command = ["./cici", file, "stdout", "lex"]
-    result = run(command, stdout=PIPE, universal_newlines=True)
-    if result.returncode != 0:
-        return ("error", expected, result.stdout)
-    result = join_split(result.stdout)
-    code = "passed" if result == expected else "failed"
-    return (code, expected, result)
+# Each `//ASM` line holds a line the generated assembly has to contain
+def get_expected_asm(file):
+    with open(file, "r") as fp:
+        return [join_split(line[len("//ASM"):]) for line in fp
+                if line.startswith("//ASM")]
+
+
+def get_flags(file):
+    with open(file, "r") as fp:
+        for line in fp:
+            if line.startswith("//FLAGS"):
+                return line.split()[1:]
+    return []
 
 
-def test_ast(file):
-    expected = join_split(get_expected("AST", file))
-    command = ["./cici", file, "stdout", "parse"]
-    result = run(command, stdout=PIPE, universal_newlines=True)
+def timed_run(command, timings, key, **kwargs):
+    start = time.perf_counter()
+    result = run(command, stdout=PIPE, universal_newlines=True, **kwargs)
+    timings[key] = time.perf_counter() - start
+    return result
+
+
+def test_output(stage, name, file, timings):
+    expected = join_split(get_expected(name, file))
+    result = timed_run([CICI, file, "stdout", stage], timings, "compile")
     if result.returncode != 0:
         return ("error", expected, result.stdout)
     result = join_split(result.stdout)
@@ -62,23 +80,84 @@ def test_ast(file):
     return (code, expected, result)
 
 
-def test_ret(file):
-    expected = get_expected_return(file)
-    comp = run(["./cici", file, file + ".s", "compile"],
-               stdout=PIPE, universal_newlines=True)
-    if comp.returncode != 0:
-        return ("error", expected, comp.stdout)
-    build_asm = run(["gcc", file + ".s"], stdout=PIPE, universal_newlines=True)
+def test_lex(file, timings):
+    return test_output("lex", "LEX", file, timings)
+
+
+def test_ast(file, timings):
+    return test_output("parse", "AST", file, timings)
+
+
+def assemble_and_run(directory, asm, expected, timings, file):
+    wanted = get_expected_asm(file)
+    if wanted:
+        # The lines have to come in this order, though not one after another,
+        # so that a test can check lines between `name:` and `.size name`
+        with open(asm, "r") as fp:
+            lines = (join_split(line) for line in fp)
+            missing = [line for line in wanted if line not in lines]
+        if missing:
+            return ("failed", wanted, f"assembly without {missing}, in order")
+    binary = os.path.join(directory, "a.out")
+    build_asm = timed_run(["gcc", asm, "-o", binary], timings, "assemble",
+                          stderr=STDOUT)
     if build_asm.returncode != 0:
         return ("error", expected, build_asm.stdout)
-    result = run(["./a.out"]).returncode
-    code = "failed"
-    if result == expected:
-        os.remove(file + ".s")
-        code = "passed"
+    result = timed_run([binary], timings, "execute").returncode
+    code = "passed" if result == expected else "failed"
     return (code, expected, result)
 
 
+# Each run test gets its own directory, so that tests can run concurrently
+# without fighting over a.out.
+def test_ret(file, timings):
+    expected = get_expected_return(file)
+    with tempfile.TemporaryDirectory(prefix="cici-") as directory:
+        asm = os.path.join(directory, "out.s")
+        comp = timed_run([CICI, *get_flags(file), file, asm, "compile"],
+                         timings, "compile")
+        if comp.returncode != 0:
+            return ("error", expected, comp.stdout)
+        return assemble_and_run(directory, asm, expected, timings, file)
+
+
+# Write the syntax trees out, and compile them back from that file
+def test_tree(file, timings):
+    expected = get_expected_return(file)
+    flags = get_flags(file)
+    with tempfile.TemporaryDirectory(prefix="cici-") as directory:
+        tree = os.path.join(directory, "out.ast")
+        asm = os.path.join(directory, "out.s")
+        write = timed_run([CICI, *flags, file, tree, "ast"], timings, "ast")
+        if write.returncode != 0:
+            return ("error", expected, write.stdout)
+        comp = timed_run([CICI, *flags, tree, asm, "compile-ast"], timings,
+                         "compile-ast")
+        if comp.returncode != 0:
+            return ("error", expected, comp.stdout)
+        return assemble_and_run(directory, asm, expected, timings, file)
+
+
+# The interpreter's exit code is what main returned, like the compiled binary
+def test_interp(file, timings):
+    expected = get_expected_return(file)
+    result = timed_run([CICI, *get_flags(file), file, "stdout", "interp"],
+                       timings, "interp")
+    code = "passed" if result.returncode == expected else "failed"
+    return (code, expected, result.returncode)
+
+
+STAGES = [("lex", "lex output", test_lex), ("parse", "parse output", test_ast),
+          ("run", "run output", test_ret),
+          ("interp", "interpreter output", test_interp),
+          ("tree", "syntax tree file output", test_tree)]
+
+
+def run_test(test, file):
+    timings = {}
+    return (test(file, timings), timings)
+
+
 def print_result(file, res):
     (code, expected, result) = res
     if code == "passed":
@@ -96,28 +175,103 @@ def print_result(file, res):
     return code == "passed"
 
 
+def load_baseline(path):
+    try:
+        with open(path, "r") as fp:
+            return json.load(fp)
+    except FileNotFoundError:
+        return {}
+
+
+# A timing regresses when it is slower than the baseline by more than the
+# threshold ratio, and by more than the minimum delta, since a few
+# milliseconds of noise on a tiny test would otherwise be flagged constantly.
+def find_regressions(timings, baseline, threshold, min_delta):
+    regressions = []
+    for test, measured in sorted(timings.items()):
+        for key, seconds in sorted(measured.items()):
+            before = baseline.get(test, {}).get(key)
+            if before is None:
+                continue
+            if seconds > before * threshold and seconds - before > min_delta:
+                regressions.append((test, key, before, seconds))
+    return regressions
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Run the golden tests.")
+    parser.add_argument("-j", "--jobs", type=int, default=os.cpu_count(),
+                        help="number of tests to run at once")
+    parser.add_argument("--baseline", default=BASELINE,
+                        help="file holding the timings to compare against")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="record the timings of this run as the baseline")
+    parser.add_argument("--threshold", type=float, default=1.5,
+                        help="slowdown ratio over the baseline to flag")
+    parser.add_argument("--min-delta", type=float, default=0.010,
+                        help="smallest slowdown to flag, in seconds")
+    parser.add_argument("--strict", action="store_true",
+                        help="fail when a timing regresses")
+    parser.add_argument("--times", action="store_true",
+                        help="print the timings of every test")
+    return parser.parse_args()
+
+
 def main():
+    args = parse_args()
     print("Building compiler...\n")
     make_res = run(["make"], stdout=PIPE, universal_newlines=True)
     if make_res.returncode != 0:
-        return
-    print("Testing lex output...\n")
+        print(make_res.stdout)
+        return 1
     c_files = sorted(list(get_c_files(TEST_DIR)))
-    for file in c_files:
-        res = test_lex(file)
-        if not print_result(file, res):
-            return
-    print("\nTesting parse output...\n")
-    for file in c_files:
-        res = test_ast(file)
-        if not print_result(file, res):
-            return
-    print("\nTesting run output...\n")
-    for file in c_files:
-        res = test_ret(file)
-        if not print_result(file, res):
-            return
+    with ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        futures = [(stage, description, file, pool.submit(run_test, test, file))
+                   for (stage, description, test) in STAGES
+                   for file in c_files]
+        failures = []
+        timings = {}
+        last_description = None
+        for (stage, description, file, future) in futures:
+            if description != last_description:
+                if last_description is not None:
+                    print()
+                print(f"Testing {description}...\n")
+                last_description = description
+            (res, measured) = future.result()
+            if not print_result(file, res):
+                failures.append(f"{stage} {file}")
+            timings[f"{stage} {file}"] = measured
+    if args.times:
+        print("\nTimings (ms):\n")
+        for test, measured in sorted(timings.items()):
+            columns = ", ".join(f"{key} {seconds * 1e3:.1f}"
+                                for key, seconds in measured.items())
+            print(f"  {test}: {columns}")
+    baseline = load_baseline(args.baseline)
+    regressions = find_regressions(timings, baseline, args.threshold,
+                                   args.min_delta)
+    if regressions:
+        print(f"\n\033[33m\033[1m{len(regressions)} timing regressions:"
+              "\033[0m")
+        for (test, key, before, seconds) in regressions:
+            print(f"  {test} {key}: {before * 1e3:.1f} ms -> "
+                  f"{seconds * 1e3:.1f} ms")
+    if args.update_baseline:
+        with open(args.baseline, "w") as fp:
+            json.dump(timings, fp, indent=2, sort_keys=True)
+            fp.write("\n")
+    total = len(futures)
+    print(f"\n{total - len(failures)}/{total} tests passed")
+    if failures:
+        print("\033[31m\033[1mFailures:\033[0m")
+        for failure in failures:
+            print(" ", failure)
+        return 1
+    if regressions and args.strict:
+        return 1
+    return 0
 
 
 if __name__ == "__main__":
-    main()
+    sys.exit(main())
@@ -0,0 +1,57 @@
+/*LEX
+int main ( ) {
+    int i = 0 , sum = 0 , n = 0 , steps = 0 , k = 5 , end = 20 ;
+    while ( i != 7 ) {
+        sum = sum + i * 3 ;
+        i = i + 1 ;
+    }
+    while ( end != n ) {
+        steps = steps + 3 ;
+        n = n + 1 ;
+        k = k - 1 ;
+    }
+    while ( k != 0 ) k = k + 1 ;
+    return sum + steps + k ;
+}
+*/
+/*AST
+(top-level
+(function main (params) (block
+    (declaration (declare i 0) (declare sum 0) (declare n 0) (declare steps 0)
+                 (declare k 5) (declare end 20))
+    (while (!= i 7) (block
+        (expr-statement (top-expr (= sum (+ sum (* i 3)))))
+        (expr-statement (top-expr (= i (+ i 1))))))
+    (while (!= end n) (block
+        (expr-statement (top-expr (= steps (+ steps 3))))
+        (expr-statement (top-expr (= n (+ n 1))))
+        (expr-statement (top-expr (= k (- k 1))))))
+    (while (!= k 0) (expr-statement (top-expr (= k (+ k 1)))))
+    (return (top-expr (+ (+ sum steps) k))))))
+*/
+//RET 123
+//ASM imul eax, eax, 3
+//ASM .main.0:
+//ASM add eax, 3
+//ASM jmp .main.0
+//ASM .main.1:
+//ASM imul eax, eax, 3
+//ASM imul eax, eax, -1
+//ASM mov DWORD PTR [rbp - 12], eax
+//ASM mov eax, 0
+//ASM mov DWORD PTR [rbp - 20], eax
+//ASM ret
+int main() {
+    int i = 0, sum = 0, n = 0, steps = 0, k = 5, end = 20;
+    while (i != 7) {
+        sum = sum + i * 3;
+        i = i + 1;
+    }
+    while (end != n) {
+        steps = steps + 3;
+        n = n + 1;
+        k = k - 1;
+    }
+    while (k != 0) k = k + 1;
+    return sum + steps + k;
+}
@@ -0,0 +1,70 @@
+/*LEX
+int pick ( int c , int a , int b ) {
+    int x ;
+    if ( c ) x = a ; else x = b ;
+    return x ;
+}
+int flag ( int c ) {
+    int x = 7 ;
+    if ( c == 3 ) {
+        x = 1 ;
+    } else {
+        x = 0 ;
+    }
+    return x ;
+}
+int main ( ) {
+    int y = 5 , z = 2 , w = 0 ;
+    if ( y == 5 ) z = z + 8 ;
+    if ( y != 5 ) w = 3 ; else w = 9 - z / y ;
+    if ( z ) w = w + y / z ;
+    return pick ( 0 , 1 , 2 ) + pick ( 4 , 10 , 20 ) + flag ( 3 ) + flag ( 2 ) + z + w ;
+}
+*/
+/*AST
+(top-level
+(function pick (params c a b) (block
+    (declaration (declare x))
+    (if c (expr-statement (top-expr (= x a))) (expr-statement (top-expr (= x b))))
+    (return (top-expr x))))
+(function flag (params c) (block
+    (declaration (declare x 7))
+    (if (== c 3)
+        (block (expr-statement (top-expr (= x 1))))
+        (block (expr-statement (top-expr (= x 0)))))
+    (return (top-expr x))))
+(function main (params) (block
+    (declaration (declare y 5) (declare z 2) (declare w 0))
+    (if (== y 5) (expr-statement (top-expr (= z (+ z 8)))))
+    (if (!= y 5)
+        (expr-statement (top-expr (= w 3)))
+        (expr-statement (top-expr (= w (- 9 (/ z y))))))
+    (if z (expr-statement (top-expr (= w (+ w (/ y z))))))
+    (return (top-expr (+ (+ (+ (+ (+ (call pick (params 0 1 2))
+        (call pick (params 4 10 20))) (call flag (params 3)))
+        (call flag (params 2))) z) w))))))
+*/
+//RET 30
+int pick(int c, int a, int b) {
+    int x;
+    if (c) x = a; else x = b;
+    return x;
+}
+
+int flag(int c) {
+    int x = 7;
+    if (c == 3) {
+        x = 1;
+    } else {
+        x = 0;
+    }
+    return x;
+}
+
+int main() {
+    int y = 5, z = 2, w = 0;
+    if (y == 5) z = z + 8;
+    if (y != 5) w = 3; else w = 9 - z / y;
+    if (z) w = w + y / z;
+    return pick(0, 1, 2) + pick(4, 10, 20) + flag(3) + flag(2) + z + w;
+}
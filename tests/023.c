@@ -0,0 +1,60 @@
+/*LEX
+int main ( ) {
+    int i = 0 , total = 0 , j ;
+    while ( 1 ) {
+        if ( i == 10 ) break ;
+        total = total + i ;
+        i = i + 1 ;
+    }
+    j = 100 ;
+    while ( j != 0 ) {
+        int half = j / 2 ;
+        if ( half == 25 ) total = total + 7 ;
+        while ( half != 0 ) {
+            half = half - 1 ;
+            total = total + 1 ;
+        }
+        j = j - 2 ;
+    }
+    return total % 256 ;
+}
+*/
+/*AST
+(top-level
+(function main (params) (block
+    (declaration (declare i 0) (declare total 0) (declare j))
+    (while 1 (block
+        (if (== i 10) (break))
+        (expr-statement (top-expr (= total (+ total i))))
+        (expr-statement (top-expr (= i (+ i 1))))))
+    (expr-statement (top-expr (= j 100)))
+    (while (!= j 0) (block
+        (declaration (declare half (/ j 2)))
+        (if (== half 25) (expr-statement (top-expr (= total (+ total 7)))))
+        (while (!= half 0) (block
+            (expr-statement (top-expr (= half (- half 1))))
+            (expr-statement (top-expr (= total (+ total 1))))))
+        (expr-statement (top-expr (= j (- j 2))))))
+    (return (top-expr (% total 256))))))
+*/
+//RET 47
+//FLAGS -funroll=3
+int main() {
+    int i = 0, total = 0, j;
+    while (1) {
+        if (i == 10) break;
+        total = total + i;
+        i = i + 1;
+    }
+    j = 100;
+    while (j != 0) {
+        int half = j / 2;
+        if (half == 25) total = total + 7;
+        while (half != 0) {
+            half = half - 1;
+            total = total + 1;
+        }
+        j = j - 2;
+    }
+    return total % 256;
+}
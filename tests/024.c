@@ -0,0 +1,41 @@
+/*LEX
+int bump ( int x ) {
+    return x + 1 ;
+}
+int main ( ) {
+    int x = 0 , y = 0 , z = 0 , i = 0 ;
+    ( x = 4 ) + ( y = 5 ) * 2 ;
+    - ( z = bump ( z ) ) , 1 , ~ y ;
+    while ( ! ( i == 6 ) ) i = bump ( i ) ;
+    if ( ! z ) return 100 ;
+    if ( - 1 == 0 - 1 ) x = x + 10 ;
+    return x + y + z + i ;
+}
+*/
+/*AST
+(top-level
+(function bump (params x) (block (return (top-expr (+ x 1)))))
+(function main (params) (block
+    (declaration (declare x 0) (declare y 0) (declare z 0) (declare i 0))
+    (expr-statement (top-expr (+ (= x 4) (* (= y 5) 2))))
+    (expr-statement (top-expr (- (= z (call bump (params z)))) 1 (~ y)))
+    (while (! (== i 6))
+        (expr-statement (top-expr (= i (call bump (params i))))))
+    (if (! z) (return (top-expr 100)))
+    (if (== (- 1) (- 0 1)) (expr-statement (top-expr (= x (+ x 10)))))
+    (return (top-expr (+ (+ (+ x y) z) i))))))
+*/
+//RET 26
+int bump(int x) {
+    return x + 1;
+}
+
+int main() {
+    int x = 0, y = 0, z = 0, i = 0;
+    (x = 4) + (y = 5) * 2;
+    -(z = bump(z)), 1, ~y;
+    while (!(i == 6)) i = bump(i);
+    if (!z) return 100;
+    if (-1 == 0 - 1) x = x + 10;
+    return x + y + z + i;
+}
@@ -0,0 +1,40 @@
+/*LEX
+int sub ( int a , int b ) {
+    return a - b ;
+}
+int main ( ) {
+    int a = 7 , b = 3 , c ;
+    c = 100 - a * b ;
+    c = c / b + c % 5 - 2 * ( a ^ b ) ;
+    c = sub ( sub ( c , 1 ) , sub ( a , b ) ) + 90 / ( b + 2 ) + ( a & 6 | 1 ) ;
+    if ( c != 0 - 5 ) c = c + ( 1 == a - 6 ) * 3 ;
+    return c ;
+}
+*/
+/*AST
+(top-level
+(function sub (params a b) (block (return (top-expr (- a b)))))
+(function main (params) (block
+    (declaration (declare a 7) (declare b 3) (declare c))
+    (expr-statement (top-expr (= c (- 100 (* a b)))))
+    (expr-statement (top-expr (= c (- (+ (/ c b) (% c 5)) (* 2 (^ a b))))))
+    (expr-statement (top-expr (= c (+ (+ (call sub (params
+        (call sub (params c 1)) (call sub (params a b))))
+        (/ 90 (+ b 2))) (| (& a 6) 1)))))
+    (if (!= c (- 0 5)) (expr-statement (top-expr
+        (= c (+ c (* (== 1 (- a 6)) 3))))))
+    (return (top-expr c)))))
+*/
+//RET 45
+int sub(int a, int b) {
+    return a - b;
+}
+
+int main() {
+    int a = 7, b = 3, c;
+    c = 100 - a * b;
+    c = c / b + c % 5 - 2 * (a ^ b);
+    c = sub(sub(c, 1), sub(a, b)) + 90 / (b + 2) + (a & 6 | 1);
+    if (c != 0 - 5) c = c + (1 == a - 6) * 3;
+    return c;
+}
@@ -0,0 +1,67 @@
+/*LEX
+int one ( ) { return 1 ; }
+int twice ( int x ) { return x + x ; }
+int square ( int x ) { return x * x ; }
+int add ( int a , int b ) { return a + b ; }
+int count ( int n ) {
+    int total = 0 ;
+    while ( n != 0 ) {
+        total = total + n ;
+        n = n - 1 ;
+    }
+    return total ;
+}
+int pick ( int c , int a , int b ) {
+    if ( c ) return a ;
+    return b ;
+}
+int main ( ) {
+    int a = twice ( square ( 3 ) ) ;
+    int b = add ( count ( 10 ) , one ( ) ) ;
+    return pick ( a != 18 , 0 , a + b ) ;
+}
+*/
+/*AST
+(top-level
+(function one (params) (block (return (top-expr 1))))
+(function twice (params x) (block (return (top-expr (+ x x)))))
+(function square (params x) (block (return (top-expr (* x x)))))
+(function add (params a b) (block (return (top-expr (+ a b)))))
+(function count (params n) (block
+    (declaration (declare total 0))
+    (while (!= n 0) (block
+        (expr-statement (top-expr (= total (+ total n))))
+        (expr-statement (top-expr (= n (- n 1))))))
+    (return (top-expr total))))
+(function pick (params c a b) (block
+    (if c (return (top-expr a)))
+    (return (top-expr b))))
+(function main (params) (block
+    (declaration (declare a (call twice (params (call square (params 3))))))
+    (declaration (declare b (call add (params
+        (call count (params 10)) (call one (params))))))
+    (return (top-expr (call pick (params (!= a 18) 0 (+ a b))))))))
+*/
+//RET 74
+//FLAGS -j4
+int one() { return 1; }
+int twice(int x) { return x + x; }
+int square(int x) { return x * x; }
+int add(int a, int b) { return a + b; }
+int count(int n) {
+    int total = 0;
+    while (n != 0) {
+        total = total + n;
+        n = n - 1;
+    }
+    return total;
+}
+int pick(int c, int a, int b) {
+    if (c) return a;
+    return b;
+}
+int main() {
+    int a = twice(square(3));
+    int b = add(count(10), one());
+    return pick(a != 18, 0, a + b);
+}
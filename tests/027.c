@@ -0,0 +1,40 @@
+/*LEX
+int unused ( int x ) { return missing ( x ) + 1 ; }
+int fib ( int n ) {
+    if ( n == 0 ) return 0 ;
+    if ( n == 1 ) return 1 ;
+    return fib ( n - 1 ) + fib ( n - 2 ) ;
+}
+int spare ( ) { return unused ( 2 ) ; }
+int main ( ) { return fib ( helper ( 3 ) ) + 3 ; }
+int helper ( int x ) { return x * 3 ; }
+*/
+/*AST
+(top-level
+(function unused (params x) (block
+    (return (top-expr (+ (call missing (params x)) 1)))))
+(function fib (params n) (block
+    (if (== n 0) (return (top-expr 0)))
+    (if (== n 1) (return (top-expr 1)))
+    (return (top-expr (+ (call fib (params (- n 1)))
+        (call fib (params (- n 2))))))))
+(function spare (params) (block
+    (return (top-expr (call unused (params 2))))))
+(function main (params) (block
+    (return (top-expr (+ (call fib (params (call helper (params 3)))) 3)))))
+(function helper (params x) (block
+    (return (top-expr (* x 3))))))
+*/
+//RET 37
+//FLAGS -flazy
+// Neither unused nor spare is reachable from main, so we never compile the
+// call to missing, which isn't defined anywhere
+int unused(int x) { return missing(x) + 1; }
+int fib(int n) {
+    if (n == 0) return 0;
+    if (n == 1) return 1;
+    return fib(n - 1) + fib(n - 2);
+}
+int spare() { return unused(2); }
+int main() { return fib(helper(3)) + 3; }
+int helper(int x) { return x * 3; }
@@ -0,0 +1,45 @@
+/*LEX
+int twice ( int x ) { return x + x ; }
+int doubled ( int y ) { return y + y ; }
+int fa ( int n ) {
+    if ( n == 0 ) return 1 ;
+    return n * fa ( n - 1 ) ;
+}
+int fb ( int m ) {
+    if ( m == 0 ) return 1 ;
+    return m * fb ( m - 1 ) ;
+}
+int main ( ) { return twice ( 3 ) + doubled ( 4 ) + fa ( 3 ) + fb ( 4 ) ; }
+*/
+/*AST
+(top-level
+(function twice (params x) (block (return (top-expr (+ x x)))))
+(function doubled (params y) (block (return (top-expr (+ y y)))))
+(function fa (params n) (block
+    (if (== n 0) (return (top-expr 1)))
+    (return (top-expr (* n (call fa (params (- n 1))))))))
+(function fb (params m) (block
+    (if (== m 0) (return (top-expr 1)))
+    (return (top-expr (* m (call fb (params (- m 1))))))))
+(function main (params) (block
+    (return (top-expr (+ (+ (+ (call twice (params 3))
+        (call doubled (params 4))) (call fa (params 3)))
+        (call fb (params 4))))))))
+*/
+//RET 44
+//FLAGS -ficf
+//ASM .set doubled, twice
+//ASM .set fb, fa
+// doubled has the same code as twice, and fb as fa, once we look past their
+// names, so they become aliases
+int twice(int x) { return x + x; }
+int doubled(int y) { return y + y; }
+int fa(int n) {
+    if (n == 0) return 1;
+    return n * fa(n - 1);
+}
+int fb(int m) {
+    if (m == 0) return 1;
+    return m * fb(m - 1);
+}
+int main() { return twice(3) + doubled(4) + fa(3) + fb(4); }
@@ -0,0 +1,78 @@
+/*LEX
+int sum ( int n ) {
+    int total = 0 ;
+    int i = 0 ;
+    while ( i != n ) {
+        total = total + i ;
+        i = i + 1 ;
+    }
+    return total ;
+}
+int pick ( int x ) {
+    if ( x == 0 ) {
+        return 1 ;
+    }
+    if ( x == 1 ) return 10 ;
+    return sum ( x ) ;
+}
+int main ( ) {
+    return pick ( 0 ) + pick ( 1 ) + pick ( 7 )
+        + 14 ;
+}
+*/
+/*AST
+(top-level
+(function sum (params n) (block
+    (declaration (declare total 0))
+    (declaration (declare i 0))
+    (while (!= i n) (block
+        (expr-statement (top-expr (= total (+ total i))))
+        (expr-statement (top-expr (= i (+ i 1))))))
+    (return (top-expr total))))
+(function pick (params x) (block
+    (if (== x 0) (block (return (top-expr 1))))
+    (if (== x 1) (return (top-expr 10)))
+    (return (top-expr (call sum (params x))))))
+(function main (params) (block
+    (return (top-expr (+ (+ (+ (call pick (params 0)) (call pick (params 1)))
+        (call pick (params 7))) 14))))))
+*/
+//RET 46
+//FLAGS -g -funroll
+//ASM .file 1 "tests/029.c"
+//ASM .type sum, @function
+//ASM sum:
+//ASM .loc 1 58
+//ASM .cfi_startproc
+//ASM .cfi_def_cfa_register rbp
+//ASM .loc 1 65
+//ASM .cfi_remember_state
+//ASM .cfi_restore_state
+//ASM .cfi_endproc
+//ASM .size sum, .-sum
+//ASM pick:
+//ASM .loc 1 72
+// Each statement says which line it comes from, even after a comment
+/* spanning
+   a few lines */
+int sum(int n) {
+    int total = 0;
+    int i = 0;
+    while (i != n) {
+        total = total + i;
+        i = i + 1;
+    }
+    return total;
+}
+int pick(int x) {
+    if (x == 0) {
+        return 1;
+    }
+    // Each return has to leave the frame as it was for the code after it
+    if (x == 1) return 10;
+    return sum(x);
+}
+int main() {
+    return pick(0) + pick(1) + pick(7)
+        + 14;
+}
@@ -0,0 +1,215 @@
+/*LEX
+int tiny ( int x ) {
+    switch ( x ) {
+    case 1 :
+        return 3 ;
+    case - 5 :
+        return 7 ;
+    default :
+        return 1 ;
+    }
+}
+int dense ( int x ) {
+    int r = 0 ;
+    switch ( x ) {
+    case 2 :
+        r = r + 1 ;
+    case 3 :
+        r = r + 2 ;
+        break ;
+    case 4 :
+        r = 10 ;
+        break ;
+    case 5 : {
+        int y = 8 ;
+        return y * 5 ;
+    }
+    case 6 :
+        r = 20 ;
+    default :
+        r = r + 50 ;
+    }
+    return r ;
+}
+int sparse ( int x ) {
+    switch ( x ) {
+    case 1000 :
+        return 1 ;
+    case - 100 :
+        return 2 ;
+    case 3 :
+        return 3 ;
+    case 77 :
+        return 4 ;
+    case 50000 :
+        return 5 ;
+    case 9 :
+        return 6 ;
+    }
+    return 0 ;
+}
+int count ( int n ) {
+    int total = 0 ;
+    int i = 0 ;
+    while ( i != n ) {
+        i = i + 1 ;
+        switch ( i % 4 ) {
+        case 0 :
+            continue ;
+        case 1 :
+            total = total + 1 ;
+            break ;
+        default :
+            total = total + 2 ;
+        }
+        total = total + 10 ;
+    }
+    return total ;
+}
+int main ( ) {
+    int total = dense ( 2 ) + dense ( 3 ) + dense ( 4 ) + dense ( 5 )
+        + dense ( 6 ) ;
+    total = total + dense ( - 1 ) + tiny ( 1 ) + tiny ( - 5 ) + tiny ( 2 ) ;
+    total = total + sparse ( - 100 ) + sparse ( 50000 ) + sparse ( 9 )
+        + sparse ( 10 ) ;
+    return total + count ( 4 ) ;
+}
+*/
+/*AST
+(top-level
+(function tiny (params x) (block
+    (switch x
+        (case 1) (return (top-expr 3))
+        (case -5) (return (top-expr 7))
+        (default) (return (top-expr 1)))))
+(function dense (params x) (block
+    (declaration (declare r 0))
+    (switch x
+        (case 2) (expr-statement (top-expr (= r (+ r 1))))
+        (case 3) (expr-statement (top-expr (= r (+ r 2)))) (break)
+        (case 4) (expr-statement (top-expr (= r 10))) (break)
+        (case 5) (block
+            (declaration (declare y 8))
+            (return (top-expr (* y 5))))
+        (case 6) (expr-statement (top-expr (= r 20)))
+        (default) (expr-statement (top-expr (= r (+ r 50)))))
+    (return (top-expr r))))
+(function sparse (params x) (block
+    (switch x
+        (case 1000) (return (top-expr 1))
+        (case -100) (return (top-expr 2))
+        (case 3) (return (top-expr 3))
+        (case 77) (return (top-expr 4))
+        (case 50000) (return (top-expr 5))
+        (case 9) (return (top-expr 6)))
+    (return (top-expr 0))))
+(function count (params n) (block
+    (declaration (declare total 0))
+    (declaration (declare i 0))
+    (while (!= i n) (block
+        (expr-statement (top-expr (= i (+ i 1))))
+        (switch (% i 4)
+            (case 0) (continue)
+            (case 1) (expr-statement (top-expr (= total (+ total 1)))) (break)
+            (default) (expr-statement (top-expr (= total (+ total 2)))))
+        (expr-statement (top-expr (= total (+ total 10))))))
+    (return (top-expr total))))
+(function main (params) (block
+    (declaration (declare total (+ (+ (+ (+ (call dense (params 2))
+        (call dense (params 3))) (call dense (params 4)))
+        (call dense (params 5))) (call dense (params 6)))))
+    (expr-statement (top-expr (= total (+ (+ (+ (+ total
+        (call dense (params (- 1)))) (call tiny (params 1)))
+        (call tiny (params (- 5)))) (call tiny (params 2))))))
+    (expr-statement (top-expr (= total (+ (+ (+ (+ total
+        (call sparse (params (- 100)))) (call sparse (params 50000)))
+        (call sparse (params 9))) (call sparse (params 10))))))
+    (return (top-expr (+ total (call count (params 4))))))))
+*/
+//RET 234
+//ASM sub eax, 2
+//ASM cmp eax, 4
+//ASM jmp rax
+//ASM .pushsection .rodata
+//ASM .long .dense.1 - .dense.7
+//ASM .long .dense.5 - .dense.7
+//ASM cmp eax, 77
+//ASM jl .sparse.7
+//ASM .sparse.7:
+// Few cases are compared one by one
+int tiny(int x) {
+    switch (x) {
+    case 1:
+        return 3;
+    case -5:
+        return 7;
+    default:
+        return 1;
+    }
+}
+// Dense cases jump through a table, and fall through unless they break
+int dense(int x) {
+    int r = 0;
+    switch (x) {
+    case 2:
+        r = r + 1;
+    case 3:
+        r = r + 2;
+        break;
+    case 4:
+        r = 10;
+        break;
+    case 5: {
+        int y = 8;
+        return y * 5;
+    }
+    case 6:
+        r = 20;
+    default:
+        r = r + 50;
+    }
+    return r;
+}
+// Sparse cases are found by a binary search
+int sparse(int x) {
+    switch (x) {
+    case 1000:
+        return 1;
+    case -100:
+        return 2;
+    case 3:
+        return 3;
+    case 77:
+        return 4;
+    case 50000:
+        return 5;
+    case 9:
+        return 6;
+    }
+    return 0;
+}
+// A break leaves the switch, but a continue restarts the loop around it
+int count(int n) {
+    int total = 0;
+    int i = 0;
+    while (i != n) {
+        i = i + 1;
+        switch (i % 4) {
+        case 0:
+            continue;
+        case 1:
+            total = total + 1;
+            break;
+        default:
+            total = total + 2;
+        }
+        total = total + 10;
+    }
+    return total;
+}
+int main() {
+    int total = dense(2) + dense(3) + dense(4) + dense(5) + dense(6);
+    total = total + dense(-1) + tiny(1) + tiny(-5) + tiny(2);
+    total = total + sparse(-100) + sparse(50000) + sparse(9) + sparse(10);
+    return total + count(4);
+}
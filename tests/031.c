@@ -0,0 +1,150 @@
+/*LEX
+int scopes ( int x ) {
+    int result = 0 ;
+    {
+        int a = x + 1 ;
+        result = result + a ;
+    }
+    {
+        int b = x + 2 ;
+        result = result + b * 2 ;
+    }
+    return result ;
+}
+int carried ( int n ) {
+    int last ;
+    int sum = 0 ;
+    int i = 0 ;
+    while ( i != n ) {
+        if ( i != 0 ) {
+            sum = sum + last ;
+        }
+        last = i * i ;
+        int step = 1 ;
+        i = i + step ;
+    }
+    return sum ;
+}
+int ignore ( int a , int c , int b ) {
+    int d = c ;
+    d = a ;
+    return b ;
+}
+int value ( int x ) {
+    int y ;
+    return y = x + 1 ;
+}
+int depth ( int n ) {
+    int twice = n * 2 ;
+    if ( n == 0 ) {
+        return 0 ;
+    }
+    return depth ( n - 1 ) + 1 ;
+}
+int main ( ) {
+    return scopes ( 3 ) + carried ( 5 ) + ignore ( 1 , 3 , 2 ) + value ( 4 )
+        + depth ( 100 ) ;
+}
+*/
+/*AST
+(top-level
+(function scopes (params x) (block
+    (declaration (declare result 0))
+    (block
+        (declaration (declare a (+ x 1)))
+        (expr-statement (top-expr (= result (+ result a)))))
+    (block
+        (declaration (declare b (+ x 2)))
+        (expr-statement (top-expr (= result (+ result (* b 2))))))
+    (return (top-expr result))))
+(function carried (params n) (block
+    (declaration (declare last))
+    (declaration (declare sum 0))
+    (declaration (declare i 0))
+    (while (!= i n) (block
+        (if (!= i 0) (block (expr-statement (top-expr (= sum (+ sum last))))))
+        (expr-statement (top-expr (= last (* i i))))
+        (declaration (declare step 1))
+        (expr-statement (top-expr (= i (+ i step))))))
+    (return (top-expr sum))))
+(function ignore (params a c b) (block
+    (declaration (declare d c))
+    (expr-statement (top-expr (= d a)))
+    (return (top-expr b))))
+(function value (params x) (block
+    (declaration (declare y))
+    (return (top-expr (= y (+ x 1))))))
+(function depth (params n) (block
+    (declaration (declare twice (* n 2)))
+    (if (== n 0) (block (return (top-expr 0))))
+    (return (top-expr (+ (call depth (params (- n 1))) 1)))))
+(function main (params) (block
+    (return (top-expr (+ (+ (+ (+ (call scopes (params 3))
+        (call carried (params 5))) (call ignore (params 1 3 2)))
+        (call value (params 4))) (call depth (params 100))))))))
+*/
+//RET 135
+//ASM scopes:
+//ASM sub rsp, 16
+//ASM mov DWORD PTR [rbp - 12], eax
+//ASM mov DWORD PTR [rbp - 4], eax
+//ASM .size scopes, .-scopes
+//ASM carried:
+//ASM sub rsp, 32
+//ASM mov DWORD PTR [rbp - 8], eax
+//ASM mov DWORD PTR [rbp - 20], eax
+//ASM .size carried, .-carried
+//ASM ignore:
+//ASM sub rsp, 16
+//ASM mov DWORD PTR [rbp - 4], edx
+//ASM mov eax, DWORD PTR [rbp - 4]
+//ASM .size ignore, .-ignore
+// Variables whose values are never needed at the same time share a slot
+int scopes(int x) {
+    int result = 0;
+    {
+        int a = x + 1;
+        result = result + a;
+    }
+    {
+        int b = x + 2;
+        result = result + b * 2;
+    }
+    return result;
+}
+// `last` is read before it's written in each iteration, so it needs its own
+// slot for the whole loop, even though `step` is only used after it
+int carried(int n) {
+    int last;
+    int sum = 0;
+    int i = 0;
+    while (i != n) {
+        if (i != 0) {
+            sum = sum + last;
+        }
+        last = i * i;
+        int step = 1;
+        i = i + step;
+    }
+    return sum;
+}
+// Nothing reads `a`, `c` or `d`, so they don't need slots
+int ignore(int a, int c, int b) {
+    int d = c;
+    d = a;
+    return b;
+}
+int value(int x) {
+    int y;
+    return y = x + 1;
+}
+int depth(int n) {
+    int twice = n * 2;
+    if (n == 0) {
+        return 0;
+    }
+    return depth(n - 1) + 1;
+}
+int main() {
+    return scopes(3) + carried(5) + ignore(1, 3, 2) + value(4) + depth(100);
+}
@@ -0,0 +1,137 @@
+// Checks libcici, compiling and running the golden tests from several threads
+// at once, each with its own context.
+//
+// Usage: libtest <threads> <tests>...
+#include "../../cici.h"
+#include "pthread.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+typedef struct Test {
+    char *source;
+    size_t length;
+    int expected;
+    char const *path;
+    // The options from the //FLAGS line, if any
+    char *flags[8];
+    int flag_count;
+} Test;
+
+Test *tests;
+int test_count;
+
+char *read_all(char const *path, size_t *length) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = malloc(*length + 1);
+    *length = fread(data, 1, *length, fp);
+    data[*length] = 0;
+    fclose(fp);
+    return data;
+}
+
+// Returns the number of failures
+void *run_tests(void *arg) {
+    (void)arg;
+    long failures = 0;
+    CiciContext *ctx = cici_new();
+    // Errors shouldn't stop the process, or break the context
+    char const *broken = "int main() { return 1 +; }";
+    if (cici_compile(ctx, broken, strlen(broken)) == 0 ||
+        strstr(cici_error(ctx), "Unexpected Token") == NULL) {
+        printf("Expected an error from a broken program, got '%s'\n",
+               cici_error(ctx));
+        ++failures;
+    }
+    for (int i = 0; i < test_count; ++i) {
+        Test *test = tests + i;
+        int result;
+        size_t size;
+        // Tests with flags get their own context, so the others don't see
+        // them. Flags the library doesn't know, like -j, are for the driver.
+        CiciContext *shared = ctx;
+        if (test->flag_count > 0) {
+            ctx = cici_new();
+            for (int j = 0; j < test->flag_count; ++j) {
+                cici_option(ctx, test->flags[j]);
+            }
+        }
+        if (cici_compile(ctx, test->source, test->length) != 0 ||
+            strstr(cici_output(ctx, &size), ".intel_syntax") == NULL) {
+            printf("%s: failed to compile\n%s", test->path, cici_error(ctx));
+            ++failures;
+        }
+        if (cici_run(ctx, test->source, test->length, &result) != 0 ||
+            result != test->expected) {
+            printf("%s: returned %d, expected %d\n%s", test->path, result,
+                   test->expected, cici_error(ctx));
+            ++failures;
+        }
+        if (ctx != shared) {
+            cici_free(ctx);
+            ctx = shared;
+        }
+    }
+    cici_free(ctx);
+    return (void *)failures;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        puts("Usage: libtest <threads> <tests>...");
+        return 1;
+    }
+    int thread_count = atoi(argv[1]);
+    test_count = argc - 2;
+    tests = malloc(test_count * sizeof(Test));
+    for (int i = 0; i < test_count; ++i) {
+        Test *test = tests + i;
+        test->path = argv[i + 2];
+        test->source = read_all(test->path, &test->length);
+        if (test->source == NULL) {
+            printf("Failed to read %s\n", test->path);
+            return 1;
+        }
+        char *ret = strstr(test->source, "//RET");
+        test->expected = ret == NULL ? 0 : atoi(ret + 5);
+        test->flag_count = 0;
+        char *flags = strstr(test->source, "//FLAGS");
+        if (flags != NULL) {
+            size_t length = strcspn(flags + 7, "\n");
+            char *line = strndup(flags + 7, length);
+            char *flag = strtok(line, " ");
+            for (; flag != NULL && test->flag_count < 8;
+                 flag = strtok(NULL, " ")) {
+                test->flags[test->flag_count++] = strdup(flag);
+            }
+            free(line);
+        }
+    }
+    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_create(threads + i, NULL, run_tests, NULL);
+    }
+    long failures = 0;
+    for (int i = 0; i < thread_count; ++i) {
+        void *result;
+        pthread_join(threads[i], &result);
+        failures += (long)result;
+    }
+    printf("%d tests on %d threads, %ld failures\n", test_count, thread_count,
+           failures);
+    for (int i = 0; i < test_count; ++i) {
+        free(tests[i].source);
+        for (int j = 0; j < tests[i].flag_count; ++j) {
+            free(tests[i].flags[j]);
+        }
+    }
+    free(tests);
+    free(threads);
+    return failures != 0;
+}